@@ -29,6 +29,13 @@
 // Uncomment this line if you're using this shield as gateway
 #define WEMOS_LORA_GW
 
+// The shield has its RGB leds on GPIO0. That pin can only be driven by bit bang,
+// which keeps interrupts off for about 30 uSec per led on every led update.
+// To drive the leds without that, the led data line has to be rewired (hardware
+// change, see README) to GPIO3 (RX, serial input is lost) or GPIO2 (D4, must not
+// be pulled low at boot), and the pin set here:
+//#define RGB_LED_PIN  3
+
 /*******************************************************************************
  *
  * Configure these values if necessary!
@@ -47,6 +54,8 @@
 
  // Set the Gateway Settings
  #define _SPREADING  SF9						// We receive and sent on this Spreading Factor (only)
+ #define _CAD        0							// 1: scan SF7-SF12 with Channel Activity Detection
+														//    and receive on the SF that was detected
  #define _LOCUDPPORT 1700						// Often 1701 is used for upstream comms
 
  // The Gateway Listen frequency is set on loramodem.h.
@@ -55,6 +64,26 @@
  #define _STAT_INTERVAL 61						// Send a 'stat' message to server
  #define _NTP_INTERVAL  3600					// How often doe we want time NTP synchronization
 
+ // Batching of received frames in one PUSH_DATA message
+ #define _BATCH_MAX     4						// Max frames in one PUSH_DATA (1 sends every frame directly)
+ #define _BATCH_BYTES   1400					// Max PUSH_DATA size, stay below the WiFi MTU
+ #define _BATCH_LINGER  50						// Max time (ms) the first frame waits for others
+ #define _BATCH_STAT    1						// Send the stat object along with a pending batch
+
+ #define _ACK_RETRY     1						// Resend a PUSH_DATA once when the server did not ACK it
+ #define _JOURNAL       1						// Store undelivered PUSH_DATA on SPIFFS and send it later
+
+ // WiFi connection management, see process_WiFi()
+ #define _WIFI_CONNECT_MS  15000				// Time for one AP to connect before trying the next
+ #define _WIFI_BACKOFF_MIN 500					// Pause (ms) between two connection attempts
+ #define _WIFI_BACKOFF_MAX 60000				// Max pause after failed rounds over all APs
+ #define _WIFI_AP_ROUNDS   2					// Start our own AP after this many failed rounds
+ #define _WIFI_SETUP_MS    20000				// Max time setup() waits for the first connection
+
+ // Latency histograms of the loop tasks and the uplink/downlink hot path, see prof.h
+ #define _PROFILE       1						// 0 compiles all measurements out
+ #define _UPTRACE_JSON  0						// 1: add the uplink stage times to rxpk as "gwtrace"
+
 // TTN Server definitions
 //#define _TTNSERVER "croft.thethings.girovito.nl"
 //#define _TTNSERVER "router.eu.thethings.network"
@@ -70,6 +99,11 @@
 #define SERVER2 _UDPSERVER
 #define PORT2   1700
 
+// More servers can be added, see upstream.cpp. Each one uses its own local
+// UDP port: _LOCUDPPORT, _LOCUDPPORT+1, ...
+//#define SERVER3 "staging.example.net"
+//#define PORT3   1700
+
 // Gateway Ident definitions
 #define _DESCRIPTION "ESP Gateway"
 #define _EMAIL "set@email.com"
@@ -109,14 +143,16 @@
 // Definitions for the admin webserver
 #define A_SERVER   1      // Define local WebServer only if this define is set
 #define SERVERPORT 8080   // local webserver port
+#define WEB_CHUNK  1024   // The status page is sent in pieces of about this size
 
 #define A_MAXBUFSIZE 192  // Must be larger than 128, but small enough to work
 #define _BAUDRATE 460800  // Works for debug messages to serial momitor (if attached).
 
 // ntp
 #define NTP_TIMESERVER "pt.pool.ntp.org"  // Country and region specific
-#define NTP_INTERVAL  3600  // How often doe we want time NTP synchronization
-#define NTP_TIMEZONES 1     // How far is our Timezone from UTC (excl daylight saving/summer time)
+#define NTP_INTERVAL  64    // Seconds between NTP polls, short enough to follow the crystal drift
+#define NTP_LOCALPORT 2390  // Local UDP port for NTP, the servers use _LOCUDPPORT and up
+#define NTP_TIMEZONES 1     // How far is our Timezone from UTC (excl daylight saving/summer time), display only
 
 #define OLED_DISPLAY 1      // Enable the Wemos OLED Display shield usage: 1-> ON   0-> Not connected
 // For OLED settings see OLEDDisplay.h file
@@ -1,9 +1,21 @@
 // Support for Wemos Oled display
+//
+// The display is retained: OLEDDisplay_Animate() only draws a new frame when
+// one of the widgets (clock, RSSI icon, Rx/Ok counters, IP) changed, and
+// oledFlush() only sends the columns of each page that differ from what the
+// display already shows, at most OLED_FPS times per second.
+// A full oled.display() costs 6 x (3 commands + 64 data bytes), every
+// command and data byte is one I2C transaction of 3 bytes (address, control
+// byte, value). The counters compare that with what was really sent. The old
+// code sent a full frame every OLED_BASE_MS and for every boot text, so
+// oledBytesFull counts one frame per OLED_BASE_MS of animation time and one
+// per boot text; both counters then cover the same time.
 #include <Arduino.h>
 #include <Wire.h>
 #include <SFE_MicroOLED.h>
 #include "OLEDDisplay.h"
 #include "loraModem.h"
+#include "gwStats.h"
 
 MicroOLED oled(OLED_PIN_RESET, OLED_I2C_ADR);
 
@@ -20,11 +32,9 @@ uint32_t OL_LORA_rx_bad;
 uint32_t OL_LORA_rx_nocrc;
 uint32_t OL_LORA_pkt_fwd;
 
-uint32_t displayseconds;
-
 int cycledisplay = 0;
-String gwIP = "10.1.1.1";
-String gwBR = "460800";
+uint32_t gwIP = 0;
+const char *gwBR = "460800";
 
 const char *Cday;
 int Chour;
@@ -33,48 +43,107 @@ int Csecond;
 long CRSSI;
 bool beat = true;
 
+// What the widgets showed in the last frame
+struct OledView {
+  uint8_t  screen;
+  int8_t   hour;
+  int8_t   minute;
+  bool     beat;
+  uint8_t  icon;
+  uint32_t rx;
+  uint32_t ok;
+  uint32_t ip;
+};
+OledView oledView;
+bool     oledDirty = true;                  // Screen buffer differs from oledShown
+
+uint8_t  oledShown[OLED_PAGES * OLED_COLUMNS];  // What the display shows now
+uint32_t oledLastFlush = 0;
+
+#define OLED_I2C_COST  3                    // Bytes on the bus per command or data byte
+#define OLED_FRAME_COST (OLED_PAGES * (3 + OLED_COLUMNS) * OLED_I2C_COST)
+#define OLED_BASE_MS   1000                 // Full frame period of the old code
+
+uint32_t oledFrames = 0;
+uint32_t oledBytesFull = 0;                 // What the old full frames would have cost
+uint32_t oledBaseLast = 0;                  // millis() of the last counted old frame
+uint32_t oledBytesSent = 0;
+uint32_t oledRateStart = 0;
+uint32_t oledRateFullBase = 0;
+uint32_t oledRateSentBase = 0;
+uint32_t oledRateFull = 0;                  // Bytes/s over the last OLED_RATE_S window
+uint32_t oledRateSent = 0;
+
 void OLED_getLoraStats() {
-  OL_LORA_rx_rcv   = getLoraRXRCV();
-  OL_LORA_rx_ok    = getLoraRXOK();
-  OL_LORA_rx_bad   = getLoraRXBAD();
-  OL_LORA_rx_nocrc = getLoraRXNOCRC();
-  OL_LORA_pkt_fwd  = getLoraPKTFWD();
+  OL_LORA_rx_rcv   = statTotal(ST_RX_RCV);
+  OL_LORA_rx_ok    = statTotal(ST_RX_OK);
+  OL_LORA_rx_bad   = statTotal(ST_RX_BAD);
+  OL_LORA_rx_nocrc = statTotal(ST_RX_NOCRC);
+  OL_LORA_pkt_fwd  = statTotal(ST_RX_FWD);
 }
 
-void OLED_setIP2Display(String ip) {
+void OLED_setIP2Display(uint32_t ip) {
   gwIP = ip;
 }
 
+// Send the changed columns of every page, compared with oledShown
+void oledFlush() {
+  for (int page=0; page<OLED_PAGES; page++) {
+    uint8_t *now = screen + page * OLED_COLUMNS;
+    uint8_t *was = oledShown + page * OLED_COLUMNS;
+    int first = 0;
+    int last = OLED_COLUMNS - 1;
+    while ((first <= last) && (now[first] == was[first])) first++;
+    if (first > last) continue;                   // Page did not change
+    while (now[last] == was[last]) last--;
+
+    oled.setPageAddress(page);
+    oled.setColumnAddress(first);
+    for (int i=first; i<=last; i++) oled.data(now[i]);
+    memcpy(was + first, now + first, last - first + 1);
+    oledBytesSent += (3 + last - first + 1) * OLED_I2C_COST;
+  }
+  oledFrames++;
+  oledLastFlush = millis();
+  oledDirty = false;
+}
+
 void OLEDDisplay_Init() {
   oled.begin();
   oled.clear(ALL);
-  oled.display();
+  oled.display();                           // Display RAM is unknown, send it all once
   oled.clear(PAGE);
 
   screen = oled.getScreenBuffer();
-
+  memset(oledShown, 0, sizeof(oledShown));
+  oledView.screen = 0xFF;                   // Draw the first frame
+  oledRateStart = millis();
+  oledBaseLast = oledRateStart;
 }
 
 void OLEDDisplay_Clear() {
-  oled.clear(ALL);
-  oled.display();
   oled.clear(PAGE);
+  oledFlush();
+  oledBytesFull += OLED_FRAME_COST;         // The old code sent a full frame here
+  oledView.screen = 0xFF;
 }
 
 void OLEDDisplay_println(const char *str) {
   oled.println(str);
-  oled.display();
+  oledFlush();
+  oledBytesFull += OLED_FRAME_COST;         // The old code sent a full frame here
+  oledView.screen = 0xFF;                   // Boot text, redraw the widgets later
 }
 
 void OLEDDisplay_printxy(int x, int y, const char *str) {
   oled.setCursor( x, y);
   oled.println(str);
-  oled.display();
+  oledFlush();
+  oledBytesFull += OLED_FRAME_COST;         // The old code sent a full frame here
+  oledView.screen = 0xFF;                   // Boot text, redraw the widgets later
 }
 
 void OLEDDisplay_Status() {
-  OLED_getLoraStats();
-
   oled.setCursor(0,8);
   oled.print("Rx: ");
   oled.println(OL_LORA_rx_rcv);
@@ -91,7 +160,7 @@ void OLEDDisplay_IPBD() {
   oled.setCursor(0,0);
   oled.print("IP: ");
   oled.setCursor(0,8);
-  oled.println(gwIP);
+  oled.println(IPAddress(gwIP));
   oled.setCursor(0,24);
   oled.println("BaudRate:");
   oled.println(gwBR);
@@ -122,25 +191,20 @@ const int wBad[] = { 0x43 , 0x44 , 0x02 , 0x74 , 0x73 , 0x00 , 0x00, 0x00};
 const int wVBad1[] = { 0x43 , 0x44 , 0x02 , 0x04 , 0x03 , 0x00 , 0x00, 0x5C};
 const int wVBad2[] = { 0x43 , 0x44 , 0x02 , 0x04 , 0x03 , 0x00 , 0x00, 0x00};
 
+const int *wIcons[] = { wGood, wOk, wBad, wVBad1, wVBad2 };
+
+// Index in wIcons for the current RSSI
+uint8_t OLEDRSSI_Level() {
+  if ( CRSSI > - 65 ) return(0);
+  if ( CRSSI > -70 ) return(1);
+  if ( CRSSI > -80 ) return(2);
+  return( beat ? 3 : 4 );
+}
+
 void OLEDRSSI_Icon() {
   int pos = 56 ; // Byte position for icon
   int i , j = 0;
-  int *graph;
-
-
-  if ( CRSSI > - 65 )
-    graph = (int *)&wGood;
-  else
-    if ( CRSSI > -70 )
-      graph = (int *)&wOk;
-    else
-      if ( CRSSI > -80 )
-        graph = (int *)&wBad;
-      else
-        if ( beat )
-          graph = (int *)&wVBad1;
-        else
-          graph = (int *)&wVBad2;
+  const int *graph = wIcons[oledView.icon];
 
   for ( i = pos ; i < pos+8 ; i++  ) { // Right now the icon is on the top right (i=72)
     screen[i] = graph[j];
@@ -151,32 +215,56 @@ void OLEDRSSI_Icon() {
 
 
 void OLEDDisplay_Animate() {
-  uint32_t nowseconds = (uint32_t) millis() /1000;
-
-  nowseconds = (uint32_t) millis() /1000;
-  if (nowseconds - displayseconds >= 1 ) {		// Wake up every xx seconds
-        if ( cycledisplay == 0 ) {
-          oled.clear(PAGE);
-
-          OLEDRSSI_Icon();
-          OLEDDisplay_Time();
-
-          OLEDDisplay_Status();
-          oled.display();
-        } else {
-          oled.clear(PAGE);
-          OLEDDisplay_IPBD();
-          oled.display();
-        }
-        cycledisplay++;
-        cycledisplay = cycledisplay % 2;
-
-        displayseconds = nowseconds;
+  uint32_t now = millis();
+  OledView view;
+
+  // Bytes per second, before (a full frame per OLED_BASE_MS) and after
+  // (changed columns only)
+  uint32_t base = (now - oledBaseLast) / OLED_BASE_MS;
+  oledBytesFull += base * OLED_FRAME_COST;
+  oledBaseLast += base * OLED_BASE_MS;
+  if (now - oledRateStart >= OLED_RATE_S * 1000) {
+    oledRateFull = (oledBytesFull - oledRateFullBase) / OLED_RATE_S;
+    oledRateSent = (oledBytesSent - oledRateSentBase) / OLED_RATE_S;
+    oledRateFullBase = oledBytesFull;
+    oledRateSentBase = oledBytesSent;
+    oledRateStart = now;
   }
 
-  beat = !beat;
-  yield();
+  // The state of every widget, a new frame is only drawn when it changed
+  beat = ((now / 1000) & 1) == 0;
+  cycledisplay = (now / (OLED_CYCLE_S * 1000)) % 2;
+  OLED_getLoraStats();
 
+  memset(&view, 0, sizeof(view));
+  view.screen = cycledisplay;
+  if ( cycledisplay == 0 ) {
+    view.hour   = Chour;
+    view.minute = Cminute;
+    view.beat   = beat;
+    view.icon   = OLEDRSSI_Level();
+    view.rx     = OL_LORA_rx_rcv;
+    view.ok     = OL_LORA_rx_ok;
+  } else {
+    view.ip     = gwIP;
+  }
+
+  if (memcmp(&view, &oledView, sizeof(view)) != 0) {
+    memcpy(&oledView, &view, sizeof(view));
+    oled.clear(PAGE);
+    if ( cycledisplay == 0 ) {
+      OLEDRSSI_Icon();
+      OLEDDisplay_Time();
+      OLEDDisplay_Status();
+    } else {
+      OLEDDisplay_IPBD();
+    }
+    oledDirty = true;
+  }
+
+  if (oledDirty && (now - oledLastFlush >= 1000 / OLED_FPS)) {
+    oledFlush();
+  }
 }
 
 void OLEDDisplay_SetTime(const char* day, int hour, int min ) {
@@ -189,3 +277,9 @@ void OLEDDisplay_SetTime(const char* day, int hour, int min ) {
 void OLEDDisplay_SetRSSI(long RSSI) {
   CRSSI = RSSI;
 }
+
+uint32_t OLEDDisplay_Frames()    { return(oledFrames); }
+uint32_t OLEDDisplay_BytesFull() { return(oledBytesFull); }
+uint32_t OLEDDisplay_BytesSent() { return(oledBytesSent); }
+uint32_t OLEDDisplay_RateFull()  { return(oledRateFull); }
+uint32_t OLEDDisplay_RateSent()  { return(oledRateSent); }
@@ -1,6 +1,12 @@
 #define OLED_I2C_ADR 0      // I2C OLED display Address: 0 -> 0x3C (default) 1 - 0x3D
 #define OLED_PIN_RESET 255  // Reset pin not used
 
+#define OLED_PAGES   6      // 64x48 display: 6 pages of 8 pixel rows
+#define OLED_COLUMNS 64
+#define OLED_FPS     2      // Max frames per second sent over I2C
+#define OLED_CYCLE_S 10     // Seconds between the status and the IP screen
+#define OLED_RATE_S  10     // Window (s) of the I2C bytes per second counters
+
 void OLEDDisplay_Init( void );
 void OLEDDisplay_Clear(void);
 void OLEDDisplay_println(const char *str);
@@ -10,4 +16,10 @@ void OLEDDisplay_Animate( void );
 void OLEDDisplay_SetTime(const char*, int, int );
 void OLEDDisplay_SetRSSI(long);
 
-void OLED_setIP2Display(String ip);
+void OLED_setIP2Display(uint32_t ip);
+
+uint32_t OLEDDisplay_Frames( void );
+uint32_t OLEDDisplay_BytesFull( void );
+uint32_t OLEDDisplay_BytesSent( void );
+uint32_t OLEDDisplay_RateFull( void );
+uint32_t OLEDDisplay_RateSent( void );
@@ -14,12 +14,15 @@
 // **********************************************************************************
 
 #include "RGBLed.h"
+#include "prof.h"
 
 #ifdef WEMOS_LORA_GW
 
 MyPixelBus rgb_led(RGB_LED_COUNT, RGB_LED_PIN);
 uint8_t rgb_luminosity = 20 ; // Luminosity from 0 to 100% 
 uint16_t wifi_led_color ; // Wifi Led Color dependinf on connexion type
+uint32_t rgb_last_tick = 0; // millis() of the last animation frame
+uint32_t rgb_coalesced = 0; // Events merged into a running one
 
 // one entry per pixel to match the animation timing manager
 NeoPixelAnimator animations(RGB_LED_COUNT); 
@@ -96,10 +99,15 @@ void LedRGBAnimate(bool force)
 {
   static unsigned long ctx;
 
+  // Frames are only computed at the animation tick
+  if ( !force && (millis() - rgb_last_tick < RGB_ANIM_TICK_MS) )
+    return;
+  rgb_last_tick = millis();
+
   if ( animations.IsAnimating() && !force ) {
     // the normal loop just needs these two to run the active animations
     animations.UpdateAnimations();
-    rgb_led.Show();
+    LedRGBShow();
 
   } else {
 
@@ -123,6 +131,7 @@ void LedRGBAnimate(bool force)
           // Stop this animation
           animationState[i].RgbEffectState=RGB_ANIM_NONE;
           animationState[i].AnimTime=0;
+          animationState[i].EventHue=0;
           animations.StopAnimation(i);
           restart = false;
           //Debugf(" Stopping effect=%d", animationState[i].RgbEffectState );
@@ -165,7 +174,58 @@ void LedRGBAnimate(bool force)
       }
       //Debugf("%d Animation(%d) restart=%d, duration=%ld, count=%d, effect=%d\r\n", ctx, i, restart, animationState[i].AnimTime,  animationState[i].AnimCount, animationState[i].RgbEffectState );
     }
+    LedRGBShow();
+  }
+}
+
+/* ======================================================================
+Function: LedRGBShow
+Purpose : Send the led colors when one of them changed
+Input   : -
+Output  : - 
+Comments: RGB_LED_IRQ_OFF is only defined for the bit bang method
+          (RGB_LED_PIN not 3 or 2, so on an unmodified shield). Then the
+          measured time (profiler stage "led show") is the time interrupts
+          were off; with DMA or UART1 Show() only starts the transfer
+====================================================================== */
+void LedRGBShow()
+{
+  if ( !rgb_led.IsDirty() )
+    return;
+
+  PROF_START(cycles);
+  rgb_led.Show();
+  PROF_END(PROF_LEDSHOW, cycles);
+}
+
+/* ======================================================================
+Function: LedRGBEvent
+Purpose : Flash a led in a color and fade it out, for a packet event
+Input   : Hue of LED (0..360)
+          led number (from 1 to ...)
+Output  : - 
+Comments: an event of the same color while the previous one is still
+          fading is merged into it, the animation is not restarted
+====================================================================== */
+void LedRGBEvent(uint16_t hue, uint16_t led)
+{
+  MyAnimationState *state = &animationState[led - 1];
+
+  if ( state->EventHue == hue + 1 ) {
+    state->EventCount++;
+    rgb_coalesced++;
+    return;
   }
+
+  LedRGBON(hue, led, true);
+  LedRGBSetAnimation(RGB_EVENT_MS, led, 1, RGB_ANIM_FADE_OUT);
+  state->EventHue   = hue + 1;
+  state->EventCount = 0;
+}
+
+uint32_t LedRGBCoalesced()
+{
+  return(rgb_coalesced);
 }
 
 /* ======================================================================
@@ -243,8 +303,7 @@ void LedRGBON (uint16_t hue, uint16_t led, bool doitnow)
       // Stop animation
       animations.StopAnimation(i);
       animationState[i].RgbEndingColor  = RgbColor(0);
-      rgb_led.SetPixelColor(i, target);
-      rgb_led.Show();  
+      rgb_led.SetPixelColor(i, target);   // Sent at the next animation tick
     }
   }
 }
@@ -275,10 +334,11 @@ void LedRGBOFF(uint16_t led)
     animationState[i].RgbEndingColor   = RgbColor(0);
     animationState[i].RgbNoEffectColor = RgbColor(0);
     animationState[i].RgbEffectState   = RGB_ANIM_NONE;
+    animationState[i].EventHue         = 0;
 
-    // clear the led strip
-    rgb_led.SetPixelColor(i, RgbColor(0));
-    rgb_led.Show();  
+    // clear the led strip, sent at the next animation tick
+    if ( rgb_led.GetPixelColor(i) != RgbColor(0) )
+      rgb_led.SetPixelColor(i, RgbColor(0));
   }
 }
 
@@ -8,6 +8,7 @@
 // Written by Charles-Henri Hallard (http://hallard.me)
 //
 // History : V1.20 2016-06-11 - Creation
+//           Output method chosen from the pin, animation tick, coalesced events
 //
 // All text above must be included in any redistribution.
 //
@@ -53,12 +54,31 @@ RgbEffectState_e;
   #include <NeoPixelBus.h>
 
  	// RGB Led on GPIO0
-  #define RGB_LED_PIN 	0
+  #ifndef RGB_LED_PIN
+  #define RGB_LED_PIN 	0	/* As on the shield, see ESP-sc-gway.h to change */
+  #endif
   #define RGB_LED_COUNT 2
   #define RGBW_LED 	/* I'm using a RGBW WS2812 led */
 
+  // Output method. Only the bit bang method can drive GPIO0, where the
+  // shield has the leds, and it keeps interrupts off while a frame is sent
+  // (about 30 uSec per led). Only after the led data line is rewired to
+  // GPIO3 (I2S DMA) or GPIO2 (UART1) and RGB_LED_PIN is set to match, the
+  // frame is sent by the hardware and interrupts stay on.
+  #if RGB_LED_PIN == 3
+    #define RGB_LED_METHOD NeoEsp8266Dma800KbpsMethod
+  #elif RGB_LED_PIN == 2
+    #define RGB_LED_METHOD NeoEsp8266Uart1800KbpsMethod
+  #else
+    #define RGB_LED_METHOD NeoEsp8266BitBang800KbpsMethod
+    #define RGB_LED_IRQ_OFF 	/* LedRGBShow() time is interrupt-off time */
+  #endif
+
+  #define RGB_ANIM_TICK_MS 	20	/* Animation frames are computed and sent at most every tick */
+  #define RGB_EVENT_MS 	1000	/* Fade out time of a packet event */
+
   #ifdef RGBW_LED
-    typedef NeoPixelBus<NeoGrbwFeature, NeoEsp8266BitBang800KbpsMethod> MyPixelBus;
+    typedef NeoPixelBus<NeoGrbwFeature, RGB_LED_METHOD> MyPixelBus;
 
     // what is stored for state is specific to the need, in this case, the colors.
     // basically what ever you need inside the animation update function
@@ -69,10 +89,12 @@ RgbEffectState_e;
       RgbEffectState_e  RgbEffectState;  // current effect of RGB LED
       uint16_t          AnimTime;
       uint8_t           AnimCount; // Animation counter
+      uint16_t          EventHue;  // Hue+1 of the running LedRGBEvent(), 0 none
+      uint32_t          EventCount; // Events merged into the running one
       //uint8_t   IndexPixel;   // general purpose variable used to store pixel index
     };
   #else
-    typedef NeoPixelBus<NeoRgbFeature, NeoEsp8266BitBang800KbpsMethod> MyPixelBus;
+    typedef NeoPixelBus<NeoRgbFeature, RGB_LED_METHOD> MyPixelBus;
 
     // what is stored for state is specific to the need, in this case, the colors.
     // basically what ever you need inside the animation update function
@@ -83,6 +105,8 @@ RgbEffectState_e;
       RgbEffectState_e  RgbEffectState;  // current effect of RGB LED
       uint16_t          AnimTime;
       uint8_t           AnimCount; // Animation counter
+      uint16_t          EventHue;  // Hue+1 of the running LedRGBEvent(), 0 none
+      uint32_t          EventCount; // Events merged into the running one
       //uint8_t   IndexPixel;   // general purpose variable used to store pixel index
     };
   #endif
@@ -92,6 +116,9 @@ RgbEffectState_e;
 	void LedRGBSetAnimation(uint16_t duration, uint16_t led=0, uint8_t count=0, RgbEffectState_e effect=RGB_ANIM_FADE_IN);
 	void LedRGBOFF(uint16_t led=0);
 	void LedRGBON (uint16_t hue, uint16_t led=0, bool doitnow=false);
+	void LedRGBEvent(uint16_t hue, uint16_t led);
+	void LedRGBShow( void );
+	uint32_t LedRGBCoalesced( void );
 
 	extern uint16_t wifi_led_color ;
 	extern MyPixelBus rgb_led;
@@ -102,6 +129,9 @@ RgbEffectState_e;
 	inline void LedRGBSetAnimation(uint16_t d, uint16_t l=0, uint8_t c=0, RgbEffectState_e e=0) {};
 	inline void LedRGBOFF(uint16_t l=0) {};
 	inline void LedRGBON(uint16_t h, uint16_t l=0, bool n=false) {};
+	inline void LedRGBEvent(uint16_t h, uint16_t l) {};
+	inline void LedRGBShow( void ) {};
+	inline uint32_t LedRGBCoalesced( void ) { return(0); };
 #endif
 
 #endif
@@ -0,0 +1,285 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * ACK tracking of the upstream datagrams (*2, par. 3.3 and 5.3)
+ * The server answers each PUSH_DATA with a PUSH_ACK and each PULL_DATA with a
+ * PULL_ACK carrying the same token. We remember what was sent to which server
+ * and when, so the replies give us the round trip time and the ack ratio.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "ESP-sc-gway.h"
+#include "loraModem.h"
+#include "ackTrack.h"
+#include "gwStats.h"
+
+extern int debug;
+
+struct AckEntry {
+	bool     used;
+	uint8_t  ident;								// PKT_PUSH_DATA or PKT_PULL_DATA
+	uint8_t  server;							// Index in ACK_SERVERS
+	uint16_t token;
+	uint32_t sent;								// millis() of the first send
+	int8_t   copy;								// Copy slot or -1
+	bool     retried;
+};
+
+struct AckServer {
+	uint32_t pushSent;
+	uint32_t pushAcked;
+	uint32_t pullSent;
+	uint32_t pullAcked;
+	uint32_t lost;
+	uint32_t retried;
+	uint32_t ratioSent;							// PUSH_DATA since the last ackRatio()
+	uint32_t ratioAcked;
+	uint16_t rtt[ACK_RTT_SAMPLES];				// Last round trip times in ms
+	uint8_t  rttIndex;
+	uint8_t  rttCount;
+};
+
+AckEntry  ackTable[ACK_TABLE_SIZE];
+AckServer ackServer[ACK_SERVERS];
+uint32_t  ackNoMatch = 0;						// ACKs we could not match (late, duplicate)
+
+// PUSH_DATA copies for a retransmission and for the lost callback (journal).
+// Only made when _ACK_RETRY or _JOURNAL is set.
+// The same datagram goes to every server with the same token; it is copied
+// once and ackCopyPending has a bit for each server that did not ACK it yet.
+#if (_ACK_RETRY==1) || (_JOURNAL==1)
+#define ACK_COPY 1
+uint8_t  ackCopy[ACK_RETRY_SLOTS][_BATCH_BYTES];
+int      ackCopyLen[ACK_RETRY_SLOTS];
+uint16_t ackCopyToken[ACK_RETRY_SLOTS];
+uint8_t  ackCopyPending[ACK_RETRY_SLOTS];		// Bit per server, 0 is a free slot
+#endif
+
+uint16_t ackToken = 0;
+ackResend_t ackLostCb = NULL;					// lost of the last ackCheck(), for ackSent()
+
+
+// ----------------------------------------------------------------------------
+// Tokens are sequential so that every datagram in flight has its own token.
+// Start at a random value so a restart does not repeat the previous tokens.
+// ----------------------------------------------------------------------------
+uint16_t ackNextToken() {
+	if (ackToken == 0) ackToken = (uint16_t)rand() | 1;
+	return(ackToken++);
+}
+
+// ----------------------------------------------------------------------------
+// Release an entry, and its copy when no other server waits for it
+// ----------------------------------------------------------------------------
+static void ackFree(AckEntry *e) {
+#ifdef ACK_COPY
+	if (e->copy >= 0) ackCopyPending[e->copy] &= ~(1 << e->server);
+#endif
+	e->used = false;
+}
+
+// ----------------------------------------------------------------------------
+// Datagram was not acknowledged in time. When we still have a copy it is
+// passed to lost (if not NULL).
+// ----------------------------------------------------------------------------
+static void ackExpire(AckEntry *e, ackResend_t lost) {
+	ackServer[e->server].lost++;
+	if (e->ident == PKT_PUSH_DATA) ackServer[e->server].ratioSent++;
+	if (debug >= 1) {
+		Serial.print(F("ackCheck:: no ACK for token "));
+		Serial.print(e->token, HEX);
+		Serial.print(F(", server "));
+		Serial.println(e->server);
+	}
+#ifdef ACK_COPY
+	if ((lost != NULL) && (e->copy >= 0)) {
+		lost(e->server, ackCopy[e->copy], ackCopyLen[e->copy]);
+	}
+#endif
+	ackFree(e);
+}
+
+// ----------------------------------------------------------------------------
+// Record a PUSH_DATA or PULL_DATA that was sent to server.
+// The token is taken from the message header. Other messages are ignored.
+// When the table is full the oldest entry is counted as lost.
+// Returns false for a PUSH_DATA that could not be copied: it will not be
+// resent and the lost callback will not get it.
+// ----------------------------------------------------------------------------
+bool ackSent(int server, uint8_t *msg, int length) {
+	uint8_t ident = msg[3];
+	if ((ident != PKT_PUSH_DATA) && (ident != PKT_PULL_DATA)) return(true);
+	if ((server < 0) || (server >= ACK_SERVERS)) return(true);
+
+	AckEntry *e = NULL;
+	AckEntry *oldest = &ackTable[0];
+	for (int i=0; i<ACK_TABLE_SIZE; i++) {
+		if (!ackTable[i].used) { e = &ackTable[i]; break; }
+		if ((int32_t)(ackTable[i].sent - oldest->sent) < 0) oldest = &ackTable[i];
+	}
+	if (e == NULL) {
+		ackExpire(oldest, ackLostCb);
+		e = oldest;
+	}
+
+	e->used    = true;
+	e->ident   = ident;
+	e->server  = server;
+	e->token   = msg[1] | (msg[2] << 8);
+	e->sent    = millis();
+	e->copy    = -1;
+	e->retried = false;
+
+	if (ident == PKT_PUSH_DATA) {
+		ackServer[server].pushSent++;
+		statInc(ST_UP_PUSH);
+	}
+	else ackServer[server].pullSent++;
+
+#ifdef ACK_COPY
+	if ((ident == PKT_PUSH_DATA) && (length <= _BATCH_BYTES)) {
+		int slot = -1;
+		for (int i=0; i<ACK_RETRY_SLOTS; i++) {
+			if (ackCopyPending[i] == 0) {
+				if (slot < 0) slot = i;
+			}
+			else if ((ackCopyToken[i] == e->token) && (ackCopyLen[i] == length)) {
+				slot = i;						// Already copied for another server
+				break;
+			}
+		}
+		if (slot >= 0) {
+			if (ackCopyPending[slot] == 0) {
+				memcpy(ackCopy[slot], msg, length);
+				ackCopyLen[slot] = length;
+				ackCopyToken[slot] = e->token;
+			}
+			ackCopyPending[slot] |= 1 << server;
+			e->copy = slot;
+		}
+	}
+#endif
+	return((ident != PKT_PUSH_DATA) || (e->copy >= 0));
+}
+
+// ----------------------------------------------------------------------------
+// Match a PUSH_ACK or PULL_ACK (ident) with the given token from server.
+// Returns true when the datagram was found.
+// ----------------------------------------------------------------------------
+bool ackReceived(int server, uint16_t token, uint8_t ident) {
+	uint8_t sentIdent = (ident == PKT_PUSH_ACK) ? PKT_PUSH_DATA : PKT_PULL_DATA;
+
+	for (int i=0; i<ACK_TABLE_SIZE; i++) {
+		AckEntry *e = &ackTable[i];
+		if (!e->used || (e->token != token) || (e->server != server) || (e->ident != sentIdent)) {
+			continue;
+		}
+
+		AckServer *s = &ackServer[server];
+		uint32_t rtt = millis() - e->sent;
+		s->rtt[s->rttIndex] = (rtt > 0xFFFF) ? 0xFFFF : rtt;
+		s->rttIndex = (s->rttIndex + 1) % ACK_RTT_SAMPLES;
+		if (s->rttCount < ACK_RTT_SAMPLES) s->rttCount++;
+
+		if (sentIdent == PKT_PUSH_DATA) {
+			s->pushAcked++;
+			statInc(ST_UP_ACK);
+			s->ratioSent++;
+			s->ratioAcked++;
+		}
+		else {
+			s->pullAcked++;
+		}
+		ackFree(e);
+		return(true);
+	}
+	ackNoMatch++;
+	return(false);
+}
+
+// ----------------------------------------------------------------------------
+// Expire old entries and resend PUSH_DATA that was not acked within
+// ACK_RETRY_MS, once, with the same token. Lost PUSH_DATA is passed to lost.
+// Called from the main loop.
+// ----------------------------------------------------------------------------
+void ackCheck(ackResend_t resend, ackResend_t lost) {
+	uint32_t now = millis();
+
+	ackLostCb = lost;
+
+	for (int i=0; i<ACK_TABLE_SIZE; i++) {
+		AckEntry *e = &ackTable[i];
+		if (!e->used) continue;
+
+		uint32_t age = now - e->sent;
+		if (age >= ACK_TIMEOUT_MS) {
+			ackExpire(e, lost);
+			continue;
+		}
+#if _ACK_RETRY==1
+		if ((e->copy >= 0) && !e->retried && (age >= ACK_RETRY_MS) && (resend != NULL)) {
+			e->retried = true;
+			ackServer[e->server].retried++;
+			if (debug >= 1) {
+				Serial.print(F("ackCheck:: resend token "));
+				Serial.print(e->token, HEX);
+				Serial.print(F(", server "));
+				Serial.println(e->server);
+			}
+			resend(e->server, ackCopy[e->copy], ackCopyLen[e->copy]);
+		}
+#endif
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Percentage (in 0.1 %) of PUSH_DATA to server that was acknowledged since
+// the previous call. Used for "ackr" in the stat message.
+// ----------------------------------------------------------------------------
+uint16_t ackRatio(int server) {
+	if ((server < 0) || (server >= ACK_SERVERS)) return(0);
+	AckServer *s = &ackServer[server];
+	uint16_t ratio = 0;
+	if (s->ratioSent > 0) ratio = (s->ratioAcked * 1000) / s->ratioSent;
+	s->ratioSent = 0;
+	s->ratioAcked = 0;
+	return(ratio);
+}
+
+// ----------------------------------------------------------------------------
+// The pct percentile (0-100) of the last ACK_RTT_SAMPLES round trip times in ms.
+// Returns 0 when there are no samples yet.
+// ----------------------------------------------------------------------------
+uint16_t ackRttPercentile(int server, int pct) {
+	uint16_t s[ACK_RTT_SAMPLES];
+	int n = ackServer[server].rttCount;
+	if (n == 0) return(0);
+
+	memcpy(s, ackServer[server].rtt, n * sizeof(uint16_t));
+	for (int i=1; i<n; i++) {					// insertion sort, n is small
+		uint16_t v = s[i];
+		int j = i - 1;
+		while ((j >= 0) && (s[j] > v)) { s[j+1] = s[j]; j--; }
+		s[j+1] = v;
+	}
+	return(s[((n - 1) * pct) / 100]);
+}
+
+uint32_t ackPushSent(int server)  { return(ackServer[server].pushSent); }
+uint32_t ackPushAcked(int server) { return(ackServer[server].pushAcked); }
+uint32_t ackPullSent(int server)  { return(ackServer[server].pullSent); }
+uint32_t ackPullAcked(int server) { return(ackServer[server].pullAcked); }
+uint32_t ackLost(int server)      { return(ackServer[server].lost); }
+uint32_t ackRetried(int server)   { return(ackServer[server].retried); }
+uint32_t ackUnknown()             { return(ackNoMatch); }
+
+void ackResetStats() {
+	memset(ackServer, 0, sizeof(ackServer));
+	ackNoMatch = 0;
+}
@@ -0,0 +1,36 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway ACK tracking
+//
+// Every PUSH_DATA and PULL_DATA sent to a server is recorded in a small in-flight
+// table keyed by token and server. The PUSH_ACK / PULL_ACK replies are matched
+// against it to measure round trip times and the real ack ratio (ackr).
+// Unacknowledged PUSH_DATA can be sent once more (_ACK_RETRY) and is handed to
+// the caller when it is finally lost, so it can be journaled.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define ACK_SERVERS      4				// Server index is the index in upstream[] (UP_MAX)
+#define ACK_TABLE_SIZE   16				// Datagrams waiting for an ACK
+#define ACK_RTT_SAMPLES  32				// RTT history per server for the percentiles
+#define ACK_TIMEOUT_MS   2000			// No ACK after this time: datagram is lost
+#define ACK_RETRY_MS     400			// Resend PUSH_DATA once when not acked after this time
+#define ACK_RETRY_SLOTS  2				// PUSH_DATA copies for a resend or the journal
+
+typedef void (*ackResend_t)(int server, uint8_t *msg, int length);
+
+// Functions:
+uint16_t ackNextToken( void );
+bool ackSent(int , uint8_t *, int );
+bool ackReceived(int , uint16_t , uint8_t );
+void ackCheck( ackResend_t , ackResend_t );
+uint16_t ackRatio(int );
+uint16_t ackRttPercentile(int , int );
+uint32_t ackPushSent(int );
+uint32_t ackPushAcked(int );
+uint32_t ackPullSent(int );
+uint32_t ackPullAcked(int );
+uint32_t ackLost(int );
+uint32_t ackRetried(int );
+uint32_t ackUnknown( void );
+void ackResetStats( void );
@@ -33,6 +33,15 @@ using namespace std;
 
 #include "loraModem.h"
 #include "aux.h"          // Auxiliary functions common to several modules.
+#include "ackTrack.h"     // Matching of PUSH_ACK / PULL_ACK with what we sent
+#include "journal.h"      // Store and forward of undelivered uplinks
+#include "dnsCache.h"     // Background resolution of the server names
+#include "upstream.h"     // Table of the servers we forward to
+#include "gwStats.h"      // Counters and rolling windows for stat and web
+#include "ntpClient.h"    // Non blocking SNTP on its own socket
+#include "timeCal.h"      // Crystal drift and TX latency for the downlink timing
+#include "sched.h"        // Cooperative scheduler for the main loop
+#include "prof.h"         // Latency histograms of the tasks and the hot path
 
 extern "C" {
 #include "user_interface.h"
@@ -75,6 +84,8 @@ IPAddress ntpServer;							// IP address of NTP_TIMESERVER
 IPAddress ttnServer;							// IP Address of thethingsnetwork server
 IPAddress gwDevice;               // Local IP of the gateway device
 
+int dnsNTP     = -1;							// dnsCache entry of the NTP server
+
 // Wifi definitions
 // Array with SSID and password records. Set WPA size to number of entries in array
 // WIFI Settings:
@@ -93,19 +104,10 @@ IPAddress gwDevice;               // Local IP of the gateway device
 int debug =  DEBUG;									// Debug level! 0 is no msgs, 1 normal, 2 is extensive
 
 uint32_t stattime = 0;	// last time we sent a stat message to server
-uint32_t pulltime = 0;	// last time we sent a pull_data request to server
-
-// Lora Counters for statistics
-uint32_t LORA_rx_rcv;
-uint32_t LORA_rx_ok;
-uint32_t LORA_rx_bad;
-uint32_t LORA_rx_nocrc;
-uint32_t LORA_pkt_fwd;
 
 uint8_t MAC_address[6];
 char    MAC_char[18];
 
-WiFiUDP  Udp;
 uint32_t lasttime;
 uint32_t lastTimeSt;
 uint8_t  buff_up[TX_BUFF_SIZE];
@@ -140,74 +142,12 @@ void printTime() {
 // =============================================================================
 // NTP TIME functions
 
-const int NTP_PACKET_SIZE = 48;					// Fixed size of NTP record
-byte packetBuffer[NTP_PACKET_SIZE];
-
-// ----------------------------------------------------------------------------
-// Send the request packet to the NTP server.
-//
-// ----------------------------------------------------------------------------
-void sendNTPpacket(IPAddress& timeServerIP) {
-  // Zeroise the buffer.
-	memset(packetBuffer, 0, NTP_PACKET_SIZE);
-	packetBuffer[0] = 0b11100011;   			// LI, Version, Mode
-	packetBuffer[1] = 0;						// Stratum, or type of clock
-	packetBuffer[2] = 6;						// Polling Interval
-	packetBuffer[3] = 0xEC;						// Peer Clock Precision
-	// 8 bytes of zero for Root Delay & Root Dispersion
-	packetBuffer[12]  = 49;
-	packetBuffer[13]  = 0x4E;
-	packetBuffer[14]  = 49;
-	packetBuffer[15]  = 52;
-
-	Udp.beginPacket(timeServerIP, (int) 123);	// NTP Server and Port
-
-	if ((Udp.write((char *)packetBuffer, NTP_PACKET_SIZE)) != NTP_PACKET_SIZE) {
-		die("sendNtpPacket:: Error write");
-	}
-	else {
-		// Success
-	}
-	Udp.endPacket();
-}
-
-
-// ----------------------------------------------------------------------------
-// Get the NTP time from one of the time servers
-// Note: As this function is called from SyncINterval in the background
-//	make sure we have no blocking calls in this function
-// ----------------------------------------------------------------------------
-time_t getNtpTime()
-{
-  WiFi.hostByName(NTP_TIMESERVER, ntpServer);
-  //while (Udp.parsePacket() > 0) ; 			// discard any previously received packets
-  for (int i = 0 ; i < 4 ; i++) { 				// 5 retries.
-    sendNTPpacket(ntpServer);
-    uint32_t beginWait = millis();
-    while (millis() - beginWait < 5000)
-	{
-      if (Udp.parsePacket()) {
-        Udp.read(packetBuffer, NTP_PACKET_SIZE);
-        // Extract seconds portion.
-        unsigned long highWord = word(packetBuffer[40], packetBuffer[41]);
-        unsigned long lowWord = word(packetBuffer[42], packetBuffer[43]);
-        unsigned long secSince1900 = highWord << 16 | lowWord;
-        Udp.flush();
-        return secSince1900 - 2208988800UL + NTP_TIMEZONES * SECS_PER_HOUR;
-		// UTC is 1 TimeZone correction when no daylight saving time
-      }
-      //delay(10);
-    }
-  }
-  return 0; 									// return 0 if unable to get the time
-}
-
 // ----------------------------------------------------------------------------
-// Set up regular synchronization of NTP server and the local time.
+// TimeLib is only used for the local time on the display and web page, so it
+// gets UTC plus our timezone. Messages to the server use ntpUtc().
 // ----------------------------------------------------------------------------
-void setupTime() {
-  setSyncProvider(getNtpTime);
-  setSyncInterval(NTP_INTERVAL);
+void setLocalClock() {
+	setTime((time_t)(ntpNow() + NTP_TIMEZONES * SECS_PER_HOUR));
 }
 
 
@@ -225,20 +165,55 @@ IPAddress getDnsIP() {
 }
 
 
+// ----------------------------------------------------------------------------
+// Build the TX_ACK (*2, par. 5.5) for the PULL_RESP in req in buf. The token
+// is copied from the PULL_RESP. When the downlink was accepted there is no
+// JSON, otherwise the txpk_ack object tells the server why it was refused.
+// TX_ERR_POWER is a warning: the downlink is sent with TX_POWE_MAX.
+// Returns the length of the message.
+// ----------------------------------------------------------------------------
+int txAckMessage(uint8_t *buf, uint8_t *req, int result) {
+    buf[0]  = PROTOCOL_VERSION;						// 0x02
+    buf[1]  = req[1];
+    buf[2]  = req[2];
+    buf[3]  = PKT_TX_ACK;							// 0x05
+
+    buf[4]  = MAC_address[0];
+    buf[5]  = MAC_address[1];
+    buf[6]  = MAC_address[2];
+    buf[7]  = 0xFF;
+    buf[8]  = 0xFF;
+    buf[9]  = MAC_address[3];
+    buf[10] = MAC_address[4];
+    buf[11] = MAC_address[5];
+
+	if (result == TX_ERR_NONE) return(12);
+	if (result == TX_ERR_POWER) {
+		return(12 + sprintf((char *)buf + 12, "{\"txpk_ack\":{\"warn\":\"%s\",\"value\":%d}}",
+			txErrName(result), TX_POWE_MAX));
+	}
+	return(12 + sprintf((char *)buf + 12, "{\"txpk_ack\":{\"error\":\"%s\"}}", txErrName(result)));
+}
+
+
 // ----------------------------------------------------------------------------
 // Read DOWN a package from UDP socket, can come from any server
 // Messages are received when server responds to gateway requests from LoRa nodes
 // (e.g. JOIN requests etc.) or when server has downstream data.
 // We repond only to the server that sent us a message!
+// up is the index in upstream[] of the socket the message arrived on.
 // ----------------------------------------------------------------------------
-int readUdp(int packetSize, uint8_t * buff_down)
+int readUdp(int up, int packetSize, uint8_t * buff_down)
 {
+  WiFiUDP &Udp = upstream[up].udp;
   uint8_t  protocol;
   uint16_t token;
   uint8_t  ident;
   char     LoraBuffer[64]; 						//buffer to hold packet to send to LoRa node
+  int      result;
+  int      ackLen;
 
-  if (packetSize > RX_BUFF_SIZE) {
+  if (packetSize >= RX_BUFF_SIZE) {				// Room for the terminating 0
 	   Serial.print(F("readUDP:: ERROR package of size: "));
      Serial.println(packetSize);
 	   Udp.flush();
@@ -270,6 +245,7 @@ int readUdp(int packetSize, uint8_t * buff_down)
 		}
 	break;
 	case PKT_PUSH_ACK:	// 0x01 DOWN
+		ackReceived(up, token, ident);
 		if (debug >= 1) {
 			Serial.print(F("PKT_PUSH_ACK:: size ")); Serial.print(packetSize);
 			Serial.print(F(" From ")); Serial.print(remoteIpNo);
@@ -285,26 +261,23 @@ int readUdp(int packetSize, uint8_t * buff_down)
 	case PKT_PULL_RESP:	// 0x03 DOWN
 
 		lastTimeSt = micros();					// Store the tmst this package was received
+		statInc(ST_DW_RCV);
 		// Send to the LoRa Node first (timing) and then do messaging
-		if (sendPacket(data, packetSize-4) < 0) {
-			return(-1);
-		}
-
-		// Now respond with an PKT_PULL_ACK; 0x04 UP
-		buff_up[0]=buff_down[0];
-		buff_up[1]=buff_down[1];
-		buff_up[2]=buff_down[2];
-		buff_up[3]=PKT_PULL_ACK;
-		buff_up[4]=0;
+		result = sendPacket(data, packetSize-4);
 
-		// Only send the PKT_PULL_ACK to the UDP socket that just sent the data!!!
+		// Now respond with a PKT_TX_ACK; 0x05 UP, with the same token, also
+		// when the downlink was refused so the server does not wait for it
+		// Only send the PKT_TX_ACK to the UDP socket that just sent the data!!!
+		ackLen = txAckMessage(buff_up, buff_down, result);
 		Udp.beginPacket(remoteIpNo, remotePortNo);
-		if (Udp.write((char *)buff_up, 4) != 4) {
-			Serial.println("PKT_PULL_ACK:: Error writing Ack");
+		if (Udp.write((char *)buff_up, ackLen) != ackLen) {
+			Serial.println("PKT_TX_ACK:: Error writing Ack");
 		}
 		else {
 			if (debug>=1) {
-				Serial.print(F("PKT_PULL_ACK:: tmst="));
+				Serial.print(F("PKT_TX_ACK:: "));
+				Serial.print(txErrName(result));
+				Serial.print(F(", tmst="));
 				Serial.println(micros());
 			}
 		}
@@ -314,16 +287,14 @@ int readUdp(int packetSize, uint8_t * buff_down)
 		if (debug >=1) {
 			Serial.print(F("PKT_PULL_RESP:: size ")); Serial.print(packetSize);
 			Serial.print(F(" From ")); Serial.print(remoteIpNo);
-			Serial.print(F(", port ")); Serial.print(remotePortNo);
-			Serial.print(F(", data: "));
-			data = buff_down + 4;
-			data[packetSize] = 0;
-			Serial.print((char *)data);
-			Serial.println(F("..."));
+			Serial.print(F(", port ")); Serial.println(remotePortNo);
+			// No data: the txpk was decoded in place by sendPacket(), which
+			// prints the JSON as received with loraDebug 2
 		}
 
 	break;
 	case PKT_PULL_ACK:	// 0x04 DOWN; the server sends a PULL_ACK to confirm PULL_DATA receipt
+		ackReceived(up, token, ident);
 		if (debug >= 2) {
 			Serial.print(F("PKT_PULL_ACK:: size ")); Serial.print(packetSize);
 			Serial.print(F(" From ")); Serial.print(remoteIpNo);
@@ -404,211 +375,416 @@ void setupHandleOTA() {
 }
 
 
+// ============================================================================
+// WIFI CONNECTION STATE MACHINE
+//
+// The connection is managed by process_WiFi(), called every loop(). It never
+// waits: WiFi.begin() starts an attempt and the next calls look at the result.
+// The APs of secrets.h are tried in turn. After every failed round over all
+// APs the pause before the next round doubles (up to _WIFI_BACKOFF_MAX) and
+// after _WIFI_AP_ROUNDS failed rounds our own AP is started so the gateway
+// can still be reached for administration and OTA. The LoRa radio and the
+// journal keep running all the time.
+
+enum wifiState_t { WIFI_S_START, WIFI_S_CONNECTING, WIFI_S_CONNECTED, WIFI_S_BACKOFF };
+
+wifiState_t wifiState = WIFI_S_START;
+int      wifiAP = 0;							// Index in APs[] we try now
+uint32_t wifiStateTime = 0;						// millis() at the last state change
+uint32_t wifiBackoff = _WIFI_BACKOFF_MIN;		// Pause before the next attempt
+int      wifiRounds = 0;						// Failed rounds over all APs
+bool     wifiApActive = false;					// Our own AP is running
+bool     wifiWasUp = false;						// Connected at least once
+
+// Statistics, shown on the web page
+uint32_t wifiDownSince = 0;						// millis() when the link was lost
+uint32_t wifiReconnects = 0;					// Connections made after a loss
+uint32_t wifiReconnectLast = 0;					// Time (ms) the last reconnect took
+uint32_t wifiReconnectMax = 0;
+uint32_t wifiDowntime = 0;						// Total time (ms) without link
+uint32_t wifiAttempts = 0;						// WiFi.begin() calls
+
 // ----------------------------------------------------------------------------
-// Function to join the Wifi Network
-// XXX Maybe we should make the reconnect shorter in order to avoid watchdog resets.
-//	It is a matter of returning to the main loop() asap and make sure in next loop
-//	the reconnect is done first thing.
+// Start our own access point (WIFI_AP_STA), the STA side keeps trying.
 // ----------------------------------------------------------------------------
-int WlanConnect(char * wifi_ssid, char * wifi_pass) {
+void wifiStartAP() {
   char thishost[17];
-  // Set Hostname for OTA and network (add only 2 last bytes of last MAC Address)
   sprintf_P(thishost, PSTR("ESP-TTN-GW-%04X"), ESP.getChipId() & 0xFFFF);
 
-  WiFiMode_t con_type ;
-  int ret = WiFi.status();
-
   WiFi.mode(WIFI_AP_STA);
+  Serial.printf("Starting AP  : %s with key %s\r\n", thishost, _AP_PASS);
+  WiFi.softAP(thishost, _AP_PASS);
+  Serial.print(F("IP address   : ")); Serial.println(WiFi.softAPIP());
+  wifiApActive = true;
 
-	if (debug>=1) {
-	  Serial.print(F("========== SDK Saved parameters Start"));
-	  WiFi.printDiag(Serial);
-	  Serial.println(F("========== SDK Saved parameters End"));
-	}
+  #ifdef WEMOS_LORA_GW
+  wifi_led_color=COLOR_ORANGE;
+  LedRGBON(wifi_led_color, RGB_WIFI);
+  LedRGBSetAnimation(333, RGB_WIFI, 0, RGB_ANIM_FADE_IN);
+  #endif
+}
 
-  if ( strncmp(wifi_ssid, "**", 2) && strncmp(wifi_pass, "**", 2) ) {
-    Serial.println(F("Sketch contain SSID/PSK will set them"));
+// ----------------------------------------------------------------------------
+// The link came up: update statistics, stop our own AP and look up the
+// server names again.
+// ----------------------------------------------------------------------------
+void wifiConnected() {
+  uint32_t took = millis() - wifiDownSince;
+
+  if (wifiWasUp) {
+    wifiReconnects++;
+    wifiReconnectLast = took;
+    if (took > wifiReconnectMax) wifiReconnectMax = took;
+    wifiDowntime += took;
   }
+  wifiWasUp = true;
+  wifiBackoff = _WIFI_BACKOFF_MIN;
+  wifiRounds = 0;
 
-  // No empty sketch SSID, try connect
-  if (*wifi_ssid!='*' && *wifi_pass!='*' ) {
-    Serial.printf("connecting to %s with psk %s\r\n", wifi_ssid, wifi_pass );
-    WiFi.begin(wifi_ssid, wifi_pass);
-  } else {
-    // empty sketch SSID, try autoconnect with SDK saved credentials
-    Serial.println(F("No SSID/PSK defined in sketch\r\nConnecting with SDK ones if any"));
+  if (wifiApActive) {
+    WiFi.softAPdisconnect(true);
+    WiFi.mode(WIFI_STA);
+    wifiApActive = false;
   }
+  gwDevice = WiFi.localIP();
 
-  // Loop until connected or 20 sec time out
-  unsigned long this_start = millis();
+  Serial.print(F("WiFi connected to "));
+  Serial.print(APs[wifiAP][0]);
+  Serial.print(F(", IP "));
+  Serial.print(gwDevice);
+  Serial.print(F(", took "));
+  Serial.print(took);
+  Serial.println(F(" ms"));
+
+  dnsRefreshAll();							// Addresses may have changed meanwhile
 
   #ifdef WEMOS_LORA_GW
-  LedRGBON( COLOR_ORANGE_YELLOW, RGB_WIFI);
+  wifi_led_color=COLOR_YELLOW;
+  LedRGBON(wifi_led_color, RGB_WIFI);
   LedRGBSetAnimation(333, RGB_WIFI, 0, RGB_ANIM_FADE_IN);
   #endif
+}
 
-  while ( WiFi.status() !=WL_CONNECTED && millis()-this_start < 20000 ) {
-    #ifdef WEMOS_LORA_GW
-    LedRGBAnimate();
-    #endif
-    delay(1);
-  }
-
-  // Get latest WifI Status
-  ret =  WiFi.status();
-
- // connected remove AP
-  if (  ret == WL_CONNECTED  ) {
-    WiFi.mode(WIFI_STA);
-  } else {
-    // Need Access point configuration
-    // SSID = hostname
-    Serial.printf("Starting AP  : %s", thishost);
-
-    // STA+AP Mode without connected to STA, autoconnec will search
-    // other frequencies while trying to connect, this is causing issue
-    // to AP mode, so disconnect will avoid this
-    if (ret != WL_CONNECTED) {
-      // Disable auto retry search channel
-      WiFi.disconnect();
+// ----------------------------------------------------------------------------
+// Advance the WiFi state machine one step. Called every loop().
+// ----------------------------------------------------------------------------
+void process_WiFi() {
+  uint32_t now = millis();
+  int st = WiFi.status();
+
+  switch (wifiState) {
+  case WIFI_S_START:
+    if (st == WL_CONNECTED) {				// SDK reconnected by itself
+      wifiConnected();
+      wifiState = WIFI_S_CONNECTED;
+      break;
     }
+    if (debug >= 1) {
+      Serial.print(F("WiFi connecting to: "));
+      Serial.println(APs[wifiAP][0]);
+    }
+    WiFi.begin((char *)APs[wifiAP][0], (char *)APs[wifiAP][1]);
+    wifiAttempts++;
+    wifiStateTime = now;
+    wifiState = WIFI_S_CONNECTING;
+    break;
+
+  case WIFI_S_CONNECTING:
+    if (st == WL_CONNECTED) {
+      wifiConnected();
+      wifiState = WIFI_S_CONNECTED;
+    }
+    else if ((now - wifiStateTime >= _WIFI_CONNECT_MS) ||
+             (st == WL_CONNECT_FAILED) || (st == WL_NO_SSID_AVAIL)) {
+      if (debug >= 1) {
+        Serial.print(F("WiFi connection failed, status "));
+        Serial.println(st);
+      }
+      wifiAP = (wifiAP + 1) % NUMAPS;
+      if (wifiAP == 0) {						// All APs tried
+        wifiRounds++;
+        if (wifiRounds > 1) wifiBackoff *= 2;
+        if (wifiBackoff > _WIFI_BACKOFF_MAX) wifiBackoff = _WIFI_BACKOFF_MAX;
+        if (!wifiApActive && (wifiRounds >= _WIFI_AP_ROUNDS)) wifiStartAP();
+      }
+      wifiStateTime = now;
+      wifiState = WIFI_S_BACKOFF;
+    }
+    break;
+
+  case WIFI_S_CONNECTED:
+    if (st != WL_CONNECTED) {
+      Serial.println(F("WiFi connection lost"));
+      wifiDownSince = now;
+      wifiStateTime = now;
+      wifiState = WIFI_S_BACKOFF;
+      #ifdef WEMOS_LORA_GW
+      wifi_led_color=COLOR_RED;
+      #endif
+    }
+    break;
 
-    // protected network
-    Serial.printf(" with key %s\r\n", _AP_PASS);
-    WiFi.softAP(thishost,_AP_PASS);
-
-    Serial.print(F("IP address   : ")); Serial.println(WiFi.softAPIP());
-    Serial.print(F("MAC address  : ")); Serial.println(WiFi.softAPmacAddress());
-  }
-
-  #ifdef WEMOS_LORA_GW
-  con_type = WiFi.getMode();
-  Serial.print(F("WIFI="));
-  if (con_type == WIFI_STA) {
-    // OK breathing cyan
-    wifi_led_color=COLOR_YELLOW;
-    Serial.println(F("STA"));
-    Serial.print("IP Address: ");
-    Serial.println(WiFi.localIP().toString());
-
-  } else if ( con_type==WIFI_AP || con_type==WIFI_AP_STA ) {
-    // Owe're also in AP ? breathing Yellow
-    wifi_led_color=COLOR_ORANGE;
-    if (con_type==WIFI_AP) {
-      Serial.println(F("AP"));
-    } else {
-      Serial.println(F("AP_STA"));
+  case WIFI_S_BACKOFF:
+    if (st == WL_CONNECTED) {
+      wifiConnected();
+      wifiState = WIFI_S_CONNECTED;
     }
-  } else {
-    // Error breathing red
-    wifi_led_color=COLOR_RED;
-    Serial.println(F("???"));
+    else if (now - wifiStateTime >= wifiBackoff) {
+      wifiState = WIFI_S_START;
+    }
+    break;
   }
+}
 
-  // Set Breathing color to indicate connexion type on LED 2
-  LedRGBON(wifi_led_color, RGB_WIFI);
-  LedRGBSetAnimation(333, RGB_WIFI, 0, RGB_ANIM_FADE_IN);
+// ----------------------------------------------------------------------------
+// Send an UDP/DGRAM message to one server, index in upstream[].
+// With track set, PUSH_DATA and PULL_DATA are recorded for ACK tracking.
+// When no copy is left for ackLostUdp(), PUSH_DATA to the primary server is
+// journaled right away; should it be acked after all, the server drops the
+// replayed duplicate. A replay (from the journal) is tracked but never
+// journaled again: the record stays in the journal until its segment is done.
+// Returns true when the message was written.
+// ----------------------------------------------------------------------------
+bool sendUdpServer(int server, uint8_t * msg, int length, bool track, bool replay) {
+	PROF_START(cycles);
+	bool sent = upstreamSend(server, msg, length);
+	PROF_END(PROF_SENDUDP, cycles);
+	if (!sent) return(false);
+	if (track && !ackSent(server, msg, length)) {
+#if _JOURNAL==1
+		if (!replay && (server == upstreamPrimary())) journalAppend(msg, length);
+#endif
+	}
+	return(true);
+}
 
-  #endif
+// ----------------------------------------------------------------------------
+// Resend callback for ackCheck(). The datagram keeps its token and its
+// entry in the ACK table, so it is not tracked again.
+// ----------------------------------------------------------------------------
+void ackResendUdp(int server, uint8_t * msg, int length) {
+	if (WiFi.status() != WL_CONNECTED) return;
+	sendUdpServer(server, msg, length, false, false);
+}
 
-  setupHandleOTA();
+// ----------------------------------------------------------------------------
+// Lost callback for ackCheck(): PUSH_DATA to the primary server that was
+// never acked goes to the journal.
+// ----------------------------------------------------------------------------
+void ackLostUdp(int server, uint8_t * msg, int length) {
+#if _JOURNAL==1
+	if (server == upstreamPrimary()) journalAppend(msg, length);
+#endif
+}
 
-  return ret;
+// ----------------------------------------------------------------------------
+// Uplink traces: the frames of a PUSH_DATA were sent to server. The time
+// since RxDone goes into the latency histogram of that server.
+// ----------------------------------------------------------------------------
+void traceSent(UpTrace *trace, int traces, int server) {
+	uint32_t now = micros();
+	for (int n=0; n<traces; n++) {
+		PROF_ADD_US(PROF_UP_SEND + server, now - trace[n].rxDone);
+		if (debug >= 2) {
+			Serial.print(F("trace:: uSec after RxDone fifo="));
+			Serial.print(trace[n].fifo - trace[n].rxDone);
+			Serial.print(F(", json="));
+			Serial.print(trace[n].json - trace[n].rxDone);
+			Serial.print(F(", queued="));
+			Serial.print(trace[n].queued - trace[n].rxDone);
+			Serial.print(F(", sent="));
+			Serial.print(now - trace[n].rxDone);
+			Serial.print(F(", server="));
+			Serial.println(server);
+		}
+	}
 }
 
 // ----------------------------------------------------------------------------
-// Send an UDP/DGRAM message to the MQTT server
-// If we send to more than one host (not sure why) then we need to set sockaddr
-// before sending.
+// Send an UDP/DGRAM message to all enabled servers, in priority order.
+// The same buffer is written to every server. When the primary server
+// cannot be reached the message is journaled.
+// trace holds the traces of the uplinks in msg (traces may be 0).
 // ----------------------------------------------------------------------------
-void sendUdp(uint8_t * msg, int length) {
-	int l;
+void sendUdp(uint8_t * msg, int length, UpTrace *trace, int traces) {
 	bool err = true;               // Let's assume that we are going to fail
 
+	// process_WiFi() takes care of the reconnect, we do not wait for it here
 	if (WiFi.status() != WL_CONNECTED) {
-		Serial.println(F("sendUdp: ERROR not connected to WLAN"));
-		Udp.flush();
-
-    // Let's try to connect again
-		if (WlanConnect( (char *) _SSID, (char *)_PASS) < 0) {
-			Serial.print(F("sendUdp: ERROR connecting to WiFi"));
-			yield();
-			err = true;
-		}
-		if (debug>=1) Serial.println(F("WiFi reconnected"));
-		delay(10);
-    err = false;
-	} else {
-    err = false;    //We are connected.
-  }
-
-	//send the update to the TTN back end server.
-	if ( !err ) {
-    err = true;
-
-    // Send data to the first server, normally the TTN server.
-    Udp.beginPacket(ttnServer, (int) PORT1);
-	  if ((l = Udp.write((char *)msg, length)) != length) {
-		   Serial.println("sendUdp:: Error write");
-    } else {
-       err = false;
-		   if (debug>=2) {
-			   Serial.print(F("sendUdp 1: sent "));
-			   Serial.print(l);
-			   Serial.println(F(" bytes"));
-		   }
-	  }
-	  yield();
-	  Udp.endPacket();
-
-    // Send data to the secondary server.
-    #ifdef SERVER2
-    // Serial.print("Sending packet to secondary server...");
-    // Serial.print( SERVER2 );
-    // Serial.print(":");
-    // Serial.println(PORT2);
-		// delay(1);
-		Udp.beginPacket((char *)SERVER2, (int) PORT2);
-
-		if ((l = Udp.write((char *)msg, length)) != length) {
-				Serial.println(F("sendUdp:: Error write"));
-		} else {
-			err = false;
-			if (debug>=2) {
-				Serial.printf("sendUdp: sent %d bytes",l);
+		if (debug>=1) Serial.println(F("sendUdp: ERROR not connected to WLAN"));
+#if _JOURNAL==1
+		journalAppend(msg, length);				// Sent again when the link is back
+#endif
+	}
+	else {
+		int primary = upstreamPrimary();
+		for (int n=0; n<upstreamCount; n++) {
+			int i = upstreamOrder(n);
+			if (!upstream[i].enabled) continue;
+			if (sendUdpServer(i, msg, length, true, false)) {
+				err = false;
+				traceSent(trace, traces, i);
+			}
+#if _JOURNAL==1
+			else if (i == primary) {
+				journalAppend(msg, length);
 			}
+#endif
 		}
-
-		yield();
-		Udp.endPacket();
-    #endif
 	}
 
   // 1 fade out animation green if okay else otherwhise
-  LedRGBON(err ? COLOR_RED : COLOR_GREEN, RGB_WIFI, true);
-  LedRGBSetAnimation(1000, RGB_WIFI, 1, RGB_ANIM_FADE_OUT);
+  LedRGBEvent(err ? COLOR_RED : COLOR_GREEN, RGB_WIFI);
+
+}
+
+
+// ============================================================================
+// PUSH_DATA BATCHING
+//
+// Received frames are not sent one per datagram. Their rxpk objects are
+// collected in batch_up and sent as one PUSH_DATA when _BATCH_MAX frames
+// are collected, when the next frame would exceed _BATCH_BYTES or when the
+// first frame has waited _BATCH_LINGER milliseconds. With _BATCH_STAT the
+// periodic stat object is sent along with a pending batch.
+
+uint8_t  batch_up[TX_BUFF_SIZE];				// PUSH_DATA under construction
+int      batchIndex = 0;						// Bytes used in batch_up
+int      batchCount = 0;						// rxpk objects in batch_up
+uint32_t batchStart = 0;						// millis() of first frame in batch
+UpTrace  batchTrace[_BATCH_MAX];				// Traces of the frames in batch_up
+
+uint32_t batchSent = 0;							// Statistics: PUSH_DATA messages with rxpk
+uint32_t batchFrames = 0;						// Frames sent in those messages
+uint32_t batchLatency = 0;						// Total time (ms) frames waited in a batch
+uint32_t batchLatencyMax = 0;
+
+// ----------------------------------------------------------------------------
+// Fill the 12-byte PUSH_DATA header (*2, par. 3.2) with a new token
+// and the gateway ID. Returns the header length.
+// ----------------------------------------------------------------------------
+int pushDataHeader(uint8_t *buf) {
+    uint16_t token = ackNextToken();				// sequential token, see ackTrack.cpp
+    buf[0]  = PROTOCOL_VERSION;						// 0x01
+    buf[1]  = token & 0xFF;
+    buf[2]  = token >> 8;
+    buf[3]  = PKT_PUSH_DATA;						// 0x00
+
+	// READ MAC ADDRESS OF ESP8266, and insert 0xFF 0xFF in the middle
+    buf[4]  = MAC_address[0];
+    buf[5]  = MAC_address[1];
+    buf[6]  = MAC_address[2];
+    buf[7]  = 0xFF;
+    buf[8]  = 0xFF;
+    buf[9]  = MAC_address[3];
+    buf[10] = MAC_address[4];
+    buf[11] = MAC_address[5];
+    return(12);
+}
+
+// ----------------------------------------------------------------------------
+// Close the pending batch and send it. When stat is not NULL the stat
+// JSON object is added to the message as well.
+// ----------------------------------------------------------------------------
+void batchFlush(const char *stat) {
+	if (batchCount == 0) return;
+
+	batch_up[batchIndex++] = ']';
+	if (stat != NULL) {
+		batchIndex += snprintf((char *)(batch_up + batchIndex), TX_BUFF_SIZE - batchIndex, ",\"stat\":%s", stat);
+	}
+	batch_up[batchIndex++] = '}';
+	batch_up[batchIndex] = 0;
+
+	uint32_t waited = millis() - batchStart;
+	batchSent++;
+	batchFrames += batchCount;
+	batchLatency += waited;
+	if (waited > batchLatencyMax) batchLatencyMax = waited;
+
+	if (debug >= 2) {
+		Serial.print(F("batchFlush:: frames="));
+		Serial.print(batchCount);
+		Serial.print(F(", bytes="));
+		Serial.print(batchIndex);
+		Serial.print(F(", waited="));
+		Serial.println(waited);
+	}
 
+	sendUdp(batch_up, batchIndex, batchTrace, batchCount);
+	batchIndex = 0;
+	batchCount = 0;
 }
 
+// ----------------------------------------------------------------------------
+// Make room for one rxpk JSON object of at most len bytes and return where
+// it has to be written. receivePacket() serializes straight into batch_up,
+// batchCommit() then adds it to the batch. The batch is flushed first when
+// the object might not fit.
+// ----------------------------------------------------------------------------
+uint8_t *batchReserve(int len) {
+	// Room for the object, a comma and the closing "]}"
+	if ((batchCount > 0) && (batchIndex + len + 3 > _BATCH_BYTES)) {
+		batchFlush(NULL);
+	}
+
+	if (batchCount == 0) {
+		batchIndex = pushDataHeader(batch_up);
+		memcpy((void *)(batch_up + batchIndex), (void *)"{\"rxpk\":[", 9);
+		batchIndex += 9;
+		return(batch_up + batchIndex);
+	}
+	return(batch_up + batchIndex + 1);				// after the comma
+}
 
 // ----------------------------------------------------------------------------
-// connect to UDP – returns true if successful or false if not
+// Add the rxpk object of len bytes written at batchReserve() to the batch,
+// flush when full. A negative len means nothing was written.
+// trace is stamped as queued and kept until the batch is sent.
 // ----------------------------------------------------------------------------
-bool UDPconnect() {
-
-	bool ret = false;
-	if (debug>=1) Serial.println(F("Connecting to UDP..."));
-	unsigned int localPort = _LOCUDPPORT;
-	if (Udp.begin(localPort) == 1) {
-		if (debug>=1) Serial.println(F("Connection successful!"));
-		ret = true;
+void batchCommit(int len, UpTrace *trace) {
+	if (len < 0) return;
+
+	trace->queued = micros();
+	PROF_ADD_US(PROF_UP_FIFO, trace->fifo - trace->rxDone);
+	PROF_ADD_US(PROF_UP_JSON, trace->json - trace->rxDone);
+	PROF_ADD_US(PROF_UP_QUEUE, trace->queued - trace->rxDone);
+	batchTrace[batchCount] = *trace;
+
+	if (batchCount == 0) {
+		batchStart = millis();
 	}
-	else{
-		//Serial.println("Connection failed");
+	else {
+		batch_up[batchIndex++] = ',';
 	}
-	return(ret);
+	batchIndex += len;
+	batchCount++;
+	statInc(ST_RX_FWD);
+
+	if (batchCount >= _BATCH_MAX) batchFlush(NULL);
 }
 
+// ----------------------------------------------------------------------------
+// Send callback for journalService(): the stored message gets a new PUSH_DATA
+// header and goes to the primary server only.
+// ----------------------------------------------------------------------------
+bool journalSendUdp(uint8_t * msg, int length) {
+	int primary = upstreamPrimary();
+	if (primary < 0) return(false);
+	pushDataHeader(msg);
+	return(sendUdpServer(primary, msg, length, true, true));
+}
+
+// ----------------------------------------------------------------------------
+// Send the batch when the first frame waited long enough
+// ----------------------------------------------------------------------------
+void batchCheck() {
+	if ((batchCount > 0) && ((millis() - batchStart) >= _BATCH_LINGER)) {
+		batchFlush(NULL);
+	}
+}
+
+
 // ----------------------------------------------------------------------------
 // Setup the LoRa environment on the connected transceiver.
 // - Determine the correct transceiver type (sx1272/RFM92 or sx1276/RFM95)
@@ -628,17 +804,10 @@ void SetupLoRa()
   }
   setLoraDebug(DEBUG); // Set debug mode for Lora Modem functions.
   setLoraModem( LORAMODEM_ssPin, LORAMODEM_dio0, NOT_A_PIN , NOT_A_PIN , LORAMODEM_RST , _SPREADING , false );
+  setLoraCad(_CAD);     // Scan all SF's or listen on _SPREADING only
 	initLoraModem();
 }
 
-void getLoraStats() {
-  LORA_rx_rcv   = getLoraRXRCV();
-  LORA_rx_ok    = getLoraRXOK();
-  LORA_rx_bad   = getLoraRXBAD();
-  LORA_rx_nocrc = getLoraRXNOCRC();
-  LORA_pkt_fwd  = getLoraPKTFWD();
-}
-
 // ----------------------------------------------------------------------------
 // Send UP periodic Pull_DATA message to server to keepalive the connection
 // and to invite the server to send downstream messages when available
@@ -647,8 +816,9 @@ void getLoraStats() {
 //	- Random Token (2 bytes)
 //	- PULL_DATA identifier (1 byte) = 0x02
 //	- Gateway unique identifier (8 bytes) = MAC address
+// Every server gets its own PULL_DATA, up is the index in upstream[].
 // ----------------------------------------------------------------------------
-void pullData() {
+void pullData(int up) {
 
     uint8_t pullDataReq[12]; 						// status report as a JSON object
     int pullIndex=0;
@@ -656,10 +826,9 @@ void pullData() {
 
     // pre-fill the data buffer with fixed fields
     pullDataReq[0]  = PROTOCOL_VERSION;						// 0x01
-	  uint8_t token_h = (uint8_t)rand(); 						// random token
-    uint8_t token_l = (uint8_t)rand();						// random token
-    pullDataReq[1]  = token_h;
-    pullDataReq[2]  = token_l;
+    uint16_t token  = ackNextToken();						// sequential token
+    pullDataReq[1]  = token & 0xFF;
+    pullDataReq[2]  = token >> 8;
     pullDataReq[3]  = PKT_PULL_DATA;						// 0x02
 
 	  // READ MAC ADDRESS OF ESP8266
@@ -687,7 +856,9 @@ void pullData() {
 		  Serial.println();
 	  //}
     //send the update
-    sendUdp(pullDataReq, pullIndex);
+    if (WiFi.status() == WL_CONNECTED) {
+      sendUdpServer(up, pullDataReq, pullIndex, true, false);
+    }
 }
 
 
@@ -771,37 +942,16 @@ void pullData() {
 void sendstat() {
 
     uint8_t status_report[STATUS_SIZE]; 					// status report as a JSON object
+    char stat_object[STATUS_SIZE];							// the {...} stat object only
     char stat_timestamp[32];								// XXX was 24
-    time_t t;
 	  char clat[10]={0};
 	  char clon[10]={0};
 
     int stat_index=0;
+    uint16_t ackr = ackRatio(upstreamPrimary());		// in 0.1 %, since the last stat
+    statIntervalEnd();										// Counters since the last stat
 
-    // pre-fill the data buffer with fixed fields
-    status_report[0]  = PROTOCOL_VERSION;					// 0x01
-    status_report[3]  = PKT_PUSH_DATA;						// 0x00
-
-	  // READ MAC ADDRESS OF ESP8266, and return unique Gateway ID consisting of MAC address and 2bytes 0xFF
-    status_report[4]  = MAC_address[0];
-    status_report[5]  = MAC_address[1];
-    status_report[6]  = MAC_address[2];
-    status_report[7]  = 0xFF;
-    status_report[8]  = 0xFF;
-    status_report[9]  = MAC_address[3];
-    status_report[10] = MAC_address[4];
-    status_report[11] = MAC_address[5];
-
-    uint8_t token_h   = (uint8_t)rand(); 					// random token
-    uint8_t token_l   = (uint8_t)rand();					// random token
-    status_report[1]  = token_h;
-    status_report[2]  = token_l;
-    stat_index = 12;										// 12-byte header
-
-    t = now();												// get timestamp for statistics
-
-	// XXX Using CET as the current timezone. Change to your timezone
-	sprintf(stat_timestamp, "%04d-%02d-%02d %02d:%02d:%02d CET", year(),month(),day(),hour(),minute(),second());
+	ntpStatTime(stat_timestamp, ntpUtc(micros64()));		// UTC
 	yield();
 
 	ftoa(lat,clat,4);										// Convert lat to char array with 4 decimals
@@ -810,25 +960,33 @@ void sendstat() {
 	// Build the Status message in JSON format, XXX Split this one up...
 	delay(1);
 
-  int j = snprintf((char *)(status_report + stat_index), STATUS_SIZE-stat_index,
-		"{\"stat\":{\"time\":\"%s\",\"lati\":%s,\"long\":%s,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%u.0,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"}}",
-		stat_timestamp, clat, clon, (int)alt, LORA_rx_rcv, LORA_rx_ok, LORA_pkt_fwd, 0, 0, 0,platform,email,description);
+	snprintf(stat_object, STATUS_SIZE,
+		"{\"time\":\"%s\",\"lati\":%s,\"long\":%s,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%u.%u,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"}",
+		stat_timestamp, clat, clon, (int)alt, statLastInterval(ST_RX_RCV), statLastInterval(ST_RX_OK),
+		statLastInterval(ST_RX_FWD), ackr / 10, ackr % 10, statLastInterval(ST_DW_RCV), statLastInterval(ST_TX_OK),
+		platform,email,description);
 
 	yield();												// Give way to the internal housekeeping of the ESP8266
-	if (debug >=1) { delay(1); }
-    stat_index += j;
-    status_report[stat_index] = 0; 							// add string terminator, for safety
 
     if (debug>=2) {
-		Serial.print(F("stat update: <"));
-		Serial.print(stat_index);
-		Serial.print(F("> "));
-		Serial.println((char *)(status_report+12));			// DEBUG: display JSON stat
+		Serial.print(F("stat update: "));
+		Serial.println(stat_object);						// DEBUG: display JSON stat
+	}
+
+	// Piggyback on the pending rxpk batch if there is one and it fits
+	if (_BATCH_STAT && (batchCount > 0) &&
+		(batchIndex + strlen(stat_object) + 12 <= _BATCH_BYTES)) {
+		batchFlush(stat_object);
+		return;
 	}
 
+    stat_index = pushDataHeader(status_report);				// 12-byte header
+    stat_index += snprintf((char *)(status_report + stat_index), STATUS_SIZE-stat_index, "{\"stat\":%s}", stat_object);
+    status_report[stat_index] = 0; 							// add string terminator, for safety
+
     //send the update
 	// delay(1);
-    sendUdp(status_report, stat_index);
+    sendUdp(status_report, stat_index, NULL, 0);
 	return;
 }
 
@@ -879,13 +1037,6 @@ void setup_OLED() {
 // }
 
 void setup_WIFI() {
-    bool connected = false;
-    char *ssid;
-    char *pwd;
-    int cntAP = 0;
-    int tries = 0;
-    String out;
-
     #ifdef OLED_DISPLAY
       OLEDDisplay_println("WIFI:");
     #endif
@@ -893,55 +1044,32 @@ void setup_WIFI() {
     Serial.println("Connecting to WIFI...");
     WiFi.mode(WIFI_STA);
 
-    while ( !connected ) {
-      ssid = (char *)APs[cntAP][0];
-      pwd  = (char *)APs[cntAP][1];
-      Serial.print("Connecting to: ");
-      Serial.println(ssid);
-
-      OLEDDisplay_printxy( 0 , 8 , "W:                     " );
-      out = "W: " + String(ssid);
-      OLEDDisplay_printxy( 0 , 8 , out.c_str() );
-
-      out = "T: " + String(tries);
-      OLEDDisplay_printxy( 0 , 32, out.c_str() );
-
-      WiFi.begin(ssid, pwd );
-      if (WiFi.waitForConnectResult() != WL_CONNECTED) {
-        Serial.println("Connection Failed! Trying next AP...");
-        Serial.print("Number of tries: ");
-        Serial.println(tries);
-
-        cntAP++;
-        tries++;
-        if (cntAP == NUMAPS )
-          cntAP = 0;
-
-        delay(1000);
-        yield();
-      } else
-        connected = true;
-     }
-
-      #ifdef OLED_DISPLAY
-          OLEDDisplay_Clear();
-          OLEDDisplay_printxy(0,0,"WIFI OK!");
-      #endif
+    // Give the state machine some time to connect before the servers are
+    // resolved. When it does not work we continue, process_WiFi() keeps
+    // trying (and starts our own AP) while the gateway runs.
+    uint32_t start = millis();
+    while ((wifiState != WIFI_S_CONNECTED) && (millis() - start < _WIFI_SETUP_MS)) {
+      process_WiFi();
+      delay(10);
+    }
 
-      if (!UDPconnect()) {
-          Serial.println("Error UDPconnect");
-      }
+    #ifdef OLED_DISPLAY
+      OLEDDisplay_Clear();
+      OLEDDisplay_printxy(0,0, (wifiState == WIFI_S_CONNECTED) ? "WIFI OK!" : "NO WIFI");
+    #endif
 
-      WiFi.macAddress(MAC_address);
-      for (int i = 0; i < sizeof(MAC_address); ++i){
-        sprintf(MAC_char,"%s%02x:",MAC_char,MAC_address[i]);
-      }
-      Serial.print("MAC: ");
-      Serial.println(MAC_char);
+    WiFi.macAddress(MAC_address);
+    for (int i = 0; i < sizeof(MAC_address); ++i){
+      sprintf(MAC_char,"%s%02x:",MAC_char,MAC_address[i]);
+    }
+    Serial.print("MAC: ");
+    Serial.println(MAC_char);
+
+    gwDevice = WiFi.localIP();
+    Serial.print("GW IP: ");
+    Serial.println( gwDevice.toString());
 
-      gwDevice = WiFi.localIP();
-      Serial.print("GW IP: ");
-      Serial.println( gwDevice.toString());
+    setupHandleOTA();
 }
 
 void setup_LORA() {
@@ -979,8 +1107,12 @@ void display_Config() {
   Serial.print(MAC_address[4],HEX);
   Serial.print(MAC_address[5],HEX);
 
-  Serial.print(", Listening at SF");
-  Serial.print(LORAMODEM_sf);
+  if (getLoraCad()) {
+    Serial.print(", Scanning SF7-SF12 (CAD)");
+  } else {
+    Serial.print(", Listening at SF");
+    Serial.print(LORAMODEM_sf);
+  }
   Serial.print(" on ");
   Serial.print((double)LORA_freq/1000000);
   Serial.println(" Mhz.");
@@ -988,20 +1120,33 @@ void display_Config() {
 
 }
 
+void setup_Journal() {
+  #if _JOURNAL==1
+    journalInit();
+  #endif
+}
+
 void setup_TTNServer() {
   #ifdef OLED_DISPLAY
     OLEDDisplay_println("TTN N RES");
   #endif
   Serial.print("Name resolution for ");
   Serial.println(_TTNSERVER);
-  WiFi.hostByName(_TTNSERVER, ttnServer);					// Use DNS to get server IP once
-  delay(100);
-  yield();
-  yield();
-  Serial.print("TTN Server is ");
-  Serial.println( ttnServer );
 
+  upstreamInit();										// Sockets and DNS entries of the servers
+  dnsNTP = dnsAdd(NTP_TIMESERVER);
 
+  // Wait a little for the first answers, NTP is needed right away.
+  // When this fails process_DNS() keeps trying in the background.
+  uint32_t start = millis();
+  while ((!upstreamResolved() || !dnsGet(dnsNTP, ntpServer)) &&
+         (WiFi.status() == WL_CONNECTED) && (millis() - start < DNS_TIMEOUT_MS)) {
+    dnsService(true);
+    delay(10);
+  }
+  ttnServer = upstream[0].ip;
+  Serial.print("TTN Server is ");
+  Serial.println( ttnServer );
 }
 
 void setup_NTPServer() {
@@ -1009,8 +1154,16 @@ void setup_NTPServer() {
     OLEDDisplay_println("NTP Init..");
   #endif
   Serial.println("NTP Server initialization...");
-	setupTime();											// Set NTP time host and interval
-	setTime((time_t)getNtpTime());
+	ntpInit(dnsNTP);
+
+	// Wait a little for the first answer, after that the time is kept
+	// up to date in the background by process_NTP()
+	uint32_t start = millis();
+	while (!ntpSynced() && (WiFi.status() == WL_CONNECTED) && (millis() - start < NTP_TIMEOUT_MS)) {
+		ntpService(true);
+		delay(10);
+	}
+	setLocalClock();
 	Serial.print("Time "); printTime();
 	Serial.println();
 }
@@ -1028,18 +1181,42 @@ void setup_WebAdminServer() {
 // Loop segregated functions
 
 void process_LORAWAN() {
-  int buff_index;
-  uint8_t buff_up[TX_BUFF_SIZE]; 						// buffer to compose the upstream packet
-
-  // Receive Lora messages
-  if ((buff_index = receivePacket(buff_up)) >= 0) {	// read is successful
+  int rxpk_len;
+  uint8_t *rxpk;
+  UpTrace trace;
+
+  // Drain the radio FIFO if DIO0 fired
+  pollLoraModem();
+
+  // Receive Lora messages, empty the RX ring. Each rxpk object is
+  // serialized in place in the PUSH_DATA batch, no intermediate copy.
+  while ((rxpk_len = receivePacketLen()) >= 0) {
+    rxpk = batchReserve(rxpk_len);
+    PROF_START(json);
+    rxpk_len = receivePacket(rxpk, rxpk_len + 1, &trace);	// +1 for the terminating 0
+    PROF_END(PROF_JSON, json);
+    if (rxpk_len < 0) continue;
     yield();
-    LedRGBON(COLOR_MAGENTA, RGB_RF, true);
-    LedRGBSetAnimation(1000, RGB_RF, 1, RGB_ANIM_FADE_OUT);
-    sendUdp(buff_up, buff_index);					// We can send to multiple sockets if necessary
+    LedRGBEvent(COLOR_MAGENTA, RGB_RF);
+    batchCommit(rxpk_len, &trace);							// Sent when the batch is full or lingered
+    pollLoraModem();								// sendUdp() can be slow, keep the FIFO empty
   }
-  else {
-    // No message received
+
+  batchCheck();
+}
+
+void process_DNS() {
+  // Start DNS lookups that are due, pick up the answers
+  dnsService(WiFi.status() == WL_CONNECTED);
+  upstreamUpdate();
+  ttnServer = upstream[0].ip;
+}
+
+void process_NTP() {
+  // Poll the NTP server, never waits for the answer
+  if (ntpService(WiFi.status() == WL_CONNECTED)) {
+	calNtpSample(ntpSampleTime(), ntpSampleOffset());
+	setLocalClock();
   }
 }
 
@@ -1049,27 +1226,33 @@ void process_TTN() {
   // messages on UDP for every message sent by the gateway. So we have to consume them..
   // As we do not know when the server will respond, we test in every loop.
   //
-  int packetSize = Udp.parsePacket();
-  if (packetSize >0) {
+  for (int i=0; i<upstreamCount; i++) {
+   int packetSize = upstream[i].udp.parsePacket();
+   if (packetSize >0) {
     yield();
-    if (readUdp(packetSize , buff_down )>0) {
-      // 1 fade out animation green if okay else otherwhise
-      #ifdef WEMOS_LORA_GW
-      LedRGBON(COLOR_GREEN, RGB_WIFI, true);
-      #endif
-    } else {
-      #ifdef WEMOS_LORA_GW
-      LedRGBON(COLOR_ORANGE, RGB_WIFI, true);
-      #endif
-    }
-    LedRGBSetAnimation(1000, RGB_WIFI, 1, RGB_ANIM_FADE_OUT);
+    PROF_START(cycles);
+    int len = readUdp(i, packetSize , buff_down );
+    PROF_END(PROF_READUDP, cycles);
+    // 1 fade out animation green if okay else otherwhise
+    LedRGBEvent((len > 0) ? COLOR_GREEN : COLOR_ORANGE, RGB_WIFI);
+   }
   }
+
+  // Expire unacknowledged datagrams, resend PUSH_DATA once
+  ackCheck(ackResendUdp, ackLostUdp);
+
+  #if _JOURNAL==1
+  // Send journaled PUSH_DATA again, rate limited
+  journalService(WiFi.status() == WL_CONNECTED, journalSendUdp);
+  #endif
 }
 
 
 void process_GateWay() {
   uint32_t nowseconds = (uint32_t) millis() /1000;
 
+  statService();										// Roll the statistics windows
+
   // stat PUSH_DATA message (*2, par. 4)
 	//
 	nowseconds = (uint32_t) millis() /1000;
@@ -1080,12 +1263,15 @@ void process_GateWay() {
 
 	yield();
 
-	// send PULL_DATA message (*2, par. 4)
+	// send PULL_DATA message (*2, par. 4), each server on its own timer
 	//
 	nowseconds = (uint32_t) millis() /1000;
-  if (nowseconds - pulltime >= _PULL_INTERVAL) {		// Wake up every xx seconds
-        pullData();										// Send PULL_DATA message to server
-	    	pulltime = nowseconds;
+  for (int i=0; i<upstreamCount; i++) {
+    if (!upstream[i].enabled) continue;
+    if (nowseconds - upstream[i].pulltime >= _PULL_INTERVAL) {	// Wake up every xx seconds
+        pullData(i);									// Send PULL_DATA message to server
+	    	upstream[i].pulltime = nowseconds;
+    }
   }
 
 }
@@ -1129,12 +1315,28 @@ void process_statusBar() {
   //Serial.printf("%s %02d:%02d:%02d", DaysNames[weekday()-1], hour(), minute(), second() );
   OLEDDisplay_SetTime(  DaysNames[weekday()-1] , hour(), minute() );
   OLEDDisplay_SetRSSI(WiFi.RSSI());
-  OLED_setIP2Display(WiFi.localIP().toString());
+  OLED_setIP2Display((uint32_t) WiFi.localIP());  // No String, only redrawn when it changed
 
   OLEDDisplay_Animate();
 
 }
 
+void process_OTA() {
+  ArduinoOTA.handle();
+}
+
+#if _PROFILE==1
+void process_Serial() {
+  // One letter commands: p = dump the latency profile, z = clear it
+  while (Serial.available() > 0) {
+    switch (Serial.read()) {
+    case 'p': profDump(); break;
+    case 'z': profReset(); Serial.println(F("Profile cleared")); break;
+    }
+  }
+}
+#endif
+
 
 // ========================================================================
 // MAIN PROGRAM (SETUP AND LOOP)
@@ -1142,6 +1344,30 @@ void process_statusBar() {
 // ----------------------------------------------------------------------------
 // Setup code (one time)
 // ----------------------------------------------------------------------------
+// ----------------------------------------------------------------------------
+// The tasks of the main loop. Budgets are in uSec and are what a normal run
+// takes, larger runs are reported as overruns on the web page.
+// ----------------------------------------------------------------------------
+void setup_Scheduler() {
+  //       name       task                    priority             period ms budget  trigger
+  schedAdd("radio",   process_LORAWAN,        SCHED_PRIO_RADIO,    0,        5000,   loraPending);
+  schedAdd("ttn",     process_TTN,            SCHED_PRIO_NET,      0,        5000,   NULL);
+  schedAdd("wifi",    process_WiFi,           SCHED_PRIO_NET,      100,      2000,   NULL);
+  schedAdd("dns",     process_DNS,            SCHED_PRIO_NET,      100,      2000,   NULL);
+  schedAdd("ntp",     process_NTP,            SCHED_PRIO_SERVICE,  50,       2000,   NULL);
+  schedAdd("gateway", process_GateWay,        SCHED_PRIO_SERVICE,  100,      10000,  NULL);
+  schedAdd("web",     process_WebAdminServer, SCHED_PRIO_SERVICE,  10,       20000,  NULL);
+  schedAdd("ota",     process_OTA,            SCHED_PRIO_SERVICE,  50,       5000,   NULL);
+  schedAdd("leds",    process_RGBLeds,        SCHED_PRIO_COSMETIC, 20,       2000,   NULL);
+  schedAdd("oled",    process_statusBar,      SCHED_PRIO_COSMETIC, 100,      30000,  NULL);
+#if _PROFILE==1
+  schedAdd("serial",  process_Serial,         SCHED_PRIO_SERVICE,  100,      5000,   NULL);
+#endif
+
+  // Nothing with a larger budget may start when a downlink is due before it ends
+  schedSetGuard(loraTxSlack);
+}
+
 void setup () {
 
 	Serial.begin(_BAUDRATE);	// As fast as possible for bus
@@ -1161,6 +1387,8 @@ void setup () {
 
   setup_LORA();
 
+  setup_Journal();
+
   display_Config();
 
   setup_TTNServer();
@@ -1176,14 +1404,14 @@ void setup () {
 	LedRGBSetAnimation(1000, RGB_WIFI);
 	LedRGBOFF(RGB_RF);
 
+  setup_Scheduler();
 }
 
 // ----------------------------------------------------------------------------
 // LOOP
 // This is the main program that is executed time and time again.
-// We need to give way to the bacjend WiFi processing that
-// takes place somewhere in the ESP8266 firmware and therefore
-// we include yield() statements at important points.
+// The work is done by the tasks of setup_Scheduler(). schedRun() gives way
+// to the backend WiFi processing (yield()) after every task.
 //
 // Note: If we spend too much time in user processing functions
 //	and the backend system cannot do its housekeeping, the watchdog
@@ -1192,19 +1420,7 @@ void setup () {
 // ----------------------------------------------------------------------------
 void loop ()
 {
-  process_LORAWAN();            // Check for incoming LORA data
-
-  process_TTN();                // Check for TTN backend data and send keep alives
-
-  process_GateWay();
-
-  process_WebAdminServer();     // Handle web admin server
-
-  process_RGBLeds();            // Process RGB LED animations
-
-  process_statusBar();
-
-  // Handle OTA
-  ArduinoOTA.handle();          // Handle OTA.
-
+  PROF_START(cycles);
+  schedRun();
+  PROF_END(PROF_PASS, cycles);
 }
@@ -26,3 +26,56 @@ void ftoa(float f, char *val, int p) {
 	// Fraction can be anything from 0 to 10^p , so can have less digits
 	strcat(val,b);
 }
+
+
+// ----------------------------------------------------------------------------
+// 64-bit gateway time base in microseconds.
+// micros() wraps every ~71 minutes; we count the wraps in the upper 32 bits.
+// This function has to be called at least once per wrap period: pollLoraModem()
+// calls it at its top, and the radio task runs it on every scheduler pass.
+// Do not call from an interrupt routine.
+// ----------------------------------------------------------------------------
+static uint32_t micros64Last = 0;
+static uint32_t micros64High = 0;
+
+uint64_t micros64() {
+	uint32_t now = micros();
+	if (now < micros64Last) micros64High++;		// micros() wrapped
+	micros64Last = now;
+	return(((uint64_t)micros64High << 32) | now);
+}
+
+// ----------------------------------------------------------------------------
+// Expand a 32-bit micros() value (a timestamp taken by an interrupt routine,
+// or a tmst sent by the server) to the 64-bit time base.
+// The 32-bit value must be within +/- 35 minutes of now; the difference is
+// taken modulo 2^32 and interpreted as signed, so this is rollover safe.
+// ----------------------------------------------------------------------------
+uint64_t micros64From32(uint32_t t) {
+	uint64_t now = micros64();
+	return(now + (int64_t)(int32_t)(t - (uint32_t)now));
+}
+
+// ----------------------------------------------------------------------------
+// Integer to decimal text, used by the rxpk serializer instead of snprintf.
+// The digits are written at buf without a terminating 0.
+// Returns the number of characters written (at most 11).
+// ----------------------------------------------------------------------------
+int fmtUint(char *buf, uint32_t v) {
+	char t[10];
+	int n = 0;
+	do {
+		t[n++] = '0' + (v % 10);
+		v /= 10;
+	} while (v != 0);
+	for (int i = 0; i < n; i++) buf[i] = t[n - 1 - i];
+	return(n);
+}
+
+int fmtInt(char *buf, int32_t v) {
+	if (v < 0) {
+		buf[0] = '-';
+		return(1 + fmtUint(buf + 1, (uint32_t)0 - (uint32_t)v));
+	}
+	return(fmtUint(buf, (uint32_t)v));
+}
@@ -1,2 +1,5 @@
-
 void ftoa(float , char *, int );
+uint64_t micros64( void );
+uint64_t micros64From32(uint32_t );
+int fmtUint(char *, uint32_t );
+int fmtInt(char *, int32_t );
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Duplicate uplink filter. Every received frame is hashed with 32-bit FNV-1a
+ * over its length and payload. The hash and the receive time are kept in a
+ * ring of DEDUP_ENTRIES; a frame whose hash is in the ring and younger than
+ * DEDUP_WINDOW_MS is a duplicate.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "dedup.h"
+
+#define FNV_OFFSET  2166136261UL
+#define FNV_PRIME   16777619UL
+
+struct DedupEntry {
+	uint32_t hash;
+	uint32_t time;								// millis() of the first reception
+};
+
+DedupEntry dedupCache[DEDUP_ENTRIES];
+uint8_t  dedupNext = 0;							// Entry to replace next
+uint8_t  dedupUsed = 0;
+uint32_t dedupHit = 0;
+uint32_t dedupMiss = 0;
+
+// ----------------------------------------------------------------------------
+// FNV-1a of the length byte followed by the payload
+// ----------------------------------------------------------------------------
+static uint32_t dedupHash(uint8_t *data, uint8_t len) {
+	uint32_t h = (FNV_OFFSET ^ len) * FNV_PRIME;
+	for (int i=0; i<len; i++) {
+		h = (h ^ data[i]) * FNV_PRIME;
+	}
+	return(h);
+}
+
+// ----------------------------------------------------------------------------
+// Returns true when the frame was already seen within DEDUP_WINDOW_MS.
+// Otherwise the frame is remembered and false is returned.
+// ----------------------------------------------------------------------------
+bool dedupSeen(uint8_t *data, uint8_t len) {
+	uint32_t h = dedupHash(data, len);
+	uint32_t now = millis();
+
+	for (int i=0; i<dedupUsed; i++) {
+		if ((dedupCache[i].hash == h) && ((now - dedupCache[i].time) < DEDUP_WINDOW_MS)) {
+			dedupHit++;
+			return(true);
+		}
+	}
+
+	dedupCache[dedupNext].hash = h;
+	dedupCache[dedupNext].time = now;
+	dedupNext = (dedupNext + 1) % DEDUP_ENTRIES;
+	if (dedupUsed < DEDUP_ENTRIES) dedupUsed++;
+	dedupMiss++;
+	return(false);
+}
+
+uint32_t dedupHits()   { return(dedupHit); }
+uint32_t dedupMisses() { return(dedupMiss); }
+
+void dedupResetStats() {
+	dedupHit = 0;
+	dedupMiss = 0;
+}
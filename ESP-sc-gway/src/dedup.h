@@ -0,0 +1,18 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway duplicate uplink filter
+//
+// A small cache of the hashes of recently received frames. A frame with the same
+// length and payload as one received less than DEDUP_WINDOW_MS ago is an exact
+// duplicate (FIFO read twice, replay) and is not forwarded again.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define DEDUP_ENTRIES    16				// Frames remembered, oldest is replaced
+#define DEDUP_WINDOW_MS  2000			// Same frame within this time is a duplicate
+
+// Functions:
+bool dedupSeen(uint8_t *, uint8_t );
+uint32_t dedupHits( void );
+uint32_t dedupMisses( void );
+void dedupResetStats( void );
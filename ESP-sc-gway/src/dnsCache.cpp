@@ -0,0 +1,174 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * DNS cache for the servers we talk to.
+ * WiFi.hostByName() waits for the answer; here the lookup is started with
+ * dns_gethostbyname() and the answer arrives in dnsFound() while the main
+ * loop goes on. Numeric addresses (e.g. "192.168.1.17") are answered at once.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "dnsCache.h"
+
+extern "C" {
+#include "lwip/err.h"
+#include "lwip/dns.h"
+}
+
+extern int debug;
+
+struct DnsEntry {
+	const char   *host;
+	IPAddress     ip;							// Last good address
+	bool          valid;
+	volatile bool pending;						// Waiting for dnsFound()
+	uint16_t      gen;							// Lookup number, a late answer has an old one
+	uint32_t      start;						// millis() the lookup started
+	uint32_t      next;							// millis() the next lookup is due
+	uint32_t      lookups;
+	uint32_t      failures;
+	uint32_t      changes;						// Address differed from the previous one
+	uint32_t      latencyLast;					// ms
+	uint32_t      latencyMax;
+	uint32_t      updated;						// millis() of the last good answer
+};
+
+DnsEntry dnsTable[DNS_ENTRIES];
+int      dnsCount = 0;
+
+
+// ----------------------------------------------------------------------------
+// Store the result of a lookup
+// ----------------------------------------------------------------------------
+static void dnsResult(int i, ip_addr_t *ipaddr) {
+	DnsEntry *e = &dnsTable[i];
+	uint32_t now = millis();
+
+	e->pending = false;
+	e->latencyLast = now - e->start;
+	if (e->latencyLast > e->latencyMax) e->latencyMax = e->latencyLast;
+
+	if ((ipaddr == NULL) || (ipaddr->addr == 0)) {
+		e->failures++;
+		e->next = now + DNS_RETRY_MS;
+		if (debug >= 1) {
+			Serial.print(F("dnsCache:: lookup failed for "));
+			Serial.println(e->host);
+		}
+		return;
+	}
+
+	IPAddress ip(ipaddr->addr);
+	if (e->valid && (ip != e->ip)) e->changes++;
+	e->ip = ip;
+	e->valid = true;
+	e->updated = now;
+	e->next = now + DNS_REFRESH_MS;
+	if (debug >= 2) {
+		Serial.print(F("dnsCache:: "));
+		Serial.print(e->host);
+		Serial.print(F(" is "));
+		Serial.println(e->ip);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Callback of dns_gethostbyname(). arg has the index in dnsTable in the low
+// byte and the generation of the lookup above it. The answer to a lookup
+// that timed out can come in while the next one is pending; its generation
+// does not match and it is ignored.
+// ----------------------------------------------------------------------------
+static void dnsFound(const char *name, ip_addr_t *ipaddr, void *arg) {
+	uint32_t tag = (uint32_t)(intptr_t) arg;
+	int i = tag & 0xFF;
+	if ((i >= dnsCount) || !dnsTable[i].pending) return;			// Timed out already
+	if ((uint16_t)(tag >> 8) != dnsTable[i].gen) return;			// Answer to an older lookup
+	dnsResult(i, ipaddr);
+}
+
+// ----------------------------------------------------------------------------
+// Add a host name to the cache. The first lookup is done by dnsService().
+// Returns the index to use with dnsGet(), or -1 when the table is full.
+// ----------------------------------------------------------------------------
+int dnsAdd(const char *host) {
+	for (int i=0; i<dnsCount; i++) {
+		if (strcmp(dnsTable[i].host, host) == 0) return(i);
+	}
+	if (dnsCount >= DNS_ENTRIES) return(-1);
+
+	DnsEntry *e = &dnsTable[dnsCount];
+	*e = DnsEntry();
+	e->host = host;
+	e->next = millis();
+	return(dnsCount++);
+}
+
+// ----------------------------------------------------------------------------
+// Last good address of entry i. Returns false when there is none yet.
+// ----------------------------------------------------------------------------
+bool dnsGet(int i, IPAddress &ip) {
+	if ((i < 0) || (i >= dnsCount) || !dnsTable[i].valid) return(false);
+	ip = dnsTable[i].ip;
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Start the lookups that are due and time out those without an answer.
+// Called from the main loop; does not wait.
+// ----------------------------------------------------------------------------
+void dnsService(bool connected) {
+	uint32_t now = millis();
+
+	for (int i=0; i<dnsCount; i++) {
+		DnsEntry *e = &dnsTable[i];
+
+		if (e->pending) {
+			if ((now - e->start) >= DNS_TIMEOUT_MS) dnsResult(i, NULL);
+			continue;
+		}
+		if (!connected || ((int32_t)(now - e->next) < 0)) continue;
+
+		ip_addr_t addr;
+		e->lookups++;
+		e->gen++;
+		e->start = now;
+		e->pending = true;
+		uint32_t tag = ((uint32_t) e->gen << 8) | i;
+		err_t err = dns_gethostbyname(e->host, &addr, dnsFound, (void *)(intptr_t) tag);
+		if (err == ERR_OK) {
+			dnsResult(i, &addr);						// Numeric or in the lwIP cache
+		}
+		else if (err != ERR_INPROGRESS) {
+			dnsResult(i, NULL);
+		}
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Look up all names again at the next dnsService(), e.g. after a reconnect
+// ----------------------------------------------------------------------------
+void dnsRefreshAll() {
+	for (int i=0; i<dnsCount; i++) {
+		if (!dnsTable[i].pending) dnsTable[i].next = millis();
+	}
+}
+
+const char *dnsHost(int i)      { return(dnsTable[i].host); }
+uint32_t dnsLookups(int i)      { return(dnsTable[i].lookups); }
+uint32_t dnsFailures(int i)     { return(dnsTable[i].failures); }
+uint32_t dnsChanges(int i)      { return(dnsTable[i].changes); }
+uint32_t dnsLatencyLast(int i)  { return(dnsTable[i].latencyLast); }
+uint32_t dnsLatencyMax(int i)   { return(dnsTable[i].latencyMax); }
+
+// Seconds since the last good answer
+uint32_t dnsAge(int i) {
+	if (!dnsTable[i].valid) return(0);
+	return((millis() - dnsTable[i].updated) / 1000);
+}
@@ -0,0 +1,28 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway DNS cache
+//
+// The server names (TTN, SERVER2, NTP) are resolved in the background with
+// dns_gethostbyname() and refreshed every DNS_REFRESH_MS. The last good address is
+// kept when a refresh fails, so a lookup is never in the path of a packet.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define DNS_ENTRIES      4				// Host names in the cache
+#define DNS_REFRESH_MS   3600000		// Look up again after this time (1 hour)
+#define DNS_RETRY_MS     10000			// Look up again after a failure
+#define DNS_TIMEOUT_MS   5000			// A lookup that did not answer has failed
+
+// Functions:
+int dnsAdd(const char * );
+bool dnsGet(int , IPAddress & );
+void dnsService(bool );
+void dnsRefreshAll( void );
+const char *dnsHost(int );
+uint32_t dnsLookups(int );
+uint32_t dnsFailures(int );
+uint32_t dnsChanges(int );
+uint32_t dnsLatencyLast(int );
+uint32_t dnsLatencyMax(int );
+uint32_t dnsAge(int );
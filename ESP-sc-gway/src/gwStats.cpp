@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Gateway statistics with rolling windows.
+ * statInc() adds one to the total, the current stat interval, the current
+ * 5 minute slot and the current hour slot. The hour and day figures are the
+ * sums of their slots, so they cover 55-60 minutes and 23-24 hours.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "gwStats.h"
+
+uint32_t statTot[ST_COUNT];
+uint32_t statCur[ST_COUNT];						// Current stat interval
+uint32_t statLast[ST_COUNT];					// Interval reported in the last stat
+uint16_t statSlot[STAT_HOUR_SLOTS][ST_COUNT];	// 5 minute slots
+uint32_t statHourSlot[STAT_DAY_SLOTS][ST_COUNT];
+uint8_t  statSlotIndex = 0;
+uint8_t  statHourIndex = 0;
+uint32_t statSlotStart = 0;						// millis() at the start of the current slot
+
+const char *statNames[ST_COUNT] = {
+	"RX Received", "RX CRC OK", "RX CRC Error", "RX No CRC", "RX Ring Overrun",
+	"RX Filtered", "RX Duplicate", "RX Forwarded",
+	"PUSH_DATA Sent", "PUSH_ACK Received", "PULL_RESP Received",
+	"TX Accepted", "TX Too Late", "TX Too Early", "TX Collision", "TX Bad Freq", "TX Power Reduced",
+	"TX Invalid", "TX Missed in Queue", "TX Timeout", "TX Done"
+};
+
+// ----------------------------------------------------------------------------
+// Count one event of counter id
+// ----------------------------------------------------------------------------
+void statInc(int id) {
+	statTot[id]++;
+	statCur[id]++;
+	if (statSlot[statSlotIndex][id] < 0xFFFF) statSlot[statSlotIndex][id]++;
+	statHourSlot[statHourIndex][id]++;
+}
+
+// ----------------------------------------------------------------------------
+// Move to the next slot when the current one is full. Called from the main
+// loop; after a long stall all the slots that passed are cleared.
+// ----------------------------------------------------------------------------
+void statService() {
+	uint32_t now = millis();
+	int n = 0;
+
+	while ((now - statSlotStart >= STAT_SLOT_MS) && (n++ < STAT_HOUR_SLOTS * STAT_DAY_SLOTS)) {
+		statSlotStart += STAT_SLOT_MS;
+		statSlotIndex = (statSlotIndex + 1) % STAT_HOUR_SLOTS;
+		memset(statSlot[statSlotIndex], 0, sizeof(statSlot[0]));
+		if (statSlotIndex == 0) {
+			statHourIndex = (statHourIndex + 1) % STAT_DAY_SLOTS;
+			memset(statHourSlot[statHourIndex], 0, sizeof(statHourSlot[0]));
+		}
+	}
+	if (now - statSlotStart >= STAT_SLOT_MS) statSlotStart = now;
+}
+
+// ----------------------------------------------------------------------------
+// Close the current stat interval. statLastInterval() then returns its counts
+// until the next call. Called by sendstat().
+// ----------------------------------------------------------------------------
+void statIntervalEnd() {
+	memcpy(statLast, statCur, sizeof(statLast));
+	memset(statCur, 0, sizeof(statCur));
+}
+
+uint32_t statLastInterval(int id) {
+	return(statLast[id]);
+}
+
+uint32_t statHour(int id) {
+	uint32_t sum = 0;
+	for (int i=0; i<STAT_HOUR_SLOTS; i++) sum += statSlot[i][id];
+	return(sum);
+}
+
+uint32_t statDay(int id) {
+	uint32_t sum = 0;
+	for (int i=0; i<STAT_DAY_SLOTS; i++) sum += statHourSlot[i][id];
+	return(sum);
+}
+
+uint32_t statTotal(int id) {
+	return(statTot[id]);
+}
+
+const char * statName(int id) {
+	return(statNames[id]);
+}
+
+void statReset() {
+	memset(statTot, 0, sizeof(statTot));
+	memset(statCur, 0, sizeof(statCur));
+	memset(statLast, 0, sizeof(statLast));
+	memset(statSlot, 0, sizeof(statSlot));
+	memset(statHourSlot, 0, sizeof(statHourSlot));
+}
@@ -0,0 +1,43 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway statistics
+//
+// One counter per stage of the uplink and downlink path. Every counter is kept as a
+// total, for the current stat interval (the rxnb, rxok, ... of the stat message),
+// for the last hour (12 slots of 5 minutes) and for the last 24 hours (24 slots of
+// 1 hour). The memory used is fixed; old slots are cleared by statService().
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+// Counters. ST_TX_RESULT + TX_ERR_x counts the sendPacket() results.
+#define ST_RX_RCV      0				// RxDone (rxnb)
+#define ST_RX_OK       1				// Payload CRC OK (rxok)
+#define ST_RX_BAD      2				// Payload CRC error
+#define ST_RX_NOCRC    3				// Received without a payload CRC
+#define ST_RX_OVR      4				// Lost, RX ring full
+#define ST_RX_FILTER   5				// Dropped by the LoRaWAN filter
+#define ST_RX_DUP      6				// Dropped as duplicate
+#define ST_RX_FWD      7				// Forwarded (rxfw)
+#define ST_UP_PUSH     8				// PUSH_DATA sent, all servers
+#define ST_UP_ACK      9				// PUSH_ACK received, all servers
+#define ST_DW_RCV      10				// PULL_RESP received (dwnb)
+#define ST_TX_RESULT   11				// 7 counters, TX_ERR_NONE .. TX_ERR_INVALID
+#define ST_TX_LATE     18				// Accepted but missed in the queue
+#define ST_TX_TIMEOUT  19				// No TxDone
+#define ST_TX_OK       20				// Transmitted (txnb)
+#define ST_COUNT       21
+
+#define STAT_SLOT_MS     300000UL		// One slot of the hour window
+#define STAT_HOUR_SLOTS  12
+#define STAT_DAY_SLOTS   24				// One slot per hour
+
+// Functions:
+void statInc(int );
+void statService( void );
+void statIntervalEnd( void );
+uint32_t statLastInterval(int );
+uint32_t statHour(int );
+uint32_t statDay(int );
+uint32_t statTotal(int );
+const char * statName(int );
+void statReset( void );
@@ -0,0 +1,363 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Store and forward of uplink messages on SPIFFS.
+ *
+ * Every record is the PUSH_DATA message without its 12-byte header:
+ *	- JRNL_MAGIC (1 byte)
+ *	- length of the JSON body, little endian (2 bytes)
+ *	- sum of the body bytes (1 byte)
+ *	- the JSON body {"rxpk":[...]} with the original tmst of every frame
+ * On replay a new header (new token) is put in front of the body.
+ *
+ * Records are collected in RAM and written in one go to limit flash wear.
+ * Only the position in the oldest segment is kept in RAM, so after a restart
+ * a partly replayed segment is sent again from the start (the servers drop
+ * the duplicates).
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include <FS.h>
+#include "ESP-sc-gway.h"
+#include "loraModem.h"
+#include "journal.h"
+
+extern int debug;
+
+#define JRNL_HDR_SIZE  4
+#define JRNL_MAX_BODY  (_BATCH_BYTES - 12)
+
+bool     jrnlMounted = false;
+uint32_t jrnlTailSeq = 0;						// Oldest segment, replay reads from here
+uint32_t jrnlHeadSeq = 0;						// Segment that new records go to
+uint32_t jrnlReadPos = 0;						// Read offset in the tail segment
+uint16_t jrnlReadCount = 0;						// Records replayed from the tail segment
+uint16_t jrnlSegCount[JRNL_SEGMENTS];			// Records per segment, index is seq % JRNL_SEGMENTS
+uint32_t jrnlSegBytes[JRNL_SEGMENTS];			// Bytes per segment, including the RAM buffer
+
+uint8_t  jrnlWbuf[JRNL_WBUF_SIZE];				// Records not yet written to the head segment
+int      jrnlWbufLen = 0;
+int      jrnlWbufCount = 0;
+uint32_t jrnlWbufTime = 0;						// millis() of the first record in jrnlWbuf
+
+uint8_t  jrnlBuf[12 + JRNL_MAX_BODY + 1];		// Replay buffer, room for the header
+
+uint32_t jrnlLastAppend = 0;
+uint32_t jrnlLastReplay = 0;
+
+// Statistics
+uint32_t jrnlDepth = 0;							// Records waiting for replay
+uint32_t jrnlWritten = 0;
+uint32_t jrnlReplayed = 0;
+uint32_t jrnlDropped = 0;
+
+
+// ----------------------------------------------------------------------------
+// Helper functions
+// ----------------------------------------------------------------------------
+static void jrnlPath(char *path, uint32_t seq) {
+	sprintf(path, "%s%lu", JRNL_DIR, (unsigned long) seq);
+}
+
+static uint8_t jrnlSum(uint8_t *buf, int len) {
+	uint8_t s = 0;
+	for (int i=0; i<len; i++) s += buf[i];
+	return(s);
+}
+
+// Append data to segment seq. Returns true when everything was written.
+static bool jrnlWrite(uint32_t seq, uint8_t *hdr, int hlen, uint8_t *buf, int len) {
+	char path[16];
+	jrnlPath(path, seq);
+	File f = SPIFFS.open(path, "a");
+	if (!f) return(false);
+	bool ok = true;
+	if ((hlen > 0) && (f.write(hdr, hlen) != (size_t) hlen)) ok = false;
+	if (ok && (f.write(buf, len) != (size_t) len)) ok = false;
+	f.close();
+	return(ok);
+}
+
+// Read the record at pos in f into jrnlBuf + 12. Returns the body length
+// or -1 when the record is not complete or not valid.
+static int jrnlRead(File &f, uint32_t pos) {
+	uint8_t hdr[JRNL_HDR_SIZE];
+
+	if (!f.seek(pos)) return(-1);
+	if (f.read(hdr, JRNL_HDR_SIZE) != JRNL_HDR_SIZE) return(-1);
+	int len = hdr[1] | (hdr[2] << 8);
+	if ((hdr[0] != JRNL_MAGIC) || (len > JRNL_MAX_BODY)) return(-1);
+	if (f.read(jrnlBuf + 12, len) != len) return(-1);
+	if (jrnlSum(jrnlBuf + 12, len) != hdr[3]) return(-1);
+	return(len);
+}
+
+// Remove a stat object that was sent along with the rxpk array (_BATCH_STAT)
+// from a replayed body, its values are stale. Returns the new length.
+// The stat of an rxpk object is a number, so "],"stat":{" can only be the
+// stat object behind the rxpk array. The closing } is moved behind the ].
+static int jrnlStripStat(uint8_t *body, int len) {
+	const char *key = "],\"stat\":{";
+	int klen = strlen(key);
+	for (int i = len - klen; i > 0; i--) {
+		if (memcmp(body + i, key, klen) == 0) {
+			body[i + 1] = '}';
+			return(i + 2);
+		}
+	}
+	return(len);
+}
+
+// Drop what is left of the tail segment and move on to the next one
+static void jrnlDropTail() {
+	char path[16];
+	int t = jrnlTailSeq % JRNL_SEGMENTS;
+	uint16_t left = jrnlSegCount[t] - jrnlReadCount;
+
+	jrnlDropped += left;
+	jrnlDepth -= left;
+	jrnlPath(path, jrnlTailSeq);
+	SPIFFS.remove(path);
+	jrnlSegCount[t] = 0;
+	jrnlSegBytes[t] = 0;
+	jrnlReadPos = 0;
+	jrnlReadCount = 0;
+	if (jrnlTailSeq != jrnlHeadSeq) jrnlTailSeq++;
+	else jrnlWbufLen = jrnlWbufCount = 0;			// Head segment is gone as well
+}
+
+// Count the valid records of an existing segment
+static void jrnlScan(uint32_t seq) {
+	char path[16];
+	int i = seq % JRNL_SEGMENTS;
+	uint32_t pos = 0;
+	int len;
+
+	jrnlSegCount[i] = 0;
+	jrnlPath(path, seq);
+	File f = SPIFFS.open(path, "r");
+	if (!f) { jrnlSegBytes[i] = 0; return; }
+	while ((len = jrnlRead(f, pos)) >= 0) {
+		pos += JRNL_HDR_SIZE + len;
+		jrnlSegCount[i]++;
+	}
+	jrnlSegBytes[i] = f.size();
+	f.close();
+	jrnlDepth += jrnlSegCount[i];
+}
+
+
+// ----------------------------------------------------------------------------
+// Mount SPIFFS and find the segments left from before a restart.
+// New records always go to a new segment, never behind old (maybe torn) data.
+// ----------------------------------------------------------------------------
+void journalInit() {
+	uint32_t minSeq = 0xFFFFFFFF;
+	uint32_t maxSeq = 0;
+	bool found = false;
+
+	jrnlMounted = SPIFFS.begin();
+	if (!jrnlMounted) {
+		Serial.println(F("journalInit:: SPIFFS mount failed, journal disabled"));
+		return;
+	}
+
+	Dir dir = SPIFFS.openDir(JRNL_DIR);
+	while (dir.next()) {
+		uint32_t seq = strtoul(dir.fileName().c_str() + strlen(JRNL_DIR), NULL, 10);
+		if (seq < minSeq) minSeq = seq;
+		if (seq > maxSeq) maxSeq = seq;
+		found = true;
+	}
+	if (!found) return;
+
+	// Keep room for the new head segment
+	if (maxSeq - minSeq >= JRNL_SEGMENTS - 1) {
+		dir = SPIFFS.openDir(JRNL_DIR);
+		while (dir.next()) {
+			String name = dir.fileName();
+			uint32_t seq = strtoul(name.c_str() + strlen(JRNL_DIR), NULL, 10);
+			if (seq + (JRNL_SEGMENTS - 1) <= maxSeq) SPIFFS.remove(name.c_str());
+		}
+		minSeq = maxSeq - (JRNL_SEGMENTS - 2);
+	}
+
+	for (uint32_t seq = minSeq; seq <= maxSeq; seq++) jrnlScan(seq);
+	jrnlTailSeq = minSeq;
+	jrnlHeadSeq = maxSeq + 1;
+	jrnlSegCount[jrnlHeadSeq % JRNL_SEGMENTS] = 0;
+	jrnlSegBytes[jrnlHeadSeq % JRNL_SEGMENTS] = 0;
+
+	Serial.print(F("journalInit:: messages to replay: "));
+	Serial.println(jrnlDepth);
+}
+
+// ----------------------------------------------------------------------------
+// Write the RAM buffer to the head segment
+// ----------------------------------------------------------------------------
+void journalFlush() {
+	if (jrnlWbufLen == 0) return;
+
+	if (!jrnlWrite(jrnlHeadSeq, NULL, 0, jrnlWbuf, jrnlWbufLen)) {
+		int h = jrnlHeadSeq % JRNL_SEGMENTS;
+		Serial.println(F("journalFlush:: ERROR writing SPIFFS"));
+		jrnlSegCount[h] -= jrnlWbufCount;
+		jrnlSegBytes[h] -= jrnlWbufLen;
+		jrnlDepth -= jrnlWbufCount;
+		jrnlDropped += jrnlWbufCount;
+	}
+	jrnlWbufLen = 0;
+	jrnlWbufCount = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Store a PUSH_DATA message (with its 12-byte header) in the journal.
+// Messages without rxpk objects (stat only) are not stored, nor is the
+// record that is being replayed (jrnlBuf): it is still in the journal.
+// Returns true when the message was accepted.
+// ----------------------------------------------------------------------------
+bool journalAppend(uint8_t *msg, int length) {
+	if (!jrnlMounted) return(false);
+	if (msg == jrnlBuf) return(false);
+	if ((length <= 12) || (msg[3] != PKT_PUSH_DATA)) return(false);
+	if (strncmp((char *)(msg + 12), "{\"rxpk\"", 7) != 0) return(false);
+
+	int body = length - 12;
+	int rec = JRNL_HDR_SIZE + body;
+	if (body > JRNL_MAX_BODY) {
+		jrnlDropped++;
+		return(false);
+	}
+
+	int h = jrnlHeadSeq % JRNL_SEGMENTS;
+	if (jrnlSegBytes[h] + rec > JRNL_SEG_SIZE) {		// Start a new segment
+		journalFlush();
+		if (jrnlHeadSeq - jrnlTailSeq + 2 >= JRNL_SEGMENTS) {
+			if (debug >= 1) Serial.println(F("journalAppend:: journal full, oldest segment dropped"));
+			jrnlDropTail();
+		}
+		jrnlHeadSeq++;
+		h = jrnlHeadSeq % JRNL_SEGMENTS;
+		jrnlSegCount[h] = 0;
+		jrnlSegBytes[h] = 0;
+	}
+
+	uint8_t hdr[JRNL_HDR_SIZE];
+	hdr[0] = JRNL_MAGIC;
+	hdr[1] = body & 0xFF;
+	hdr[2] = body >> 8;
+	hdr[3] = jrnlSum(msg + 12, body);
+
+	if (jrnlWbufLen + rec > JRNL_WBUF_SIZE) journalFlush();
+	if (rec > JRNL_WBUF_SIZE) {						// Too big for the buffer, write now
+		if (!jrnlWrite(jrnlHeadSeq, hdr, JRNL_HDR_SIZE, msg + 12, body)) {
+			Serial.println(F("journalAppend:: ERROR writing SPIFFS"));
+			jrnlDropped++;
+			return(false);
+		}
+	}
+	else {
+		if (jrnlWbufLen == 0) jrnlWbufTime = millis();
+		memcpy(jrnlWbuf + jrnlWbufLen, hdr, JRNL_HDR_SIZE);
+		memcpy(jrnlWbuf + jrnlWbufLen + JRNL_HDR_SIZE, msg + 12, body);
+		jrnlWbufLen += rec;
+		jrnlWbufCount++;
+	}
+
+	jrnlSegCount[h]++;
+	jrnlSegBytes[h] += rec;
+	jrnlDepth++;
+	jrnlWritten++;
+	jrnlLastAppend = millis();
+
+	if (debug >= 2) {
+		Serial.print(F("journalAppend:: stored "));
+		Serial.print(body);
+		Serial.print(F(" bytes, depth "));
+		Serial.println(jrnlDepth);
+	}
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Called from the main loop. Writes the RAM buffer when it is old enough and,
+// when connected and nothing was journaled for JRNL_HOLD_MS, sends the
+// oldest message again. At most one message per JRNL_REPLAY_MS.
+// ----------------------------------------------------------------------------
+void journalService(bool connected, journalSend_t send) {
+	uint32_t now = millis();
+
+	if ((jrnlWbufLen > 0) && ((now - jrnlWbufTime) >= JRNL_FLUSH_MS)) journalFlush();
+
+	if (!connected || (jrnlDepth == 0)) return;
+	if ((now - jrnlLastAppend) < JRNL_HOLD_MS) return;
+	if ((now - jrnlLastReplay) < JRNL_REPLAY_MS) return;
+	jrnlLastReplay = now;
+
+	journalFlush();
+
+	// Skip segments that are done
+	int t = jrnlTailSeq % JRNL_SEGMENTS;
+	while ((jrnlTailSeq != jrnlHeadSeq) && (jrnlReadCount >= jrnlSegCount[t])) {
+		jrnlDropTail();
+		t = jrnlTailSeq % JRNL_SEGMENTS;
+	}
+	if (jrnlReadCount >= jrnlSegCount[t]) return;
+
+	char path[16];
+	jrnlPath(path, jrnlTailSeq);
+	File f = SPIFFS.open(path, "r");
+	int len = -1;
+	if (f) {
+		len = jrnlRead(f, jrnlReadPos);
+		f.close();
+	}
+	if (len < 0) {
+		Serial.println(F("journalService:: bad record, segment dropped"));
+		jrnlDropTail();
+		return;
+	}
+
+	int rec = len;
+	len = jrnlStripStat(jrnlBuf + 12, len);
+	if (!send(jrnlBuf, 12 + len)) return;			// Try again later
+
+	jrnlReadPos += JRNL_HDR_SIZE + rec;
+	jrnlReadCount++;
+	jrnlDepth--;
+	jrnlReplayed++;
+
+	if (debug >= 2) {
+		Serial.print(F("journalService:: replayed "));
+		Serial.print(len);
+		Serial.print(F(" bytes, depth "));
+		Serial.println(jrnlDepth);
+	}
+
+	if (jrnlReadCount >= jrnlSegCount[t]) {			// Segment done, remove it
+		jrnlPath(path, jrnlTailSeq);
+		SPIFFS.remove(path);
+		jrnlSegCount[t] = 0;
+		jrnlSegBytes[t] = 0;
+		jrnlReadPos = 0;
+		jrnlReadCount = 0;
+		if (jrnlTailSeq != jrnlHeadSeq) jrnlTailSeq++;
+	}
+}
+
+uint32_t journalDepth()    { return(jrnlDepth); }
+uint32_t journalWritten()  { return(jrnlWritten); }
+uint32_t journalReplayed() { return(jrnlReplayed); }
+uint32_t journalDropped()  { return(jrnlDropped); }
+
+uint32_t journalBytes() {
+	uint32_t b = 0;
+	for (int i=0; i<JRNL_SEGMENTS; i++) b += jrnlSegBytes[i];
+	return(b - jrnlReadPos);
+}
@@ -0,0 +1,35 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway uplink journal
+//
+// PUSH_DATA messages with rxpk objects that could not be delivered (WiFi down, write
+// error, no PUSH_ACK) are stored on SPIFFS and sent again when the link is back.
+// The journal is a ring of JRNL_SEGMENTS files of at most JRNL_SEG_SIZE bytes. When
+// it is full the oldest segment is dropped. One file of the ring is kept free, it
+// takes the new head segment after a restart.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define JRNL_DIR         "/jr/"			// Segment files are /jr/<sequence number>
+#define JRNL_SEGMENTS    8				// Number of segment files in the ring
+#define JRNL_SEG_SIZE    16384			// Max bytes in one segment file
+#define JRNL_WBUF_SIZE   1024			// Records are collected in RAM before writing
+#define JRNL_FLUSH_MS    10000			// Write the RAM buffer at least this often
+#define JRNL_HOLD_MS     5000			// No replay until nothing was journaled this long
+#define JRNL_REPLAY_MS   250			// Min time between two replayed messages
+#define JRNL_MAGIC       0xA5			// First byte of every record
+
+// Send function used for a replay. The message starts with 12 free bytes
+// for the PUSH_DATA header; length includes these. Returns true when sent.
+typedef bool (*journalSend_t)(uint8_t *msg, int length);
+
+// Functions:
+void journalInit( void );
+bool journalAppend(uint8_t *, int );
+void journalService(bool , journalSend_t );
+void journalFlush( void );
+uint32_t journalDepth( void );
+uint32_t journalBytes( void );
+uint32_t journalWritten( void );
+uint32_t journalReplayed( void );
+uint32_t journalDropped( void );
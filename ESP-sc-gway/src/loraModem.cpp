@@ -24,14 +24,20 @@
  *
  *******************************************************************************/
 #include <Arduino.h>
-#include <ArduinoJson.h>
 #include <SPI.h>
 #include "Base64.h"
 #include "loraModem.h"
 #include "aux.h"
+#include "txpk.h"
+#include "dedup.h"
+#include "lwFilter.h"
+#include "gwStats.h"
+#include "ntpClient.h"
+#include "timeCal.h"
+#include "prof.h"
 
 // Our code should correct the server timing
-long txDelay= 0000;								// extra delay time on top of server TMST
+int32_t txDelay= 0;								// manual trim on top of server TMST, uSec, may be negative
 
 // Lora Modem pins:
 int ssPin;
@@ -44,18 +50,94 @@ int sf;
 // Modem type
 bool sx1272 = true;
 
-uint32_t cp_nb_rx_rcv;
-uint32_t cp_nb_rx_ok;
-uint32_t cp_nb_rx_bad;
-uint32_t cp_nb_rx_nocrc;
-uint32_t cp_up_pkt_fwd;
-
 int loraDebug = 0;
 byte receivedbytes;
 uint32_t lastTmst = 0;
-uint8_t message[256];
-char b64[256];
-extern uint8_t MAC_address[6];
+
+// Constant parts of the rxpk JSON object. The frequency does not change
+// so the part from "chan" up to "datr":"SF is built once by initRxpk().
+char rxpkFixed[80];
+int  rxpkFixedLen = 0;
+
+// Rest of "datr" and "codr" per spreading factor, SF7 .. SF12
+const char * const rxpkDatr[SF12 - SF7 + 1] = {
+	"7BW125\",\"codr\":\"4/5\",\"lsnr\":",
+	"8BW125\",\"codr\":\"4/5\",\"lsnr\":",
+	"9BW125\",\"codr\":\"4/5\",\"lsnr\":",
+	"10BW125\",\"codr\":\"4/5\",\"lsnr\":",
+	"11BW125\",\"codr\":\"4/5\",\"lsnr\":",
+	"12BW125\",\"codr\":\"4/5\",\"lsnr\":"
+};
+uint8_t rxpkDatrLen[SF12 - SF7 + 1];
+
+// DIO0 interrupt state. The ISR only takes the timestamp and raises the flag,
+// all SPI work is done from pollLoraModem() in the main loop.
+volatile uint32_t dio0Tmst = 0;
+volatile bool dio0Event = false;
+
+// Received packet record, filled when the FIFO is drained and read back
+// by receivePacket() when the JSON message is built.
+struct LoraRxPkt {
+	uint64_t tmst;								// micros64() at RxDone
+	uint32_t fifo;								// micros() when the FIFO was read
+	long     snr;
+	int      prssi;								// Packet RSSI
+	int      rssi;								// Current RSSI at time of drain
+	uint8_t  sf;								// Spreading factor the packet was received on
+	uint8_t  size;
+	uint8_t  payload[256];
+};
+
+// Single producer (pollLoraModem) / single consumer (receivePacket) ring.
+// Head is only written by the producer, tail only by the consumer, so no
+// locking is needed.
+LoraRxPkt rxRing[RX_RING_SIZE];
+volatile uint8_t rxRingHead = 0;
+volatile uint8_t rxRingTail = 0;
+
+// Downlink record as accepted by sendPacket() and waiting for its tmst.
+struct LoraTxPkt {
+	uint64_t tmst;								// micros64() at which TX must start
+	uint32_t freq;								// Hz
+	uint8_t  sf;
+	uint16_t bw;								// kHz
+	uint8_t  cr;								// 5..8 for 4/5 .. 4/8
+	uint8_t  powe;
+	uint8_t  crc;
+	uint8_t  iiq;
+	uint8_t  size;
+	uint32_t airtime;							// uSec, for the collision check
+	uint8_t  payload[256];
+};
+
+// JIT queue, txQueue[0] is always the first downlink to go out.
+LoraTxPkt txQueue[TX_QUEUE_SIZE];
+uint8_t txQueueLen = 0;
+
+// Transmitter state, handled by pollLoraModem()
+#define TX_IDLE  0
+#define TX_BUSY  1								// OPMODE_TX given, waiting for TxDone
+#define TX_ARMED 2								// FIFO loaded, waiting for txFireAt
+uint8_t txState = TX_IDLE;
+uint64_t txFireAt = 0;							// micros64() at which OPMODE_TX is given
+uint8_t  txOpmode = 0;							// REG_OPMODE value that starts the armed TX
+uint32_t txStartTime = 0;
+uint32_t txAirtimeUs = 0;						// Calculated time on air of the current TX
+uint64_t txBusyUntil = 0;						// micros64() at which the current TX ends
+
+// Receiver state. In CAD mode the receiver cycles CAD over SF7-SF12 and only
+// switches to RX on the SF where a preamble was detected.
+#define RX_CONT 0								// Continuous receive on sf
+#define RX_CAD  1								// CAD running on cadSf
+#define RX_LOCK 2								// Receiving on cadSf after a detection
+uint8_t rxState = RX_CONT;
+bool cadMode = false;
+uint8_t cadSf = SF7;
+uint32_t rxLockStart = 0;
+uint32_t rxLockWindow = 0;
+
+uint32_t cp_cad_det[SF12-SF7+1];				// CAD detections per SF
+uint32_t cp_nb_rx_sf[SF12-SF7+1];				// Packets received OK per SF
 
 // Set parameters
 void setLoraModem( int _ssPin , int _dio0, int _dio1, int _dio2, int _rst, int _sf, bool _sx1272 ) {
@@ -72,20 +154,22 @@ void setLoraDebug(int mode  ) {
   loraDebug = mode;
 }
 
-uint32_t getLoraRXRCV() {
-  return cp_nb_rx_rcv;
+void setLoraCad(bool mode) {
+  cadMode = mode;
 }
-uint32_t getLoraRXOK() {
-  return cp_nb_rx_ok;
+
+bool getLoraCad() {
+  return cadMode;
 }
-uint32_t getLoraRXBAD() {
-  return cp_nb_rx_bad;
+
+uint8_t getLoraTXQUEUE() {
+  return txQueueLen;
 }
-uint32_t getLoraRXNOCRC() {
-  return cp_nb_rx_nocrc;
+uint32_t getLoraCADDET(int s) {
+  return cp_cad_det[s - SF7];
 }
-uint32_t getLoraPKTFWD() {
-  return cp_up_pkt_fwd;
+uint32_t getLoraRXSF(int s) {
+  return cp_nb_rx_sf[s - SF7];
 }
 
 int getLoraSF() {
@@ -93,11 +177,10 @@ int getLoraSF() {
 }
 
 void resetLoraStats() {
-   cp_nb_rx_rcv = 0;
-   cp_nb_rx_ok = 0;
-   cp_nb_rx_bad = 0;
-   cp_nb_rx_nocrc = 0;
-   cp_up_pkt_fwd = 0;
+   for (int i = 0; i <= SF12-SF7; i++) {
+     cp_cad_det[i] = 0;
+     cp_nb_rx_sf[i] = 0;
+   }
 }
 
 // ============================================================================
@@ -161,31 +244,80 @@ void writeRegister(byte addr, byte value)
 }
 
 
+// ----------------------------------------------------------------------------
+// Burst read of len consecutive bytes starting at register addr.
+// The chip select stays asserted and only one SPI transaction is opened for
+// the whole block. For REG_FIFO the transceiver does not increment the address
+// but pops the next FIFO byte instead, so this drains the FIFO in one go.
+// ----------------------------------------------------------------------------
+void readBuffer(byte addr, uint8_t *buf, uint8_t len)
+{
+	selectreceiver();
+	SPI.beginTransaction(SPISettings(50000, MSBFIRST, SPI_MODE0));
+	SPI.transfer(addr & 0x7F);
+	for (uint8_t i = 0; i < len; i++) {
+		buf[i] = SPI.transfer(0x00);
+	}
+	SPI.endTransaction();
+	unselectreceiver();
+}
+
+
+// ----------------------------------------------------------------------------
+// Burst write of len consecutive bytes starting at register addr.
+// Used to fill the FIFO (REG_FIFO) in one CS-asserted transaction.
+// ----------------------------------------------------------------------------
+void writeBuffer(byte addr, uint8_t *buf, uint8_t len)
+{
+	selectreceiver();
+	SPI.beginTransaction(SPISettings(50000, MSBFIRST, SPI_MODE0));
+	SPI.transfer(addr | 0x80);
+	for (uint8_t i = 0; i < len; i++) {
+		SPI.transfer(buf[i]);
+	}
+	SPI.endTransaction();
+	unselectreceiver();
+}
+
+
 // ----------------------------------------------------------------------------
 //  setRate is setting rate etc. for transmission
-//		Modem Config 1 (MC1) ==
+//		Modem Config 1 (MC1) == (bw<<4) | (cr<<1)
 //		Modem Config 2 (MC2) == (CRC_ON) | (sf<<4)
-//		Modem Config 3 (MC3) == 0x04 | (optional SF11/12 LOW DATA OPTIMIZE 0x08)
+//		Modem Config 3 (MC3) == 0x04 | (optional LOW DATA OPTIMIZE 0x08)
 //		sf == SF7 default 0x07, (SF7<<4) == SX72_MC2_SF7
-//		bw == 125 == 0x70
-//		cr == CR4/5 == 0x02
+//		bw == 125 == 0x70, 250 == 0x80, 500 == 0x90
+//		cr == CR4/5 == 0x02 .. CR4/8 == 0x08
 //		CRC_ON == 0x04
+//	On the sx1272 bw is in bits 7-6 of MC1 (125 == 0x00), cr in bits 5-3
+//	(CR4/5 == 0x08), and low data rate optimize is bit 0.
+//	Low data rate optimize is needed when a symbol takes longer than 16 mSec,
+//	so for SF11 and SF12 on 125 kHz and for SF12 on 250 kHz.
 // ----------------------------------------------------------------------------
-void setRate(uint8_t sf, uint8_t crc) {
+static bool lowDataRate(uint8_t sf, uint16_t bw) {
+	uint8_t bwi = (bw == 500) ? 2 : ((bw == 250) ? 1 : 0);
+	return((sf + 1 - bwi) >= 12);								// Symbol time >= 16 mSec
+}
+
+void setRate(uint8_t sf, uint16_t bw, uint8_t cr, uint8_t crc) {
 
 	uint8_t mc1=0, mc2=0, mc3=0;
+	uint8_t bwi = (bw == 500) ? 2 : ((bw == 250) ? 1 : 0);	// 0=125, 1=250, 2=500 kHz
+	bool ldro = lowDataRate(sf, bw);
+
+	if ((cr < 5) || (cr > 8)) cr = 5;
+
 	// Set rate based on Spreading Factor etc
     if (sx1272) {
-		  mc1= 0x0A;				// SX1276_MC1_BW_250 0x80 | SX1276_MC1_CR_4_5 0x02
+		  mc1= (bwi<<6) | ((cr-4)<<3) | 0x02;	// SX1272_MC1_BW_125==0x00 | SX1272_MC1_CR_4_5==0x08 | 0x02
 		  mc2= (sf<<4) | crc;
-		  // SX1276_MC1_BW_250 0x80 | SX1276_MC1_CR_4_5 0x02 | SX1276_MC1_IMPLICIT_HEADER_MODE_ON 0x01
-      if (sf == SF11 || sf == SF12) { mc1= 0x0B; }
+		  if (ldro) { mc1|= 0x01; }
     }
 	else {
-	    mc1= 0x72;				// SX1276_MC1_BW_125==0x70 | SX1276_MC1_CR_4_5==0x02
+	    mc1= ((7+bwi)<<4) | ((cr-4)<<1);	// SX1276_MC1_BW_125==0x70 | SX1276_MC1_CR_4_5==0x02
 		  mc2= (sf<<4) | crc;		// crc is 0x00 or 0x04==SX1276_MC2_RX_PAYLOAD_CRCON
 		  mc3= 0x04;				// 0x04; SX1276_MC3_AGCAUTO
-      if (sf == SF11 || sf == SF12) { mc3|= 0x08; }		// 0x08 | 0x04
+      if (ldro) { mc3|= 0x08; }		// 0x08 | 0x04
     }
 
 	// Implicit Header (IH), for class b beacons
@@ -210,18 +342,18 @@ void setRate(uint8_t sf, uint8_t crc) {
 
 
 // ----------------------------------------------------------------------------
-// Set the frequency for our gateway
-// The function has no parameter other than the freq setting used in init.
-// Since we are usin a 1ch gateway this value is set fixed.
+// Set the frequency (in Hz) for our gateway.
+// The receiver always uses LORA_freq, downlinks use the freq the server asks
+// for (RX2 is on 869.525 MHz in EU868).
 // ----------------------------------------------------------------------------
-void setFreq()
+void setFreq(uint32_t freq)
 {
 	if (loraDebug >= 2) {
 		Serial.print(F("setFreq using: "));
-		Serial.println(LORA_freq);
+		Serial.println(freq);
 	}
     // set frequency
-    uint64_t frf = ((uint64_t)LORA_freq << 19) / 32000000;
+    uint64_t frf = ((uint64_t)freq << 19) / 32000000;
     writeRegister(REG_FRF_MSB, (uint8_t)(frf>>16) );
     writeRegister(REG_FRF_MID, (uint8_t)(frf>> 8) );
     writeRegister(REG_FRF_LSB, (uint8_t)(frf>> 0) );
@@ -274,18 +406,89 @@ static void opmode (uint8_t mode) {
 // This DOWN function sends a payload to the LoRa node over the air
 // Radio must go back in standby mode as soon as the transmission is finished
 // ----------------------------------------------------------------------------
-bool sendPkt(uint8_t *payLoad, uint8_t payLength, uint32_t tmst)
+bool sendPkt(uint8_t *payLoad, uint8_t payLength)
 {
 	writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_TX_BASE_AD));	// 0x0D, 0x0E
 	writeRegister(REG_PAYLOAD_LENGTH, payLength);				// 0x22
-	for(int i = 0; i < payLength; i++)
-    {
-        writeRegister(REG_FIFO, payLoad[i]);					// 0x00
-    }
+	writeBuffer(REG_FIFO, payLoad, payLength);					// 0x00, one burst
 	return true;
 }
 
 
+// ----------------------------------------------------------------------------
+// Set the receiver modem configuration for spreading factor rsf.
+// Used for continuous receive as well as for the CAD scanner.
+// ----------------------------------------------------------------------------
+static void setRxRate(uint8_t rsf)
+{
+	// Set spreading Factor
+    if (sx1272) {
+        if (rsf == SF11 || rsf == SF12) {
+            writeRegister(REG_MODEM_CONFIG1,0x0B);
+        } else {
+            writeRegister(REG_MODEM_CONFIG1,0x0A);
+        }
+        writeRegister(REG_MODEM_CONFIG2,(rsf<<4) | 0x04);
+    } else {
+        if (rsf == SF11 || rsf == SF12) {
+            writeRegister(REG_MODEM_CONFIG3,0x0C);				// 0x08 | 0x04
+        } else {
+            writeRegister(REG_MODEM_CONFIG3,0x04);				// 0x04; SX1276_MC3_LOW_DATA_RATE_OPTIMIZE
+        }
+        writeRegister(REG_MODEM_CONFIG1,0x72);
+        writeRegister(REG_MODEM_CONFIG2,(rsf<<4) | 0x04);		// Set mc2 to (SF<<4) | CRC==0x04
+    }
+
+    if (rsf == SF10 || rsf == SF11 || rsf == SF12) {
+        writeRegister(REG_SYMB_TIMEOUT_LSB,0x05);
+    } else {
+        writeRegister(REG_SYMB_TIMEOUT_LSB,0x08);
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// Start Channel Activity Detection on spreading factor csf.
+// DIO0 is mapped to CadDone, the CadDetected flag is read from REG_IRQ_FLAGS
+// by pollLoraModem() once CadDone is signalled.
+// ----------------------------------------------------------------------------
+static void cadScanner(uint8_t csf)
+{
+	opmode(OPMODE_STANDBY);
+	cadSf = csf;
+	setRxRate(cadSf);
+
+	writeRegister(REG_IRQ_FLAGS_MASK, (uint8_t) ~(IRQ_LORA_CDDONE_MASK | IRQ_LORA_CDDETD_MASK));
+	writeRegister(REG_DIO_MAPPING_1, MAP_DIO0_LORA_CADDONE);	// Set CADDONE interrupt to dio0
+	writeRegister(REG_IRQ_FLAGS, 0xFF);
+
+	rxState = RX_CAD;
+	opmode(OPMODE_CAD);											// 0x80 | 0x07
+}
+
+
+// ----------------------------------------------------------------------------
+// CAD found a preamble on cadSf: receive on that spreading factor until
+// RxDone or until no packet shows up within the lock window.
+// ----------------------------------------------------------------------------
+static void rxLock()
+{
+	opmode(OPMODE_STANDBY);
+
+	writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_RX_BASE_AD));	// 0x0D, 0x0F
+	writeRegister(REG_IRQ_FLAGS_MASK, ~IRQ_LORA_RXDONE_MASK);	// Accept no interrupts except RXDONE
+	writeRegister(REG_DIO_MAPPING_1, MAP_DIO0_LORA_RXDONE);		// Set RXDONE interrupt to dio0
+	writeRegister(REG_IRQ_FLAGS, 0xFF);
+
+	// One symbol at BW125 is 2^SF * 8 uSec
+	rxLockStart = micros();
+	rxLockWindow = CAD_LOCK_SYMBOLS * ((uint32_t)8 << cadSf);
+
+	rxState = RX_LOCK;
+	opmode(OPMODE_RX);											// 0x80 | 0x05 (listen)
+}
+
+
 // ----------------------------------------------------------------------------
 // Setup the LoRa receiver on the connected transceiver.
 // - Determine the correct transceiver type (sx1272/RFM92 or sx1276/RFM95)
@@ -296,6 +499,9 @@ bool sendPkt(uint8_t *payLoad, uint8_t payLength, uint32_t tmst)
 // 1. Put the radio in LoRa mode
 // 2. Put modem in sleep or in standby
 // 3. Set Frequency
+//
+// In CAD mode the receiver does not listen continuously but starts scanning
+// all spreading factors from SF7.
 // ----------------------------------------------------------------------------
 void rxLoraModem()
 {
@@ -305,34 +511,13 @@ void rxLoraModem()
 	// Put the radio in sleep mode
   opmode(OPMODE_SLEEP);
 
-	// 3. Set frequency based on value in freq
-	setFreq();
+	// 3. Set frequency, always the receive channel (also after a downlink)
+	setFreq(LORA_freq);
 
   writeRegister(REG_SYNC_WORD, 0x34); // LoRaWAN public sync word
 
 	// Set spreading Factor
-    if (sx1272) {
-        if (sf == SF11 || sf == SF12) {
-            writeRegister(REG_MODEM_CONFIG1,0x0B);
-        } else {
-            writeRegister(REG_MODEM_CONFIG1,0x0A);
-        }
-        writeRegister(REG_MODEM_CONFIG2,(sf<<4) | 0x04);
-    } else {
-        if (sf == SF11 || sf == SF12) {
-            writeRegister(REG_MODEM_CONFIG3,0x0C);				// 0x08 | 0x04
-        } else {
-            writeRegister(REG_MODEM_CONFIG3,0x04);				// 0x04; SX1276_MC3_LOW_DATA_RATE_OPTIMIZE
-        }
-        writeRegister(REG_MODEM_CONFIG1,0x72);
-        writeRegister(REG_MODEM_CONFIG2,(sf<<4) | 0x04);		// Set mc2 to (SF<<4) | CRC==0x04
-    }
-
-    if (sf == SF10 || sf == SF11 || sf == SF12) {
-        writeRegister(REG_SYMB_TIMEOUT_LSB,0x05);
-    } else {
-        writeRegister(REG_SYMB_TIMEOUT_LSB,0x08);
-    }
+	setRxRate(sf);
 
 	// prevent node to node communication
 	writeRegister(REG_INVERTIQ,0x27);							// 0x33, 0x27; to reset from TX
@@ -347,10 +532,16 @@ void rxLoraModem()
     // Low Noise Amplifier used in receiver
     writeRegister(REG_LNA, LNA_MAX_GAIN);  						// 0x0C, 0x23
 
+	if (cadMode) {
+		cadScanner(SF7);
+		return;
+	}
+
 	  writeRegister(REG_IRQ_FLAGS_MASK, ~IRQ_LORA_RXDONE_MASK);	// Accept no interrupts except RXDONE
 	  writeRegister(REG_DIO_MAPPING_1, MAP_DIO0_LORA_RXDONE);		// Set RXDONE interrupt to dio0
 
 	// Set Continous Receive Mode
+	rxState = RX_CONT;
     opmode(OPMODE_RX);											// 0x80 | 0x05 (listen)
 
 	return;
@@ -361,76 +552,24 @@ void rxLoraModem()
 // This function implements the wait protocol needed for downstream transmissions.
 // Note: Timing of downstream and JoinAccept messages is VERY critical.
 //
-// As the ESP8266 watchdog will not like us to wait more than a few hundred
-// milliseconds (or it will kick in) we have to implement a simple way to wait
-// time in case we have to wait seconds before sending messages (e.g. for OTAA 5 or 6 seconds)
-// Without it, the system is known to crash in half of the cases it has to wait for
-// JOIN-ACCEPT messages to send.
+// The scheduler only runs the radio task again TX_SPIN_US before tmst (see
+// loraTxSlack), so what is left here is a short spin on delayMicroseconds().
 //
-// This function uses a combination of delay() statements and delayMicroseconds().
-// As we use delay() only when there is still enough time to wait and we use micros()
-// to make sure that delay() did not take too much time this works.
-//
-// Parameter: uint32-t tmst gives the micros() value when transmission should start.
-// ----------------------------------------------------------------------------
-void loraWait(uint32_t tmst) {
-
-	uint32_t startTime = micros();							// Start of the loraWait function
-	uint32_t nowTime;										// to prevent micros(0) to creep over 0xFFFFFF
-
-	if ((nowTime = micros()) > tmst) {
-		// If difference larger than 8 secs, no rollover. Waiting would take too long
-		if ((0xFFFFFFFF - nowTime + tmst) > 8000000)
-		{
-			Serial.print(F("loraWait:: ERROR, micros="));
-			Serial.print(nowTime);
-			Serial.print(F(", tmst="));
-			Serial.print(tmst);
-			Serial.print(F(", wait="));
-			Serial.println(0xFFFFFFFF - nowTime + tmst);
-			delay(100);
-			return;
-		}
-		if (loraDebug >= 1) {
-			Serial.print(F("Rollover, micros="));
-			Serial.print(nowTime);
-			Serial.print(F(", tmst="));
-			Serial.print(tmst);
-			Serial.print(F(", wait="));
-			Serial.println(0xFFFFFFFF - nowTime + tmst);
-		}
-	}
-	else if ((tmst - nowTime) > 8000000) {
-		Serial.print(F("Wait ERROR, micros="));
-		Serial.print(nowTime);
-		Serial.print(F(", tmst="));
-		Serial.print(tmst);
-		Serial.print(F(", wait="));
-		Serial.println(tmst - nowTime);
-		return;
-	}
-	else if (loraDebug >= 2) {
-		Serial.print(F("Waiting, micros="));
-		Serial.print(nowTime);
-		Serial.print(F(", tmst="));
-		Serial.print(tmst);
-		Serial.print(F(", wait="));
-		Serial.println(tmst - nowTime);
-		return;
-	}
+// Parameter: uint64_t tmst gives the micros64() value when transmission should
+// start. As the time base is 64-bit there is no rollover to deal with.
+// ----------------------------------------------------------------------------
+void loraWait(uint64_t tmst) {
 
-	// First deal with the situation of overflow, tmst < micros();
-	while ((nowTime = micros()) > tmst) {					// Buffer overflow situation, correct 2^32
-		// While we can wait 16000 usecs
-		if ((0xFFFFFFFF - nowTime + tmst) > 15000) delay(15);
-		else delayMicroseconds(0xFFFFFFFF - nowTime + tmst);	// Last uSec wait if longer times have been waited out.
+	int64_t wait;
+
+	if (loraDebug >= 2) {
+		Serial.print(F("Waiting, wait="));
+		Serial.println((int32_t)(tmst - micros64()));
 	}
 
-	while ((nowTime = micros()) < tmst) {
-		if ((tmst- nowTime) > 15000) delay(14);
-		else delayMicroseconds(tmst - nowTime);				// Last uSec wait if longer times have been waited out.
+	while ((wait = (int64_t)(tmst - micros64())) > 0) {
+		delayMicroseconds((uint32_t)wait);
 	}
-	delayMicroseconds(txDelay);								// extra correction (only positive numbers allowed)
 }
 
 
@@ -455,17 +594,26 @@ void loraWait(uint32_t tmst) {
 // 11. write REG LoRa Fifo Base Address
 // 12. write REG LoRa Fifo Addr Ptr
 // 13. write REG LoRa Payload Length
-// 14. Write buffer (byte by byte)
-// 15. opmode TX
+// 14. Write buffer (burst)
+// 15. opmode TX, by txFire()
+//
+// This function is called by pollLoraModem() shortly (TX_PREPARE_US) before
+// tmst. It leaves the radio armed and returns; pollLoraModem() calls txFire()
+// when tmst is less than TX_SPIN_US away and handles TxDone after that.
 // ----------------------------------------------------------------------------
 
-static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint32_t tmst,
-						uint8_t powe, uint32_t freq, uint8_t crc, uint8_t iiq)
+static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint64_t tmst,
+						uint8_t powe, uint32_t freq, uint8_t tsf, uint16_t bw, uint8_t cr,
+						uint8_t crc, uint8_t iiq)
 {
+	PROF_START(prep);
 	if (loraDebug>=1) {
 		Serial.print(F("txLoraModem:: "));
 		Serial.print(F("powe: ")); Serial.print(powe);
 		Serial.print(F(", freq: ")); Serial.print(freq);
+		Serial.print(F(", SF")); Serial.print(tsf);
+		Serial.print(F("BW")); Serial.print(bw);
+		Serial.print(F(", cr: 4/")); Serial.print(cr);
 		Serial.print(F(", crc: ")); Serial.print(crc);
 		Serial.print(F(", iiq: ")); Serial.print(iiq,HEX);
 		Serial.println();
@@ -479,15 +627,15 @@ static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint32_t tmst,
 
 	// 2. enter standby mode (required for FIFO loading))
 	opmode(OPMODE_STANDBY);
+	txOpmode = (readRegister(REG_OPMODE) & ~OPMODE_MASK) | OPMODE_TX;	// for txFire()
 
-	// 3. Init spreading factor and other Modem setting
-  //sf_t sf = _SPREADING;
-	setRate(sf, crc);
+	// 3. Init spreading factor and other Modem setting of this downlink
+	setRate(tsf, bw, cr, crc);
 
 	//writeRegister(REG_HOP_PERIOD, 0x00);						// 0x24 only for receivers
 
 	// 4. Init Frequency, config channel
-	setFreq();
+	setFreq(freq);
 
 	// 5. Config PA Ramp up time
 	writeRegister(REG_PARAMP, (readRegister(REG_PARAMP) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
@@ -508,6 +656,12 @@ static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint32_t tmst,
 	// 9. clear all radio IRQ flags
     writeRegister(REG_IRQ_FLAGS, 0xFF);
 
+	// An RxDone that came in before standby set dio0Event; from now on DIO0
+	// means TxDone, so drop it or it would end this transmission right away.
+	noInterrupts();
+	dio0Event = false;
+	interrupts();
+
 	// 10. mask all IRQs but TxDone
     writeRegister(REG_IRQ_FLAGS_MASK, ~IRQ_LORA_TXDONE_MASK);
 
@@ -515,32 +669,71 @@ static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint32_t tmst,
 	//opmode(OPMODE_FSTX);	// 0x02
 
 	// 11, 12, 13, 14. write the buffer to the FiFo
-	sendPkt(payLoad, payLength, tmst);
+	sendPkt(payLoad, payLength);
+
+	txFireAt = tmst + txDelay - calTxAdvance();				// manual trim and measured TX start latency
+	txState = TX_ARMED;
+	PROF_END(PROF_TXPREP, prep);
+}
+
+
+// ----------------------------------------------------------------------------
+// txFire
+// Wait the last uSecs out and start the armed transmission (step 15).
+// txStartTime is the start of the OPMODE_TX write, the SPI time of that one
+// write is part of the TX latency that calTxAdvance() corrects.
+// ----------------------------------------------------------------------------
+static void txFire()
+{
+	uint64_t startTime = micros64();
+	loraWait(txFireAt);
 
-	// wait extra delay out. The delayMicroseconds timer is accurate until 16383 uSec.
-	//												// XXX We should not use yield() outside loop()
-	uint32_t startTime = micros();
-	loraWait(tmst);
+	// 15. Initiate actual transmission of FiFo. One register write, stamped
+	// right before it: opmode() would read and write twice (over 1 mSec of
+	// SPI) and the stamp would be late for the TX latency calibration.
+	txStartTime = micros();
+	writeRegister(REG_OPMODE, txOpmode);
 
-	// 15. Initiate actual transmission of FiFo
-	opmode(OPMODE_TX);
+	txState = TX_BUSY;
 
-	yield();
 	if (loraDebug >=1) {
 		Serial.print(F("start: "));
-		Serial.print(startTime);
+		Serial.print((uint32_t)startTime);
 		Serial.print(F(", end: "));
-		Serial.print(tmst);
+		Serial.print((uint32_t)txFireAt);
 		Serial.print(F(", waited: "));
-		Serial.print(tmst - startTime);
+		Serial.print((int32_t)(txFireAt - startTime));
 		Serial.print(F(", delay="));
 		Serial.print(txDelay);
 		Serial.println();
 	}
+}
+
 
-	// XXX Intead of handling the interrupt of dio0, we wait it out, Not using delay(1);
-	// for trasmitter this should not be a problem.
-	while(digitalRead(dio0) == 0) {  }						// XXX tx done? handle by interrupt
+// ----------------------------------------------------------------------------
+// Handle the end of a transmission: TxDone was signalled on DIO0 or the
+// transmission took too long. Either way the radio goes back to listening.
+// When the TxDone interrupt was seen (edge) its timestamp is used for the
+// TX latency calibration, a TxDone found by polling the pin is too late.
+// ----------------------------------------------------------------------------
+static void txDoneLoraModem(bool timeout, bool edge)
+{
+	if (timeout) {
+		statInc(ST_TX_TIMEOUT);
+		Serial.println(F("txDoneLoraModem:: ERROR TxDone timeout"));
+	}
+	else {
+		statInc(ST_TX_OK);
+		// A dio0Tmst from before OPMODE_TX is a stale edge, not this TxDone
+		if (edge && ((int32_t)(dio0Tmst - txStartTime) > 0)) {
+			calTxSample(txStartTime, dio0Tmst, txAirtimeUs);
+		}
+		if (loraDebug >= 2) {
+			Serial.print(F("txDoneLoraModem:: TX took "));
+			Serial.print(micros() - txStartTime);
+			Serial.println(F(" uSec"));
+		}
+	}
 
 	// ----- TX SUCCESS, SWITCH BACK TO RX CONTINUOUS --------
 	// Successful TX cycle put's radio in standby mode.
@@ -549,10 +742,112 @@ static void txLoraModem(uint8_t *payLoad, uint8_t payLength, uint32_t tmst,
 	writeRegister(REG_IRQ_FLAGS, 0xFF);
 
 	// Give control back to continuous receive setup
-	// Put's the radio in sleep mode and then in stand-by
+	// Put's the radio in sleep mode and then in stand-by, and sets the
+	// receive frequency and rate again (the downlink may have used others)
 	rxLoraModem();
+	txState = TX_IDLE;
+}
+
+
+// ----------------------------------------------------------------------------
+// Insert a downlink in the JIT queue, ordered on tmst (64-bit gateway time,
+// so ordering is not affected by a micros() rollover).
+// Returns NULL when the queue is full.
+// ----------------------------------------------------------------------------
+static LoraTxPkt * txQueueInsert(uint64_t tmst)
+{
+	if (txQueueLen >= TX_QUEUE_SIZE) return(NULL);
+
+	int i = txQueueLen;
+	while ((i > 0) && (tmst < txQueue[i-1].tmst)) {
+		txQueue[i] = txQueue[i-1];
+		i--;
+	}
+	txQueueLen++;
+	txQueue[i].tmst = tmst;
+	return(&txQueue[i]);
+}
+
+
+// ----------------------------------------------------------------------------
+// Remove the first (earliest) downlink from the JIT queue
+// ----------------------------------------------------------------------------
+static void txQueuePop()
+{
+	for (int i = 1; i < txQueueLen; i++) {
+		txQueue[i-1] = txQueue[i];
+	}
+	txQueueLen--;
+}
+
+
+// ----------------------------------------------------------------------------
+// Start the first downlink of the JIT queue when it is due.
+// Returns immediately when nothing is due yet.
+// ----------------------------------------------------------------------------
+static void txQueueService()
+{
+	if ((txState != TX_IDLE) || (txQueueLen == 0)) return;
+
+	LoraTxPkt *pkt = &txQueue[0];
+	int64_t wait = (int64_t)(pkt->tmst - micros64());
+
+	if (wait > TX_PREPARE_US) return;							// Not yet
+
+	if (wait < 0) {
+		// The main loop was too slow, the node is not listening anymore
+		statInc(ST_TX_LATE);
+		Serial.print(F("txQueueService:: ERROR too late by "));
+		Serial.print((int32_t)-wait);
+		Serial.println(F(" uSec"));
+		txQueuePop();
+		return;
+	}
+
+	txBusyUntil = pkt->tmst + pkt->airtime;
+	txAirtimeUs = pkt->airtime;
+	txLoraModem(pkt->payload, pkt->size, pkt->tmst, pkt->powe,
+				pkt->freq, pkt->sf, pkt->bw, pkt->cr, pkt->crc, pkt->iiq);
+	txQueuePop();
+}
+
+// ----------------------------------------------------------------------------
+// Interrupt handler for DIO0 (RxDone or TxDone depending on the mapping).
+// Keep this as short as possible: take the timestamp and set the flag.
+// ----------------------------------------------------------------------------
+void ICACHE_RAM_ATTR dio0Interrupt()
+{
+	dio0Tmst = micros();
+	dio0Event = true;
+}
+
+// ----------------------------------------------------------------------------
+// Build the constant parts of the rxpk JSON object (see receivePacket).
+// The frequency is printed as MHz with 6 decimals, e.g. 868.100000
+// ----------------------------------------------------------------------------
+static void initRxpk()
+{
+	char *p = rxpkFixed;
+	const char *s1 = ",\"chan\":0,\"rfch\":0,\"freq\":";
+	memcpy(p, s1, strlen(s1));
+	p += strlen(s1);
+
+	p += fmtUint(p, (uint32_t) LORA_freq / 1000000);
+	*p++ = '.';
+	uint32_t frac = (uint32_t) LORA_freq % 1000000;
+	for (uint32_t d = 100000; d > 0; d /= 10) {
+		*p++ = '0' + (frac / d) % 10;
+	}
+
+	const char *s2 = ",\"stat\":1,\"modu\":\"LORA\",\"datr\":\"SF";
+	memcpy(p, s2, strlen(s2));
+	p += strlen(s2);
+	rxpkFixedLen = p - rxpkFixed;
+
+	for (int i = 0; i <= SF12 - SF7; i++) rxpkDatrLen[i] = strlen(rxpkDatr[i]);
 }
 
+
 // ----------------------------------------------------------------------------
 // First time initialisation of the LoRa modem
 // Subsequent changes to the modem state etc. done by txLoraModem or rxLoraModem
@@ -592,8 +887,12 @@ void initLoraModem()
         }
     }
 
+	initRxpk();
+
 	// Set the radio in Continuous listen mode
 	rxLoraModem();
+
+	attachInterrupt(digitalPinToInterrupt(dio0), dio0Interrupt, RISING);
 	if (loraDebug >= 1) Serial.println(F("initLoraModem done"));
 }
 
@@ -606,26 +905,35 @@ void initLoraModem()
 // ----------------------------------------------------------------------------
 bool receivePkt(uint8_t *payload)
 {
+    int irqflags = readRegister(REG_IRQ_FLAGS);				// 0x12
+
+    // DIO0 can also be raised by TxDone, only continue for RxDone
+    if ((irqflags & IRQ_LORA_RXDONE_MASK) == 0) {
+        writeRegister(REG_IRQ_FLAGS, 0xFF);					// 0x12; Clear all
+        return false;
+    }
+
     // clear rxDone
     writeRegister(REG_IRQ_FLAGS, 0x40);						// 0x12; Clear RxDone
 
-    int irqflags = readRegister(REG_IRQ_FLAGS);				// 0x12
-
-    cp_nb_rx_rcv++;											// Receive statistics counter
+    statInc(ST_RX_RCV);										// Receive statistics counter
     if (loraDebug != 0 ) {
       Serial.println("Packet received!");
       Serial.print("Counter is now: ");
-      Serial.println(cp_nb_rx_rcv);
+      Serial.println(statTotal(ST_RX_RCV));
     }
     //  payload crc=0x20 set
     if((irqflags & 0x20) == 0x20)
     {
         Serial.println(F("CRC error"));
+        statInc(ST_RX_BAD);
         writeRegister(REG_IRQ_FLAGS, 0x20);					// 0x12
         return false;
     } else {
 
-        cp_nb_rx_ok++;										// Receive OK statistics counter
+        // Receive OK statistics counter, only when the node sent a CRC
+        if (readRegister(REG_HOP_CHANNEL) & HOP_CHANNEL_CRC_ON) statInc(ST_RX_OK);
+        else statInc(ST_RX_NOCRC);
 
         byte currentAddr = readRegister(REG_FIFO_RX_CURRENT_ADDR);	// 0x10
         byte receivedCount = readRegister(REG_RX_NB_BYTES);	// 0x13; How many bytes were read
@@ -633,10 +941,15 @@ bool receivePkt(uint8_t *payload)
 
         //writeRegister(REG_FIFO_ADDR_PTR, currentAddr);	// 0x0D XXX??? This sets the FiFo higher!!!
 
-        for(int i = 0; i < receivedCount; i++)
-        {
-            payload[i] = readRegister(REG_FIFO);			// 0x00
-        }
+		uint32_t spiStart = micros();
+        readBuffer(REG_FIFO, payload, receivedCount);		// 0x00, one burst
+		if (loraDebug >= 2) {
+			Serial.print(F("receivePkt:: FIFO read "));
+			Serial.print(receivedCount);
+			Serial.print(F(" bytes in "));
+			Serial.print(micros() - spiStart);
+			Serial.println(F(" uSec"));
+		}
 		//yield();
     }
     return true;
@@ -644,14 +957,70 @@ bool receivePkt(uint8_t *payload)
 
 
 
+// ----------------------------------------------------------------------------
+// Time on air in uSec of a LoRa packet of size bytes, explicit header and
+// 8 preamble symbols (Semtech AN1200.13):
+//	Tpreamble = (8 + 4.25) * Tsym
+//	symbols   = 8 + max(ceil((8*PL - 4*SF + 28 + 16*CRC) / (4*(SF - 2*DE))) * CR, 0)
+// ----------------------------------------------------------------------------
+static uint32_t txAirtime(uint8_t sf, uint16_t bw, uint8_t cr, uint8_t crc, uint8_t size)
+{
+	uint32_t tsym = ((uint32_t)1000 << sf) / bw;
+	int32_t num = 8*size - 4*sf + 28 + (crc ? 16 : 0);
+	int32_t den = 4 * (sf - (lowDataRate(sf, bw) ? 2 : 0));
+	uint32_t symbols = 8;
+	if (num > 0) symbols += ((num + den - 1) / den) * cr;
+	return((49 * tsym) / 4 + symbols * tsym);
+}
+
+// ----------------------------------------------------------------------------
+// True when a downlink from tmst lasting airtime uSec overlaps the one on
+// the air or one in the queue. TX_PREPARE_US is kept free in between to set
+// up the radio for the next one.
+// ----------------------------------------------------------------------------
+static bool txCollision(uint64_t tmst, uint32_t airtime)
+{
+	if ((txState != TX_IDLE) && (tmst < txBusyUntil + TX_PREPARE_US)) return(true);
+	for (int i = 0; i < txQueueLen; i++) {
+		if ((tmst < txQueue[i].tmst + txQueue[i].airtime + TX_PREPARE_US) &&
+			(txQueue[i].tmst < tmst + airtime + TX_PREPARE_US)) return(true);
+	}
+	return(false);
+}
+
+// ----------------------------------------------------------------------------
+// Name of a sendPacket() result as used in the txpk_ack JSON object
+// ----------------------------------------------------------------------------
+const char * txErrName(int r)
+{
+	switch (r) {
+	case TX_ERR_NONE:      return("NONE");
+	case TX_ERR_TOO_LATE:  return("TOO_LATE");
+	case TX_ERR_TOO_EARLY: return("TOO_EARLY");
+	case TX_ERR_COLLISION: return("COLLISION_PACKET");
+	case TX_ERR_FREQ:      return("TX_FREQ");
+	case TX_ERR_POWER:     return("TX_POWER");
+	case TX_ERR_INVALID:   return("TX_INVALID");
+	}
+	return("UNKNOWN");
+}
+
+static int txResult(int r)
+{
+	statInc(ST_TX_RESULT + r);
+	return(r);
+}
+
+
 // ----------------------------------------------------------------------------
 // Send DOWN a LoRa packet over the air to the node. This function does all the
 // decoding of the server message and prepares a Payload buffer.
 // The payload is actually transmitted by the sendPkt() function.
 // This function is used for regular downstream messages and for JOIN_ACCEPT
 // messages.
+// Returns one of the TX_ERR_ values for the TX_ACK.
 // ----------------------------------------------------------------------------
-int sendPacket(uint8_t *buff_down, uint8_t length) {
+int sendPacket(uint8_t *buff_down, int length) {
 
 	// Received package with Meta Data:
 	// codr	: "4/5"
@@ -667,9 +1036,6 @@ int sendPacket(uint8_t *buff_down, uint8_t length) {
 
 	if (loraDebug >= 2) Serial.println(F("sendPacket called"));
 
-	// Trx Time received the message
-    uint32_t trx = (uint32_t) micros();
-
 	// 12-byte header;
 	//		HDR (1 byte)
 	//
@@ -683,269 +1049,442 @@ int sendPacket(uint8_t *buff_down, uint8_t length) {
 	//		CFList (fill to 16 bytes)
 
 	int i=0;
-	StaticJsonBuffer<256> jsonBuffer;
-	char * bufPtr = (char *) (buff_down);
-	buff_down[length] = 0;
-
-	if (loraDebug >= 2) Serial.println((char *)buff_down);
+	Txpk txpk;
 
-	// Use JSON to decode the string after the first 4 bytes.
-	// The data for the node is in the "data" field. This function destroys original buffer
-	JsonObject& root = jsonBuffer.parseObject(bufPtr);
-
-	if (!root.success()) {
-		Serial.print (F("sendPacket:: ERROR Json Decode "));
-		if (loraDebug>=2) {
-			Serial.print(": ");
-			Serial.println(bufPtr);
-		}
-		return(-1);
+	if (loraDebug >= 2) {
+		buff_down[length] = 0;
+		Serial.println((char *)buff_down);
 	}
-	delay(1);
+
 	// Meta Data sent by server (example)
 	// {"txpk":{"codr":"4/5","data":"YCkEAgIABQABGmIwYX/kSn4Y","freq":868.1,"ipol":true,"modu":"LORA","powe":14,"rfch":0,"size":18,"tmst":1890991792,"datr":"SF7BW125"}}
+	// The payload is decoded in place in buff_down.
+	int err = txpkParse((char *) buff_down, length, &txpk);
+	if (err != TXPK_OK) {
+		Serial.print(F("sendPacket:: ERROR txpk parse "));
+		Serial.println(err);
+		return(txResult(TX_ERR_INVALID));
+	}
 
-	// Used in the protocol:
-	const char * data = root["txpk"]["data"];
-	uint8_t psize = root["txpk"]["size"];
-	bool ipol = root["txpk"]["ipol"];
-	uint8_t powe = root["txpk"]["powe"];
-	uint32_t tmst = (uint32_t) root["txpk"]["tmst"].as<unsigned long>();
+	// One now for the schedule and the range check: an immediate downlink
+	// would otherwise miss TX_PREPARE_US by the time spent in between.
+	uint64_t now = micros64();
+	uint64_t tmst64;
+	if (txpk.imme) {
+		tmst64 = now + TX_PREPARE_US;						// As soon as possible
+	}
+	else {
+		tmst64 = micros64From32(txpk.tmst);				// Server tmst is our time base modulo 2^32
+	}
 
+	uint8_t iiq = (txpk.ipol? 0x40: 0x27);				// if ipol==true 0x40 else 0x27
+	uint8_t crc = 0x00;									// switch CRC off for TX
+	uint8_t payLength = txpk.dataLen;
+
+	// Channel and rate of the downlink. Fields the server did not give are
+	// taken from our receive channel.
+	uint32_t freq = (txpk.freq != 0) ? txpk.freq : LORA_freq;
+	uint8_t  tsf  = (txpk.sf != 0) ? txpk.sf : sf;
+	uint16_t bw   = (txpk.bw != 0) ? txpk.bw : 125;
+	uint8_t  cr   = (txpk.cr != 0) ? txpk.cr : 5;
+	if ((tsf < SF7) || (tsf > SF12) || ((bw != 125) && (bw != 250) && (bw != 500))) {
+		Serial.print(F("sendPacket:: ERROR unsupported datr SF"));
+		Serial.print(tsf);
+		Serial.print(F("BW"));
+		Serial.println(bw);
+		return(txResult(TX_ERR_INVALID));
+	}
+	if ((cr < 5) || (cr > 8)) {									// also TXPK_CR_BAD
+		Serial.println(F("sendPacket:: ERROR unsupported codr"));
+		return(txResult(TX_ERR_INVALID));
+	}
 
-	// Not used in the protocol:
-	const char * datr = root["txpk"]["datr"];
-	const double ff= root["txpk"]["freq"];
-	const char * modu = root["txpk"]["modu"];
-	//if (root["txpk"].containsKey("imme") ) {
-	//	const bool imme = root["txpk"]["imme"];			// Immediate Transmit (tmst don't care)
-	//}
-	const uint32_t fff = (uint32_t)(ff*1000000);
+	if ((freq < TX_FREQ_MIN) || (freq > TX_FREQ_MAX)) {
+		Serial.print(F("sendPacket:: ERROR freq not allowed: "));
+		Serial.println(freq);
+		return(txResult(TX_ERR_FREQ));
+	}
 
-	if (data != NULL) {
-		if (loraDebug>=2) { Serial.print(F("data: ")); Serial.println((char *) data); }
+	// Check that we can make it, and that it is not too far in the future
+	int64_t wait = (int64_t)(tmst64 - now);
+	if ((wait < TX_PREPARE_US) || (wait > TX_MAX_AHEAD)) {
+		Serial.print(F("sendPacket:: ERROR tmst out of range, wait="));
+		Serial.println((int32_t)wait);
+		return(txResult((wait < TX_PREPARE_US) ? TX_ERR_TOO_LATE : TX_ERR_TOO_EARLY));
 	}
-	else {
-		Serial.println(F("sendPacket:: data is NULL"));
-		return(-1);
+
+	// tmst is counted by our micros(), correct it for the drift of the crystal
+	// over the wait. Immediate downlinks have nothing to correct.
+	if (!txpk.imme) tmst64 += calCorrection(wait);
+
+	uint32_t airtime = txAirtime(tsf, bw, cr, crc, payLength);
+	if (txCollision(tmst64, airtime)) {
+		Serial.println(F("sendPacket:: ERROR downlink collides with a queued one"));
+		return(txResult(TX_ERR_COLLISION));
 	}
 
-	uint8_t iiq = (ipol? 0x40: 0x27);					// if ipol==true 0x40 else 0x27
-	uint8_t crc = 0x00;									// switch CRC off for TX
-	uint8_t payLength = base64_dec_len((char *) data, strlen(data));
-	uint8_t payLoad[payLength];
-	base64_decode((char *) payLoad, (char *) data, strlen(data));
+	// Queue the downlink, pollLoraModem() will send it just in time
+	LoraTxPkt *pkt = txQueueInsert(tmst64);
+	if (pkt == NULL) {
+		Serial.println(F("sendPacket:: ERROR downlink queue full"));
+		return(txResult(TX_ERR_COLLISION));
+	}
 
-	txLoraModem(payLoad, payLength, tmst, powe, LORA_freq, crc, iiq);
+	int result = TX_ERR_NONE;
+	int8_t powe = txpk.powe;
+	if (powe > TX_POWE_MAX) {
+		powe = TX_POWE_MAX;
+		result = TX_ERR_POWER;
+	}
 
-	if ((loraDebug >= 2) && (fff != LORA_freq)) {
-		Serial.print(F("sendPacket:: WARNING used freq="));
-		Serial.print(LORA_freq);
-		Serial.print(F(", freq req="));
-		Serial.println(fff);
+	pkt->freq = freq;
+	pkt->sf   = tsf;
+	pkt->bw   = bw;
+	pkt->cr   = cr;
+	pkt->powe = powe;
+	pkt->crc  = crc;
+	pkt->iiq  = iiq;
+	pkt->size = payLength;
+	pkt->airtime = airtime;
+	uint8_t *payLoad = pkt->payload;
+	memcpy(payLoad, txpk.data, payLength);
+
+	if ((loraDebug >= 2) && (freq != LORA_freq)) {
+		Serial.print(F("sendPacket:: downlink on freq="));
+		Serial.println(freq);
 	}
 
-	if (payLength != psize) {
+	if ((txpk.size >= 0) && (payLength != txpk.size)) {
 		Serial.print(F("sendPacket:: WARNING payLength: "));
 		Serial.print(payLength);
 		Serial.print(F(", psize="));
-		Serial.println(psize);
+		Serial.println(txpk.size);
 	}
 	else if (loraDebug >= 2 ) {
 		for (i=0; i<payLength; i++) {Serial.print(payLoad[i],HEX); Serial.print(':'); }
 		Serial.println();
 	}
 
-	cp_up_pkt_fwd++;
+	return(txResult(result));
+}
 
-	return 1;
+
+// ----------------------------------------------------------------------------
+// True when the radio needs the main loop now: DIO0 fired, packets wait in
+// the RX ring, a downlink is due or a TX or CAD lock timed out.
+// Only flag tests and one pin read, the scheduler calls it between tasks.
+// ----------------------------------------------------------------------------
+bool loraPending() {
+	if (dio0Event || (digitalRead(dio0) == 1)) return(true);
+	if (rxRingTail != rxRingHead) return(true);
+	if (txState == TX_BUSY) return((micros() - txStartTime) > TX_TIMEOUT_US);
+	if (loraTxSlack() == 0) return(true);
+	return((rxState == RX_LOCK) && ((micros() - rxLockStart) > rxLockWindow));
 }
 
+// ----------------------------------------------------------------------------
+// uSec until pollLoraModem() has to prepare the first queued downlink, or
+// fire the armed one, 0 when it is due, 0xFFFFFFFF when there is none.
+// ----------------------------------------------------------------------------
+uint32_t loraTxSlack() {
+	int64_t wait;
+	if (txState == TX_ARMED) wait = (int64_t)(txFireAt - micros64()) - TX_SPIN_US;
+	else if (txQueueLen == 0) return(0xFFFFFFFF);
+	else wait = (int64_t)(txQueue[0].tmst - micros64()) - TX_PREPARE_US;
+	if (wait <= 0) return(0);
+	return((wait > 0xFFFFFFFE) ? 0xFFFFFFFE : (uint32_t)wait);
+}
+
+// ----------------------------------------------------------------------------
+// DIO0 went high while receiving: a CAD cycle is done, or a packet came in.
+// A packet is drained from the FIFO and, together with its timestamp, SNR
+// and RSSI, stored in the RX ring.
+// ----------------------------------------------------------------------------
+static void rxDoneLoraModem() {
+
+	long SNR;
+	int rssicorr;
+
+	// CAD cycle done, either lock on this SF or try the next one
+	if (rxState == RX_CAD) {
+		dio0Event = false;
+		uint8_t flags = readRegister(REG_IRQ_FLAGS);
+		if (flags & IRQ_LORA_CDDETD_MASK) {
+			cp_cad_det[cadSf - SF7]++;
+			rxLock();
+		}
+		else {
+			cadScanner((cadSf >= SF12) ? SF7 : cadSf + 1);
+		}
+		return;
+	}
+
+	// Take the timestamp captured by the interrupt routine
+	noInterrupts();
+	uint32_t tmst = dio0Tmst;
+	bool event = dio0Event;
+	dio0Event = false;
+	interrupts();
+	if (!event) tmst = (uint32_t) micros();						// Missed the edge, DIO0 still high
+	else PROF_ADD_US(PROF_DIO0, (uint32_t) micros() - tmst);
+	uint64_t tmst64 = micros64From32(tmst);
+
+	if (loraDebug >= 2) Serial.println(F("pollLoraModem:: LoRa message ready"));
+
+	// If the ring is full we still have to empty the FIFO, the slot at head
+	// is always free so use it as scratch space and drop the packet.
+	uint8_t next = (rxRingHead + 1) & (RX_RING_SIZE - 1);
+	LoraRxPkt *pkt = &rxRing[rxRingHead];
+
+	// Handle the physical data read from FiFo
+	PROF_START(fifo);
+	bool received = receivePkt(pkt->payload);
+	PROF_END(PROF_FIFO, fifo);
+	if (!received) {
+		if (rxState == RX_LOCK) cadScanner(SF7);				// Resume scanning
+		return;
+	}
+
+	if (next == rxRingTail) {
+		statInc(ST_RX_OVR);
+		if (loraDebug >= 1) {
+			Serial.print(F("pollLoraModem:: RX ring overrun, lost: "));
+			Serial.println(statTotal(ST_RX_OVR));
+		}
+		if (rxState == RX_LOCK) cadScanner(SF7);
+		return;
+	}
+
+	// SNR, packet RSSI and current RSSI are consecutive registers,
+	// read them in one burst: 0x19, 0x1A, 0x1B
+	uint8_t sigRegs[REG_RSSI - REG_PKT_SNR_VALUE + 1];
+	readBuffer(REG_PKT_SNR_VALUE, sigRegs, sizeof(sigRegs));
+
+	byte value = sigRegs[0];									// REG_PKT_SNR_VALUE
+	if( value & 0x80 ) // The SNR sign bit is 1
+	{
+		// Invert and divide by 4
+		value = ( ( ~value + 1 ) & 0xFF ) >> 2;
+		SNR = -value;
+	}
+	else
+	{
+		// Divide by 4
+		SNR = ( value & 0xFF ) >> 2;
+	}
+
+	if (sx1272) {
+		rssicorr = 139;
+	} else {													// Probably SX1276 or RFM95
+		rssicorr = 157;
+	}
+
+	pkt->tmst  = tmst64;
+	pkt->fifo  = (uint32_t) micros();
+	pkt->snr   = SNR;
+	pkt->prssi = sigRegs[REG_PKT_RSSI - REG_PKT_SNR_VALUE] - rssicorr;
+	pkt->rssi  = sigRegs[REG_RSSI - REG_PKT_SNR_VALUE] - rssicorr;
+	pkt->size  = receivedbytes;
+	pkt->sf    = (rxState == RX_LOCK) ? cadSf : sf;
+	cp_nb_rx_sf[pkt->sf - SF7]++;
+
+	rxRingHead = next;											// Publish to the consumer
+
+	if (rxState == RX_LOCK) cadScanner(SF7);					// Resume scanning
+}
+
+
+// ----------------------------------------------------------------------------
+// Service the LoRa modem from the main loop
+//
+// When the DIO0 interrupt has fired (or DIO0 is high and we missed the edge)
+// the packet is read by rxDoneLoraModem(); this is the producer side of the
+// RX ring. After that a due downlink is prepared, and an armed one is started
+// when its time has come. Called as often as possible; it costs only a flag
+// test when nothing is waiting.
+// ----------------------------------------------------------------------------
+void pollLoraModem() {
+
+	// Keep the 64-bit time base up to date (see micros64()), also when
+	// nothing below reads it
+	micros64();
+
+	// While transmitting DIO0 is mapped to TxDone
+	if (txState == TX_BUSY) {
+		if (dio0Event || (digitalRead(dio0) == 1)) {
+			bool edge = dio0Event;
+			dio0Event = false;
+			txDoneLoraModem(false, edge);
+		}
+		else if ((micros() - txStartTime) > TX_TIMEOUT_US) {
+			txDoneLoraModem(true, false);
+		}
+		return;
+	}
+
+	// Radio is in standby with the downlink in the FIFO
+	if (txState == TX_ARMED) {
+		if ((int64_t)(txFireAt - micros64()) <= TX_SPIN_US) txFire();
+		return;
+	}
+
+	// A packet that is already in is read before a downlink is started:
+	// once DIO0 is mapped to TxDone its RxDone would end the transmission.
+	if (dio0Event || (digitalRead(dio0) == 1)) {
+		rxDoneLoraModem();
+	}
+	else if ((rxState == RX_LOCK) && ((micros() - rxLockStart) > rxLockWindow)) {
+		// Locked on a SF after CAD but nothing came in: resume scanning,
+		// unless the modem is still busy receiving a packet.
+		if ((readRegister(REG_MODEM_STAT) & MODEM_STAT_RX_BUSY) &&
+			((micros() - rxLockStart) < CAD_LOCK_MAX_US)) {
+			rxLockWindow += CAD_LOCK_SYMBOLS * ((uint32_t)8 << cadSf);
+		}
+		else {
+			cadScanner(SF7);
+		}
+	}
+
+	// Start a downlink when it is due
+	txQueueService();
+}
+
+
+// ----------------------------------------------------------------------------
+// Worst case length of the rxpk JSON object for the oldest packet in the
+// RX ring, so the caller can reserve room for receivePacket().
+// Returns -1 when the ring is empty.
+// ----------------------------------------------------------------------------
+int receivePacketLen() {
+	if (rxRingTail == rxRingHead) return(-1);					// Ring empty
+#if _UPTRACE_JSON==1
+	return(RXPK_FIXED_MAX + RXPK_TRACE_MAX + base64_enc_len(rxRing[rxRingTail].size));
+#else
+	return(RXPK_FIXED_MAX + base64_enc_len(rxRing[rxRingTail].size));
+#endif
+}
 
 // ----------------------------------------------------------------------------
 // Receive a LoRa package over the air
 //
-// Receive a LoRa message and fill the buff_up char buffer.
+// Take the oldest packet from the RX ring (filled by pollLoraModem) and
+// write its rxpk JSON object {...} in buff_up (at most size bytes).
+// The PUSH_DATA header and the surrounding {"rxpk":[ ]} are added by the
+// caller, which can combine several objects in one message.
+// The object is written in one pass: constant parts are copied from
+// rxpkFixed and rxpkDatr, numbers are formatted with fmtInt/fmtUint and
+// the payload is base64 encoded straight into buff_up.
+// trace gets the RxDone, FIFO read and serialization times of the packet.
 // returns values:
 // - returns the length of string returned in buff_up
-// - returns -1 when no message arrived.
+// - returns -1 when no message arrived, or it did not fit (it is dropped).
 // ----------------------------------------------------------------------------
-int receivePacket(uint8_t * buff_up) {
+int receivePacket(uint8_t * buff_up, int size, UpTrace *trace) {
 
-    // long int SNR;
-	long SNR;
-    int rssicorr;
-	char cfreq[12] = {0};										// Character array to hold freq in MHz
+	if (rxRingTail == rxRingHead) return(-1);					// Ring empty
 
-	// delay(1);
+	LoraRxPkt *pkt = &rxRing[rxRingTail];
+	receivedbytes = pkt->size;
+	lastTmst = (uint32_t) pkt->tmst;
+	trace->rxDone = lastTmst;
+	trace->fifo = pkt->fifo;
 
-	// Regular message received, see SX1276 spec table 18
-	// Next statement could also be a "while" to combine several messages received in one UDP message
-	// The Semtech Gateway spec does allow this.
-    if(digitalRead(dio0) == 1)									// READY?
-    {
-		// Take the timestamp as soon as possible, to have accurate recepion timestamp
-		// TODO: tmst can jump if micros() overflow.
-		uint32_t tmst = (uint32_t) micros();				// Only microseconds, rollover in
-		lastTmst = tmst;									// MMMM according to spec
-
-		if (loraDebug >= 2) Serial.println(F("receivePacket:: LoRa message ready"));
-
-		// Handle the physical data read from FiFo
-        if(receivePkt(message)) {
-
-            byte value = readRegister(REG_PKT_SNR_VALUE);		// 0x19;
-            if( value & 0x80 ) // The SNR sign bit is 1
-            {
-                // Invert and divide by 4
-                value = ( ( ~value + 1 ) & 0xFF ) >> 2;
-                SNR = -value;
-            }
-            else
-            {
-                // Divide by 4
-                SNR = ( value & 0xFF ) >> 2;
-            }
-
-            if (sx1272) {
-                rssicorr = 139;
-            } else {											// Probably SX1276 or RFM95
-                rssicorr = 157;
-            }
-
-			if (loraDebug>=1) {
-			    Serial.print(F("Packet RSSI: "));
-				Serial.print(readRegister(0x1A)-rssicorr);
-				Serial.print(F(" RSSI: "));
-				Serial.print(readRegister(0x1B)-rssicorr);
-				Serial.print(F(" SNR: "));
-				Serial.print(SNR);
-				Serial.print(F(" Length: "));
-				Serial.print((int)receivedbytes);
-				Serial.print(F(" -> "));
-				int i;
-				for (i=0; i< receivedbytes; i++) {
-					Serial.print(message[i],HEX);
-					Serial.print(' ');
-				}
-				Serial.println();
-				yield();
-			}
-
-            int j;
-			// XXX Base64 library is nopad. So we may have to add padding characters until
-			// 	length is multiple of 4!
-			int encodedLen = base64_enc_len(receivedbytes);		// max 341
-			base64_encode(b64, (char *) message, receivedbytes);// max 341
-
-            int buff_index=0;
-
-            // pre-fill the data buffer with fixed fields
-            buff_up[0] = PROTOCOL_VERSION;						// 0x01 still
-            buff_up[3] = PKT_PUSH_DATA;							// 0x00
-
-			// READ MAC ADDRESS OF ESP8266, and insert 0xFF 0xFF in the middle
-            buff_up[4]  = MAC_address[0];
-            buff_up[5]  = MAC_address[1];
-            buff_up[6]  = MAC_address[2];
-            buff_up[7]  = 0xFF;
-            buff_up[8]  = 0xFF;
-            buff_up[9]  = MAC_address[3];
-            buff_up[10] = MAC_address[4];
-            buff_up[11] = MAC_address[5];
-
-            // start composing datagram with the header
-            uint8_t token_h = (uint8_t)rand(); 					// random token
-            uint8_t token_l = (uint8_t)rand(); 					// random token
-            buff_up[1] = token_h;
-            buff_up[2] = token_l;
-            buff_index = 12; 									// 12-byte header
-
-            // start of JSON structure that will make payload
-            memcpy((void *)(buff_up + buff_index), (void *)"{\"rxpk\":[", 9);
-            buff_index += 9;
-            buff_up[buff_index] = '{';
-            ++buff_index;
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE - buff_index, "\"tmst\":%u", tmst);
-            buff_index += j;
-
-            ftoa((double)LORA_freq/1000000,cfreq,6);					// XXX This can be done better
-
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%s", 0, 0, cfreq);
-            buff_index += j;
-            memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
-            buff_index += 9;
-            memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
-            buff_index += 14;
-            /* Lora datarate & bandwidth, 16-19 useful chars */
-            switch (sf) {
-            case SF7:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
-                buff_index += 12;
-                break;
-            case SF8:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
-                buff_index += 12;
-                break;
-            case SF9:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
-                buff_index += 12;
-                break;
-            case SF10:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
-                buff_index += 13;
-                break;
-            case SF11:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
-                buff_index += 13;
-                break;
-            case SF12:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
-                buff_index += 13;
-                break;
-            default:
-                memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF?", 12);
-                buff_index += 12;
-            }
-            memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
-            buff_index += 6;
-            memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
-            buff_index += 13;
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"lsnr\":%li", SNR);
-            buff_index += j;
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"rssi\":%d,\"size\":%u", readRegister(0x1A)-rssicorr, receivedbytes);
-            buff_index += j;
-            memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
-            buff_index += 9;
-
-			// Use gBase64 library
-			encodedLen = base64_enc_len(receivedbytes);		// max 341
-			j = base64_encode((char *)(buff_up + buff_index), (char *) message, receivedbytes);
-
-            buff_index += j;
-            buff_up[buff_index] = '"';
-            ++buff_index;
-
-            // End of packet serialization
-            buff_up[buff_index] = '}';
-            ++buff_index;
-            buff_up[buff_index] = ']';
-            ++buff_index;
-            // end of JSON datagram payload */
-            buff_up[buff_index] = '}';
-            ++buff_index;
-            buff_up[buff_index] = 0; 						// add string terminator, for safety
-
-			if (loraDebug>=1) {
-				Serial.print(F("RXPK:: "));
-				Serial.println((char *)(buff_up + 12));		// DEBUG: display JSON payload
-			}
-
-			return(buff_index);
-
-        } // received a message
-    } // dio0=1
-	// else not ready for receive
-
-	return(-1);
+	if (loraDebug>=1) {
+		Serial.print(F("Packet RSSI: "));
+		Serial.print(pkt->prssi);
+		Serial.print(F(" RSSI: "));
+		Serial.print(pkt->rssi);
+		Serial.print(F(" SNR: "));
+		Serial.print(pkt->snr);
+		Serial.print(F(" Length: "));
+		Serial.print((int)receivedbytes);
+		Serial.print(F(" -> "));
+		int i;
+		for (i=0; i< receivedbytes; i++) {
+			Serial.print(pkt->payload[i],HEX);
+			Serial.print(' ');
+		}
+		Serial.println();
+		yield();
+	}
+
+	// Not for a network we forward, e.g. a neighbour's private network
+	if (!lwFilterPass(pkt->payload, receivedbytes)) {
+		statInc(ST_RX_FILTER);
+		if (loraDebug>=1) Serial.println(F("receivePacket:: filtered, packet dropped"));
+		rxRingTail = (rxRingTail + 1) & (RX_RING_SIZE - 1);
+		return(-1);
+	}
+
+	if (size <= receivePacketLen()) {
+		Serial.println(F("receivePacket:: buffer too small, packet dropped"));
+		rxRingTail = (rxRingTail + 1) & (RX_RING_SIZE - 1);
+		return(-1);
+	}
+
+	// Exact copy of a frame we just forwarded, do not serialize it again.
+	// Only frames that are really sent are remembered, after the size check.
+	if (dedupSeen(pkt->payload, receivedbytes)) {
+		statInc(ST_RX_DUP);
+		if (loraDebug>=1) Serial.println(F("receivePacket:: duplicate, packet dropped"));
+		rxRingTail = (rxRingTail + 1) & (RX_RING_SIZE - 1);
+		return(-1);
+	}
+
+	char *p = (char *) buff_up;
+
+	memcpy(p, "{\"tmst\":", 8);
+	p += 8;
+	p += fmtUint(p, (uint32_t) pkt->tmst);
+
+	if (ntpSynced()) {											// UTC of the reception
+		memcpy(p, ",\"time\":\"", 9);
+		p += 9;
+		p += ntpIsoTime(p, ntpUtc(pkt->tmst));
+		*p++ = '"';
+	}
+
+	memcpy(p, rxpkFixed, rxpkFixedLen);							// chan .. "datr":"SF
+	p += rxpkFixedLen;
+
+	uint8_t i = pkt->sf - SF7;									// 7BW125","codr":"4/5","lsnr":
+	memcpy(p, rxpkDatr[i], rxpkDatrLen[i]);
+	p += rxpkDatrLen[i];
+	p += fmtInt(p, pkt->snr);
+
+	memcpy(p, ",\"rssi\":", 8);
+	p += 8;
+	p += fmtInt(p, pkt->prssi);
+	memcpy(p, ",\"size\":", 8);
+	p += 8;
+	p += fmtUint(p, receivedbytes);
+	memcpy(p, ",\"data\":\"", 9);
+	p += 9;
+	p += base64_encode(p, (char *) pkt->payload, receivedbytes);
+	*p++ = '"';
+
+	trace->json = (uint32_t) micros();
+#if _UPTRACE_JSON==1
+	memcpy(p, ",\"gwtrace\":[", 12);								// uSec after RxDone
+	p += 12;
+	p += fmtUint(p, trace->fifo - trace->rxDone);
+	*p++ = ',';
+	p += fmtUint(p, trace->json - trace->rxDone);
+	*p++ = ']';
+#endif
+
+	// End of packet serialization
+	*p++ = '}';
+	*p = 0; 									// add string terminator, for safety
+
+	int buff_index = p - (char *) buff_up;
+
+	if (loraDebug>=1) {
+		Serial.print(F("RXPK:: "));
+		Serial.println((char *)buff_up);			// DEBUG: display JSON object
+	}
+
+	rxRingTail = (rxRingTail + 1) & (RX_RING_SIZE - 1);		// Release the slot
+
+	return(buff_index);
 }
@@ -10,17 +10,32 @@
 // ----------------------------------------------------------------------------------------
 #include <Arduino.h>
 
+// Trace of one uplink through the gateway, micros() at each stage.
+// rxDone is the tmst of the packet, queued and the sends are stamped by
+// the PUSH_DATA batching in application.cpp.
+struct UpTrace {
+	uint32_t rxDone;					// DIO0 RxDone interrupt
+	uint32_t fifo;						// FIFO read into the RX ring
+	uint32_t json;						// rxpk object serialized
+	uint32_t queued;					// Added to the PUSH_DATA batch
+};
+
 // Functions:
 void initLoraModem( void );
 void setLoraModem( int ,int ,int ,int ,int, int, bool);
 void setLoraDebug( int );
-int receivePacket(uint8_t[]);
-int sendPacket(uint8_t* , uint8_t );
-uint32_t getLoraRXRCV( void );
-uint32_t getLoraRXOK( void );
-uint32_t getLoraRXBAD( void );
-uint32_t getLoraRXNOCRC( void );
-uint32_t getLoraPKTFWD( void );
+void setLoraCad( bool );
+bool getLoraCad( void );
+void pollLoraModem( void );
+bool loraPending( void );
+uint32_t loraTxSlack( void );
+int receivePacketLen();
+int receivePacket(uint8_t *, int, UpTrace *);
+int sendPacket(uint8_t* , int );
+const char * txErrName( int );
+uint8_t getLoraTXQUEUE( void );
+uint32_t getLoraCADDET( int );
+uint32_t getLoraRXSF( int );
 int getLoraSF( void );
 void resetLoraStats( void );
 
@@ -49,6 +64,42 @@ enum sf_t { SF7=7, SF8, SF9, SF10, SF11, SF12 };
 
 #define TX_BUFF_SIZE  2048
 #define RX_BUFF_SIZE  1024
+#define RXPK_FIXED_MAX 232				// rxpk JSON object without the base64 payload, worst case
+#define RXPK_TRACE_MAX 34				// ,"gwtrace":[fifo,json] with _UPTRACE_JSON
+
+// Number of received LoRa packets that can wait between the DIO0 handling
+// (FIFO drain) and process_LORAWAN() (serialization). Must be a power of 2.
+#define RX_RING_SIZE  4
+
+// Downlink (JIT) queue. Downlinks are kept ordered on tmst and the radio is
+// only prepared TX_PREPARE_US before the transmission has to start.
+#define TX_QUEUE_SIZE 4
+#define TX_PREPARE_US 30000				// Time needed to configure the radio and load the FIFO
+#define TX_SPIN_US    1000				// Busy-wait at most this long for the exact TX start
+#define TX_MAX_AHEAD  8000000			// Do not accept downlinks more than 8 seconds ahead
+#define TX_TIMEOUT_US 8000000			// Give up waiting for TxDone after this time
+
+// Downlinks are only accepted in this band, at no more than TX_POWE_MAX dBm
+// (EU 863-870 MHz). Higher power requests are sent with TX_POWE_MAX.
+#define TX_FREQ_MIN   863000000
+#define TX_FREQ_MAX   870000000
+#define TX_POWE_MAX   14
+
+// Result of sendPacket(), reported to the server in the TX_ACK (*2, par. 5.5)
+#define TX_ERR_NONE       0
+#define TX_ERR_TOO_LATE   1				// Not enough time left to prepare the radio
+#define TX_ERR_TOO_EARLY  2				// More than TX_MAX_AHEAD in the future
+#define TX_ERR_COLLISION  3				// Overlaps a queued downlink, or queue full
+#define TX_ERR_FREQ       4				// Outside TX_FREQ_MIN..TX_FREQ_MAX
+#define TX_ERR_POWER      5				// Warning: sent, but with TX_POWE_MAX
+#define TX_ERR_INVALID    6				// No usable txpk, or a datr we cannot send
+#define TX_ERR_COUNT      7
+
+// CAD scanning. After a detection the receiver stays on that SF for
+// CAD_LOCK_SYMBOLS symbols, extended while the modem reports a reception in
+// progress, up to CAD_LOCK_MAX_US (longest packet airtime).
+#define CAD_LOCK_SYMBOLS 32
+#define CAD_LOCK_MAX_US  3000000
 
 // ============================================================================
 // Set all definitions for Gateway
@@ -66,9 +117,13 @@ enum sf_t { SF7=7, SF8, SF9, SF10, SF11, SF12 };
 #define REG_IRQ_FLAGS_MASK          0x11
 #define REG_IRQ_FLAGS               0x12
 #define REG_RX_NB_BYTES             0x13
+#define REG_MODEM_STAT              0x18
 #define REG_PKT_SNR_VALUE           0x19
+#define REG_PKT_RSSI                0x1A
+#define REG_RSSI                    0x1B
 #define REG_MODEM_CONFIG1           0x1D
 #define REG_MODEM_CONFIG2           0x1E
+#define REG_HOP_CHANNEL             0x1C
 #define REG_SYMB_TIMEOUT_LSB        0x1F
 
 #define REG_PAYLOAD_LENGTH          0x22
@@ -165,6 +220,7 @@ enum sf_t { SF7=7, SF8, SF9, SF10, SF11, SF12 };
 // DIO function mappings                D0D1D2D3
 #define MAP_DIO0_LORA_RXDONE   0x00  // 00------
 #define MAP_DIO0_LORA_TXDONE   0x40  // 01------
+#define MAP_DIO0_LORA_CADDONE  0x80  // 10------
 #define MAP_DIO1_LORA_RXTOUT   0x00  // --00----
 #define MAP_DIO1_LORA_NOP      0x30  // --11----
 #define MAP_DIO2_LORA_NOP      0xC0  // ----11--
@@ -185,10 +241,18 @@ enum sf_t { SF7=7, SF8, SF9, SF10, SF11, SF12 };
 #define IRQ_LORA_FHSSCH_MASK 0x02
 #define IRQ_LORA_CDDETD_MASK 0x01
 
+// ----------------------------------------
+// REG_MODEM_STAT: signal detected | signal synchronized | header info valid
+#define MODEM_STAT_RX_BUSY   0x0B
+
+// REG_HOP_CHANNEL: the received header had the payload CRC on
+#define HOP_CHANNEL_CRC_ON   0x40
+
 
-#define PROTOCOL_VERSION  1
+#define PROTOCOL_VERSION  2
 #define PKT_PUSH_DATA 0
 #define PKT_PUSH_ACK  1
 #define PKT_PULL_DATA 2
 #define PKT_PULL_RESP 3
 #define PKT_PULL_ACK  4
+#define PKT_TX_ACK    5
@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * LoRaWAN uplink filter on DevAddr prefixes (*1, par. 4.1 and 4.3.1)
+ * Data frame layout: MHDR(1) DevAddr(4, LSB first) FCtrl(1) FCnt(2) ... MIC(4)
+ * The rule table is small and sorted with the longest prefix first, so the
+ * first rule that matches is the best one: a lookup is at most LWF_RULES
+ * mask-and-compare operations.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "lwFilter.h"
+
+LwRule lwRules[LWF_RULES];
+int lwRuleCount = 0;
+bool lwDefaultAllow = true;						// No rules: forward everything
+
+uint32_t lwDefault = 0;							// Data frames that matched no rule
+uint32_t lwDropped = 0;							// Frames not forwarded
+uint32_t lwOther = 0;							// Join and proprietary frames, not checked
+
+// ----------------------------------------------------------------------------
+// Read the LoRaWAN header of a received frame into h.
+// Returns false when the frame is too short or not LoRaWAN R1.
+// devAddr, fctrl and fcnt are only set for data frames.
+// ----------------------------------------------------------------------------
+bool lwParse(uint8_t *payload, uint8_t len, LwHeader *h) {
+	if (len < 1 + 4) return(false);				// MHDR + MIC at least
+	if ((payload[0] & 0x03) != 0) return(false);	// Major must be LoRaWAN R1
+
+	h->mtype = payload[0] >> 5;
+	h->devAddr = 0;
+	h->fctrl = 0;
+	h->fcnt = 0;
+
+	if ((h->mtype == MTYPE_UNCONF_UP) || (h->mtype == MTYPE_CONF_UP) ||
+		(h->mtype == MTYPE_UNCONF_DOWN) || (h->mtype == MTYPE_CONF_DOWN)) {
+		if (len < 1 + 7 + 4) return(false);		// MHDR + FHDR + MIC
+		h->devAddr = (uint32_t)payload[1] | ((uint32_t)payload[2] << 8) |
+					 ((uint32_t)payload[3] << 16) | ((uint32_t)payload[4] << 24);
+		h->fctrl = payload[5];
+		h->fcnt = payload[6] | (payload[7] << 8);
+	}
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Decide if a received frame is forwarded. Data frames are checked against
+// the rules, other LoRaWAN frames always pass. Frames that are not LoRaWAN
+// get the default action.
+// ----------------------------------------------------------------------------
+bool lwFilterPass(uint8_t *payload, uint8_t len) {
+	LwHeader h;
+	bool allow;
+
+	if (!lwParse(payload, len, &h)) {
+		allow = lwDefaultAllow;
+	}
+	else if ((h.mtype == MTYPE_JOIN_REQUEST) || (h.mtype == MTYPE_REJOIN_REQUEST) ||
+			 (h.mtype == MTYPE_PROPRIETARY)) {
+		lwOther++;
+		return(true);
+	}
+	else {
+		int i;
+		for (i=0; i<lwRuleCount; i++) {
+			if ((h.devAddr & lwRules[i].mask) == lwRules[i].prefix) break;
+		}
+		if (i < lwRuleCount) {
+			lwRules[i].hits++;
+			allow = lwRules[i].allow;
+		}
+		else {
+			lwDefault++;
+			allow = lwDefaultAllow;
+		}
+	}
+
+	if (!allow) lwDropped++;
+	return(allow);
+}
+
+// ----------------------------------------------------------------------------
+// Add a rule for DevAddr prefix/bits, or change the action of an existing one.
+// Returns the index of the rule or -1 when the table is full.
+// ----------------------------------------------------------------------------
+int lwFilterAdd(uint32_t prefix, uint8_t bits, bool allow) {
+	if (bits > 32) bits = 32;
+	uint32_t mask = (bits == 0) ? 0 : (0xFFFFFFFFUL << (32 - bits));
+	prefix &= mask;
+
+	int i;
+	for (i=0; i<lwRuleCount; i++) {
+		if ((lwRules[i].bits == bits) && (lwRules[i].prefix == prefix)) {
+			lwRules[i].allow = allow;
+			return(i);
+		}
+	}
+	if (lwRuleCount >= LWF_RULES) return(-1);
+
+	// Insert sorted, longest prefix first
+	i = lwRuleCount;
+	while ((i > 0) && (lwRules[i-1].bits < bits)) {
+		lwRules[i] = lwRules[i-1];
+		i--;
+	}
+	lwRules[i].prefix = prefix;
+	lwRules[i].mask   = mask;
+	lwRules[i].bits   = bits;
+	lwRules[i].allow  = allow;
+	lwRules[i].hits   = 0;
+	lwRuleCount++;
+	return(i);
+}
+
+// ----------------------------------------------------------------------------
+// Remove rule n
+// ----------------------------------------------------------------------------
+void lwFilterDel(int n) {
+	if ((n < 0) || (n >= lwRuleCount)) return;
+	for (int i=n+1; i<lwRuleCount; i++) {
+		lwRules[i-1] = lwRules[i];
+	}
+	lwRuleCount--;
+}
+
+uint32_t lwDefaultHits()   { return(lwDefault); }
+uint32_t lwDroppedFrames() { return(lwDropped); }
+uint32_t lwOtherFrames()   { return(lwOther); }
+
+void lwFilterResetStats() {
+	for (int i=0; i<lwRuleCount; i++) lwRules[i].hits = 0;
+	lwDefault = 0;
+	lwDropped = 0;
+	lwOther = 0;
+}
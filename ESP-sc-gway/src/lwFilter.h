@@ -0,0 +1,53 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway LoRaWAN uplink filter
+//
+// The MAC header of every received frame is read (MType, DevAddr, FCtrl, FCnt, *1
+// par. 4) and the DevAddr is matched against a small table of address prefixes. A
+// NetID is a DevAddr prefix too (NwkID in the top bits), e.g. 26000000/7 for TTN.
+// The longest matching prefix decides whether the frame is forwarded; frames that
+// match no rule get the default action. Join requests carry no DevAddr and are always
+// forwarded. Rules are set at runtime through the web server (/FILTER).
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define LWF_RULES  16						// Max number of prefix rules
+
+// LoRaWAN MType, bits 7..5 of MHDR
+#define MTYPE_JOIN_REQUEST     0
+#define MTYPE_JOIN_ACCEPT      1
+#define MTYPE_UNCONF_UP        2
+#define MTYPE_UNCONF_DOWN      3
+#define MTYPE_CONF_UP          4
+#define MTYPE_CONF_DOWN        5
+#define MTYPE_REJOIN_REQUEST   6
+#define MTYPE_PROPRIETARY      7
+
+struct LwHeader {
+	uint8_t  mtype;
+	uint32_t devAddr;						// Only for data frames
+	uint8_t  fctrl;
+	uint16_t fcnt;
+};
+
+struct LwRule {
+	uint32_t prefix;						// DevAddr bits, the others are 0
+	uint32_t mask;
+	uint8_t  bits;							// Prefix length, 0..32
+	bool     allow;
+	uint32_t hits;
+};
+
+extern LwRule lwRules[LWF_RULES];			// Sorted on bits, longest prefix first
+extern int lwRuleCount;
+extern bool lwDefaultAllow;
+
+// Functions:
+bool lwParse(uint8_t *, uint8_t , LwHeader * );
+bool lwFilterPass(uint8_t *, uint8_t );
+int lwFilterAdd(uint32_t , uint8_t , bool );
+void lwFilterDel(int );
+uint32_t lwDefaultHits( void );
+uint32_t lwDroppedFrames( void );
+uint32_t lwOtherFrames( void );
+void lwFilterResetStats( void );
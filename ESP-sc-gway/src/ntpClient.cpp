@@ -0,0 +1,265 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Non blocking SNTP client (RFC 4330).
+ * T1 is our micros64() when the request is sent; it is also put in the
+ * transmit timestamp so the server echoes it as originate timestamp and we
+ * can recognise the answer. T2/T3 are the receive/transmit timestamps of the
+ * server, T4 is micros64() when we read the answer:
+ *	offset = ((T2 - T1) + (T3 - T4)) / 2
+ *	delay  = (T4 - T1) - (T3 - T2)
+ * UTC (in uSec since 1970) of a local time t is t + offset.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "ESP-sc-gway.h"
+#include "aux.h"
+#include "dnsCache.h"
+#include "ntpClient.h"
+
+extern int debug;
+
+#define NTP_UNIX_OFFSET  2208988800UL			// Seconds from 1900 to 1970
+
+WiFiUDP  ntpUdp;
+uint8_t  ntpBuf[NTP_PACKET_SIZE];
+int      ntpDns = -1;							// dnsCache entry of the server
+bool     ntpWaiting = false;					// Request sent, no answer yet
+uint64_t ntpT1 = 0;
+uint32_t ntpSentAt = 0;							// millis() of the request, for the timeout
+uint32_t ntpNextPoll = 0;						// millis() of the next request
+int64_t  ntpOffset = 0;							// UTC - micros64(), uSec
+bool     ntpValid = false;
+uint32_t ntpLastSync = 0;						// millis() of the last good answer
+
+uint32_t ntpPollCount = 0;
+uint32_t ntpFailCount = 0;
+uint32_t ntpLastDelay = 0;
+int32_t  ntpLastCorrection = 0;
+uint64_t ntpSampleLocal = 0;					// Last raw sample, before smoothing
+int64_t  ntpSampleOff = 0;
+
+// ----------------------------------------------------------------------------
+// Start the client on its own socket. dns is the dnsCache entry of the server.
+// ----------------------------------------------------------------------------
+void ntpInit(int dns) {
+	ntpDns = dns;
+	if (ntpUdp.begin(NTP_LOCALPORT) != 1) {
+		Serial.println(F("ntpInit:: ERROR socket"));
+	}
+	ntpNextPoll = millis();
+}
+
+static uint32_t be32(uint8_t *b) {
+	return(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3]);
+}
+
+// NTP timestamp (seconds since 1900 and 2^-32 fractions) to uSec since 1970
+static uint64_t ntpToMicros(uint8_t *b) {
+	uint64_t sec = be32(b) - NTP_UNIX_OFFSET;
+	uint64_t frac = ((uint64_t)be32(b + 4) * 1000000) >> 32;
+	return(sec * 1000000 + frac);
+}
+
+static void ntpSend(IPAddress &server) {
+	while (ntpUdp.parsePacket() > 0) ntpUdp.flush();		// Late answers of a lost request
+
+	memset(ntpBuf, 0, NTP_PACKET_SIZE);
+	ntpBuf[0] = 0b00100011;							// LI 0, Version 4, Mode 3 (client)
+	ntpT1 = micros64();
+	for (int i=0; i<8; i++) ntpBuf[40 + i] = (uint8_t)(ntpT1 >> (56 - 8*i));
+
+	ntpUdp.beginPacket(server, 123);					// NTP Server and Port
+	if (ntpUdp.write((char *)ntpBuf, NTP_PACKET_SIZE) != NTP_PACKET_SIZE) {
+		Serial.println(F("ntpSend:: ERROR write"));
+	}
+	ntpUdp.endPacket();
+	ntpSentAt = millis();
+	ntpWaiting = true;
+	ntpPollCount++;
+}
+
+// ----------------------------------------------------------------------------
+// Use the answer in ntpBuf, received at t4. Returns false when it is not the
+// answer to our request or not good enough.
+// ----------------------------------------------------------------------------
+static bool ntpAnswer(uint64_t t4) {
+	if ((ntpBuf[0] & 0x07) != 4) return(false);			// Not a server answer
+	if (ntpBuf[1] == 0) return(false);					// Kiss-o'-Death, or unsynchronized
+	for (int i=0; i<8; i++) {
+		if (ntpBuf[24 + i] != (uint8_t)(ntpT1 >> (56 - 8*i))) return(false);
+	}
+
+	int64_t t2 = ntpToMicros(ntpBuf + 32);
+	int64_t t3 = ntpToMicros(ntpBuf + 40);
+	int64_t delay = (int64_t)(t4 - ntpT1) - (t3 - t2);
+	if ((delay < 0) || (delay > NTP_MAX_DELAY_US)) return(false);
+
+	int64_t offset = ((t2 - (int64_t)ntpT1) + (t3 - (int64_t)t4)) / 2;
+	int64_t change = offset - ntpOffset;
+	ntpSampleLocal = ntpT1 + (t4 - ntpT1) / 2;
+	ntpSampleOff = offset;
+
+	if (!ntpValid || (change > NTP_STEP_US) || (change < -NTP_STEP_US)) {
+		ntpOffset = offset;
+	}
+	else {
+		change /= NTP_SMOOTH;
+		ntpOffset += change;
+	}
+	ntpValid = true;
+	ntpLastSync = millis();
+	ntpLastDelay = delay;
+	ntpLastCorrection = (change > INT32_MAX) ? INT32_MAX : ((change < INT32_MIN) ? INT32_MIN : change);
+
+	if (debug >= 1) {
+		Serial.print(F("NTP:: delay "));
+		Serial.print(ntpLastDelay);
+		Serial.print(F(" uSec, correction "));
+		Serial.print(ntpLastCorrection);
+		Serial.println(F(" uSec"));
+	}
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Send a request when one is due and pick up the answer. Never blocks.
+// Returns true when the clock was updated.
+// ----------------------------------------------------------------------------
+bool ntpService(bool connected) {
+	uint32_t now = millis();
+
+	if (ntpWaiting) {
+		int size = ntpUdp.parsePacket();
+		if (size > 0) {
+			uint64_t t4 = micros64();
+			int n = ntpUdp.read(ntpBuf, NTP_PACKET_SIZE);
+			ntpUdp.flush();
+			if ((n == NTP_PACKET_SIZE) && ntpAnswer(t4)) {
+				ntpWaiting = false;
+				ntpNextPoll = now + NTP_INTERVAL * 1000UL;
+				return(true);
+			}
+			return(false);										// Not ours, keep waiting
+		}
+		if (now - ntpSentAt >= NTP_TIMEOUT_MS) {
+			ntpWaiting = false;
+			ntpFailCount++;
+			ntpNextPoll = now + NTP_RETRY_MS;
+			if (debug >= 1) Serial.println(F("NTP:: no answer"));
+		}
+		return(false);
+	}
+
+	if (!connected || ((int32_t)(now - ntpNextPoll) < 0)) return(false);
+
+	IPAddress server;
+	if (!dnsGet(ntpDns, server)) {
+		ntpNextPoll = now + NTP_RETRY_MS;						// Not resolved (yet)
+		return(false);
+	}
+	ntpSend(server);
+	return(false);
+}
+
+bool ntpSynced() {
+	return(ntpValid);
+}
+
+// ----------------------------------------------------------------------------
+// UTC in uSec since 1970 of the micros64() time t
+// ----------------------------------------------------------------------------
+uint64_t ntpUtc(uint64_t t) {
+	return(t + ntpOffset);
+}
+
+uint32_t ntpNow() {
+	return((uint32_t)(ntpUtc(micros64()) / 1000000));
+}
+
+// ----------------------------------------------------------------------------
+// Date of a day number since 1970 (H. Hinnant, civil_from_days)
+// ----------------------------------------------------------------------------
+static void ntpCivil(uint32_t z, int *y, int *m, int *d) {
+	z += 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+	uint32_t mp = (5*doy + 2) / 153;
+	*d = doy - (153*mp + 2)/5 + 1;
+	*m = (mp < 10) ? mp + 3 : mp - 9;
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static char *put2(char *p, int v) {
+	*p++ = '0' + v / 10;
+	*p++ = '0' + v % 10;
+	return(p);
+}
+
+// "2026-10-18?12:34:56", sep between date and time
+static char *ntpDateTime(char *p, uint64_t utc, char sep) {
+	uint32_t s = utc / 1000000;
+	int y, m, d;
+	ntpCivil(s / 86400, &y, &m, &d);
+	s %= 86400;
+	p = put2(p, y / 100);
+	p = put2(p, y % 100);
+	*p++ = '-';
+	p = put2(p, m);
+	*p++ = '-';
+	p = put2(p, d);
+	*p++ = sep;
+	p = put2(p, s / 3600);
+	*p++ = ':';
+	p = put2(p, (s / 60) % 60);
+	*p++ = ':';
+	p = put2(p, s % 60);
+	return(p);
+}
+
+// ----------------------------------------------------------------------------
+// ISO 8601 compact UTC time with uSec as used in rxpk "time" (*2, par. 4):
+// 2026-10-18T12:34:56.123456Z. Returns the length (27), adds a terminating 0.
+// ----------------------------------------------------------------------------
+int ntpIsoTime(char *buf, uint64_t utc) {
+	char *p = ntpDateTime(buf, utc, 'T');
+	uint32_t us = utc % 1000000;
+	*p++ = '.';
+	for (uint32_t div = 100000; div > 0; div /= 10) *p++ = '0' + (us / div) % 10;
+	*p++ = 'Z';
+	*p = 0;
+	return(p - buf);
+}
+
+// ----------------------------------------------------------------------------
+// UTC time as used in stat "time" (*2, par. 4): 2026-10-18 12:34:56 GMT
+// Returns the length (23), adds a terminating 0.
+// ----------------------------------------------------------------------------
+int ntpStatTime(char *buf, uint64_t utc) {
+	char *p = ntpDateTime(buf, utc, ' ');
+	memcpy(p, " GMT", 5);
+	return(p + 4 - buf);
+}
+
+uint32_t ntpPolls()      { return(ntpPollCount); }
+uint32_t ntpFailures()   { return(ntpFailCount); }
+uint32_t ntpDelay()      { return(ntpLastDelay); }
+int32_t  ntpCorrection() { return(ntpLastCorrection); }
+
+// The last raw sample: offset measured at local time (midpoint of T1 and T4)
+uint64_t ntpSampleTime()   { return(ntpSampleLocal); }
+int64_t  ntpSampleOffset() { return(ntpSampleOff); }
+
+// Seconds since the last good answer
+uint32_t ntpAge() {
+	return(ntpValid ? (millis() - ntpLastSync) / 1000 : 0);
+}
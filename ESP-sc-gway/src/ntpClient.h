@@ -0,0 +1,34 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway NTP client
+//
+// SNTP (RFC 4330) on its own UDP socket, driven from the main loop: a request is
+// sent every NTP_INTERVAL seconds and the answer is picked up by a later call, so
+// nothing ever waits for the network. The offset between micros64() and UTC is
+// computed from the four timestamps of every answer (round trip compensated, with
+// the fraction bits) and smoothed over the polls.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define NTP_PACKET_SIZE  48				// Fixed size of an NTP message
+#define NTP_TIMEOUT_MS   2000			// No answer after this time: request is lost
+#define NTP_RETRY_MS     8000			// Ask again after a lost request or a bad answer
+#define NTP_MAX_DELAY_US 250000			// Answers with a longer round trip are not used
+#define NTP_STEP_US      100000			// A larger offset change is applied at once
+#define NTP_SMOOTH       4				// Otherwise 1/NTP_SMOOTH of the change is applied
+
+// Functions:
+void ntpInit(int );
+bool ntpService(bool );
+bool ntpSynced( void );
+uint64_t ntpUtc(uint64_t );
+uint32_t ntpNow( void );
+int ntpIsoTime(char *, uint64_t );
+int ntpStatTime(char *, uint64_t );
+uint32_t ntpPolls( void );
+uint32_t ntpFailures( void );
+uint32_t ntpDelay( void );
+int32_t ntpCorrection( void );
+uint64_t ntpSampleTime( void );
+int64_t ntpSampleOffset( void );
+uint32_t ntpAge( void );
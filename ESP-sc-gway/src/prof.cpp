@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Latency profiler.
+ * profAdd() costs a count-leading-zeros and a few additions, so the stages
+ * can stay measured in production. Values are kept in CPU cycles
+ * (ESP.getCycleCount(), 80 or 160 per uSec) and only converted to uSec
+ * when they are shown. A percentile is the upper bound of the bucket it
+ * falls in, so it is accurate to a factor 2, capped by the real maximum.
+ * A stage is about 150 bytes; it is allocated when it is first measured, and
+ * stays allocated (a reset only clears it).
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "prof.h"
+#include "sched.h"
+
+#if _PROFILE==1
+
+struct ProfStage {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t bucket[PROF_BUCKETS];
+};
+
+ProfStage *profTable[PROF_COUNT];				// NULL until the stage is measured
+
+static const ProfStage profEmpty = { 0 };
+
+const char *profNames[PROF_TASK] = {
+	"loop pass", "dio0 detect", "fifo drain", "json build", "sendUdp", "readUdp", "tx prep",
+	"led show",
+	"up fifo read", "up serialized", "up queued",
+	"up sent server 0", "up sent server 1", "up sent server 2", "up sent server 3"
+};
+
+// ----------------------------------------------------------------------------
+// Add one measurement of cycles to stage id
+// ----------------------------------------------------------------------------
+void profAdd(int id, uint32_t cycles) {
+	if ((id < 0) || (id >= PROF_COUNT)) return;
+	ProfStage *p = profTable[id];
+	if (p == NULL) {
+		p = (ProfStage *) calloc(1, sizeof(ProfStage));
+		if (p == NULL) return;									// No heap, not measured
+		profTable[id] = p;
+	}
+
+	if ((p->count == 0) || (cycles < p->min)) p->min = cycles;
+	if (cycles > p->max) p->max = cycles;
+	p->count++;
+	p->total += cycles;
+	p->bucket[(cycles == 0) ? 0 : 31 - __builtin_clz(cycles)]++;
+}
+
+// ----------------------------------------------------------------------------
+// Add one measurement of us uSec to stage id, saturated at 2^32-1 cycles
+// ----------------------------------------------------------------------------
+void profAddUs(int id, uint32_t us) {
+	uint64_t cycles = (uint64_t) us * ESP.getCpuFreqMHz();
+	profAdd(id, (cycles > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32_t) cycles);
+}
+
+// A stage that was never measured reads as empty
+static const ProfStage * profStage(int id) {
+	return((profTable[id] != NULL) ? profTable[id] : &profEmpty);
+}
+
+static uint32_t profUs(uint32_t cycles) {
+	return(cycles / ESP.getCpuFreqMHz());
+}
+
+const char *profName(int id) {
+	if (id < PROF_TASK) return(profNames[id]);
+	if (id - PROF_TASK < schedCount()) return(schedName(id - PROF_TASK));
+	return("");
+}
+
+uint32_t profCount(int id)  { return(profStage(id)->count); }
+uint32_t profMinUs(int id)  { return(profUs(profStage(id)->min)); }
+uint32_t profMaxUs(int id)  { return(profUs(profStage(id)->max)); }
+uint32_t profBucket(int id, int b) { return(profStage(id)->bucket[b]); }
+
+uint32_t profAvgUs(int id) {
+	const ProfStage *p = profStage(id);
+	if (p->count == 0) return(0);
+	return(profUs((uint32_t)(p->total / p->count)));
+}
+
+// ----------------------------------------------------------------------------
+// The pct percentile (0-100) of stage id in uSec
+// ----------------------------------------------------------------------------
+uint32_t profPctUs(int id, int pct) {
+	const ProfStage *p = profStage(id);
+	if (p->count == 0) return(0);
+
+	uint32_t need = (uint32_t)(((uint64_t)p->count * pct + 99) / 100);
+	uint32_t seen = 0;
+	for (int b=0; b<PROF_BUCKETS; b++) {
+		seen += p->bucket[b];
+		if (seen >= need) {
+			uint32_t top = (b == 31) ? 0xFFFFFFFF : ((uint32_t)2 << b) - 1;
+			return(profUs((top < p->max) ? top : p->max));
+		}
+	}
+	return(profUs(p->max));
+}
+
+// ----------------------------------------------------------------------------
+// Print all stages with their non-empty buckets on the serial port
+// ----------------------------------------------------------------------------
+void profDump() {
+	Serial.print(F("Profile, uSec, CPU "));
+	Serial.print(ESP.getCpuFreqMHz());
+	Serial.println(F(" MHz"));
+	for (int i=0; i<PROF_COUNT; i++) {
+		const ProfStage *p = profStage(i);
+		if (p->count == 0) continue;
+		Serial.print(profName(i));
+		Serial.print(F(": n="));   Serial.print(p->count);
+		Serial.print(F(" min="));  Serial.print(profMinUs(i));
+		Serial.print(F(" avg="));  Serial.print(profAvgUs(i));
+		Serial.print(F(" p99="));  Serial.print(profPctUs(i, 99));
+		Serial.print(F(" max="));  Serial.println(profMaxUs(i));
+		for (int b=0; b<PROF_BUCKETS; b++) {
+			if (p->bucket[b] == 0) continue;
+			Serial.print(F("  <"));
+			Serial.print(profUs(((b == 31) ? 0xFFFFFFFF : ((uint32_t)2 << b) - 1)) + 1);
+			Serial.print(F(": "));
+			Serial.println(p->bucket[b]);
+		}
+		yield();
+	}
+}
+
+void profReset() {
+	for (int i=0; i<PROF_COUNT; i++) {
+		if (profTable[i] != NULL) memset(profTable[i], 0, sizeof(ProfStage));
+	}
+}
+
+#endif
@@ -0,0 +1,59 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway latency profiler
+//
+// Every measured stage has a histogram of its run time in CPU cycles with log2 buckets
+// (bucket b holds 2^b .. 2^(b+1)-1 cycles), plus count, min and max. The hot path is
+// measured with PROF_START / PROF_END around the code, the scheduler tasks by schedRun().
+// The uplink trace stages are the time since RxDone, added with PROF_ADD_US; that is
+// converted to cycles in 64 bits and saturates at 2^32-1 (26 sec at 160 MHz).
+// A stage gets its table on the heap with its first measurement, so stages that are
+// never used (servers, tasks, LEDs that are not there) cost one pointer.
+// With _PROFILE 0 the macros are empty and no tables are compiled in.
+// Results: web page, or 'p' on the serial port (dump) and 'z' (reset).
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include "ESP-sc-gway.h"
+
+#define PROF_BUCKETS   32				// log2 buckets, enough for any uint32_t
+
+// Stages
+#define PROF_PASS      0				// One schedRun() pass
+#define PROF_DIO0      1				// DIO0 interrupt until pollLoraModem() picks it up
+#define PROF_FIFO      2				// receivePkt(), FIFO drain over SPI
+#define PROF_JSON      3				// receivePacket(), rxpk JSON build
+#define PROF_SENDUDP   4				// One datagram to one server
+#define PROF_READUDP   5				// readUdp(), one server message
+#define PROF_TXPREP    6				// txLoraModem() up to the wait for tmst
+#define PROF_LEDSHOW   7				// One WS2812 frame (interrupts off with bit bang)
+#define PROF_UP_FIFO   8				// Uplink trace, uSec after RxDone: FIFO read
+#define PROF_UP_JSON   9				// rxpk serialized
+#define PROF_UP_QUEUE  10				// Added to the PUSH_DATA batch
+#define PROF_UP_SEND   11				// Sent, one stage per server
+#define PROF_UP_SERVERS 4				// Same as UP_MAX
+#define PROF_TASK      (PROF_UP_SEND + PROF_UP_SERVERS)	// First scheduler task, one stage per task
+#define PROF_TASKS     12				// Same as SCHED_TASKS
+#define PROF_COUNT     (PROF_TASK + PROF_TASKS)
+
+#if _PROFILE==1
+#define PROF_START(v)        uint32_t v = ESP.getCycleCount()
+#define PROF_END(id, v)      profAdd((id), ESP.getCycleCount() - (v))
+#define PROF_ADD_US(id, us)  profAddUs((id), (us))
+#else
+#define PROF_START(v)
+#define PROF_END(id, v)
+#define PROF_ADD_US(id, us)
+#endif
+
+// Functions:
+void profAdd(int , uint32_t );
+void profAddUs(int , uint32_t );
+const char *profName(int );
+uint32_t profCount(int );
+uint32_t profMinUs(int );
+uint32_t profMaxUs(int );
+uint32_t profAvgUs(int );
+uint32_t profPctUs(int , int );
+uint32_t profBucket(int , int );
+void profDump( void );
+void profReset( void );
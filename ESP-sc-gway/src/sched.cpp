@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Cooperative scheduler for the main loop.
+ * A task is due when its trigger returns true or when period ms have passed
+ * since it last ran (period 0: every pass). The table is kept sorted on
+ * priority so one pass runs the most important work first.
+ * Radio service latency is bounded by the largest budget of the other tasks:
+ * between two of them the radio triggers are always checked again. The
+ * measured worst case is kept for the web page.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "sched.h"
+#include "prof.h"
+
+extern int debug;
+
+struct SchedTask {
+	const char     *name;
+	schedTask_t     fn;
+	schedTrigger_t  trigger;					// NULL: periodic only
+	uint8_t         prio;
+	uint16_t        period;						// ms, 0 = every pass
+	uint32_t        budget;						// uSec
+	uint32_t        last;						// millis() of the last run
+	uint32_t        runs;
+	uint32_t        overruns;
+	uint32_t        deferred;					// Skipped, budget did not fit the guard
+	uint32_t        maxUs;
+	uint64_t        totalUs;
+};
+
+SchedTask    schedTable[SCHED_TASKS];
+int          schedNum = 0;
+schedGuard_t schedGuard = NULL;
+uint32_t     schedLastCheck = 0;				// micros() of the last radio check
+uint32_t     schedGapMax = 0;					// Longest time without a radio check, uSec
+
+// ----------------------------------------------------------------------------
+// Register a task. period in ms, budget in uSec, trigger may be NULL.
+// Returns the task index or -1 when the table is full.
+// ----------------------------------------------------------------------------
+int schedAdd(const char *name, schedTask_t fn, uint8_t prio, uint16_t period,
+				uint32_t budget, schedTrigger_t trigger) {
+	if (schedNum >= SCHED_TASKS) return(-1);
+
+	int i = schedNum++;
+	while ((i > 0) && (schedTable[i-1].prio > prio)) {		// Insertion, stable per priority
+		schedTable[i] = schedTable[i-1];
+		i--;
+	}
+	SchedTask *t = &schedTable[i];
+	memset(t, 0, sizeof(SchedTask));
+	t->name    = name;
+	t->fn      = fn;
+	t->trigger = trigger;
+	t->prio    = prio;
+	t->period  = period;
+	t->budget  = budget;
+	t->last    = millis();
+	return(i);
+}
+
+// ----------------------------------------------------------------------------
+// guard returns the uSec that are left before the radio needs the CPU again
+// (the next downlink). A task with a larger budget waits.
+// ----------------------------------------------------------------------------
+void schedSetGuard(schedGuard_t guard) {
+	schedGuard = guard;
+}
+
+// ----------------------------------------------------------------------------
+// Run one task and check its budget
+// ----------------------------------------------------------------------------
+static void schedExec(SchedTask *t) {
+	uint32_t start = micros();
+	PROF_START(cycles);
+	t->last = millis();
+	t->fn();
+	PROF_END(PROF_TASK + (t - schedTable), cycles);
+	uint32_t used = micros() - start;
+
+	t->runs++;
+	t->totalUs += used;
+	if (used > t->maxUs) t->maxUs = used;
+	if (used > t->budget) {
+		t->overruns++;
+		if (debug >= 1) {
+			Serial.print(F("sched:: "));
+			Serial.print(t->name);
+			Serial.print(F(" overrun "));
+			Serial.print(used);
+			Serial.print(F("/"));
+			Serial.print(t->budget);
+			Serial.println(F(" uSec"));
+		}
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Run the radio tasks whose trigger fired. The longest time between two of
+// these checks is the worst case radio service latency.
+// ----------------------------------------------------------------------------
+static void schedRadio() {
+	uint32_t now = micros();
+	if ((schedLastCheck != 0) && (now - schedLastCheck > schedGapMax)) {
+		schedGapMax = now - schedLastCheck;
+	}
+	for (int i=0; (i<schedNum) && (schedTable[i].prio == SCHED_PRIO_RADIO); i++) {
+		SchedTask *t = &schedTable[i];
+		if ((t->trigger != NULL) && t->trigger()) schedExec(t);
+	}
+	schedLastCheck = micros();
+}
+
+// ----------------------------------------------------------------------------
+// One pass over all tasks. Called from loop().
+// ----------------------------------------------------------------------------
+void schedRun() {
+	for (int i=0; i<schedNum; i++) {
+		SchedTask *t = &schedTable[i];
+
+		bool due = (t->period == 0) || (millis() - t->last >= t->period);
+		if (!due && ((t->trigger == NULL) || !t->trigger())) continue;
+
+		if (t->prio != SCHED_PRIO_RADIO) {
+			schedRadio();
+			if ((schedGuard != NULL) && (t->budget > schedGuard())) {
+				t->deferred++;
+				continue;
+			}
+		}
+		else {
+			schedLastCheck = micros();
+		}
+		schedExec(t);
+		yield();
+	}
+	schedRadio();
+}
+
+int         schedCount()          { return(schedNum); }
+const char *schedName(int i)      { return(schedTable[i].name); }
+uint8_t     schedPrio(int i)      { return(schedTable[i].prio); }
+uint32_t    schedBudget(int i)    { return(schedTable[i].budget); }
+uint32_t    schedRuns(int i)      { return(schedTable[i].runs); }
+uint32_t    schedOverruns(int i)  { return(schedTable[i].overruns); }
+uint32_t    schedDeferred(int i)  { return(schedTable[i].deferred); }
+uint32_t    schedMaxUs(int i)     { return(schedTable[i].maxUs); }
+uint32_t    schedRadioGap()       { return(schedGapMax); }
+
+// Average run time in uSec
+uint32_t schedAvgUs(int i) {
+	return(schedTable[i].runs ? (uint32_t)(schedTable[i].totalUs / schedTable[i].runs) : 0);
+}
+
+void schedResetStats() {
+	for (int i=0; i<schedNum; i++) {
+		SchedTask *t = &schedTable[i];
+		t->runs = t->overruns = t->deferred = t->maxUs = t->totalUs = 0;
+	}
+	schedGapMax = 0;
+}
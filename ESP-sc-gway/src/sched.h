@@ -0,0 +1,39 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway cooperative scheduler
+//
+// The subsystems of loop() are tasks with a priority, a period or an event trigger
+// and a time budget. schedRun() is one pass over the tasks in priority order.
+// Before every task below SCHED_PRIO_RADIO the radio tasks whose trigger fired are
+// run first, and a task is deferred when its budget does not fit before the next
+// radio deadline (the guard). Tasks that take longer than their budget are counted
+// as overruns. Tasks are never interrupted, so the budgets must be realistic.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define SCHED_TASKS        12				// Maximum number of tasks
+
+#define SCHED_PRIO_RADIO   0				// RX FIFO and downlinks, always first
+#define SCHED_PRIO_NET     1				// Server traffic, WiFi and DNS
+#define SCHED_PRIO_SERVICE 2				// Statistics, NTP, web admin, OTA
+#define SCHED_PRIO_COSMETIC 3				// OLED and LEDs
+
+typedef void (*schedTask_t)( void );
+typedef bool (*schedTrigger_t)( void );
+typedef uint32_t (*schedGuard_t)( void );	// uSec until the next radio deadline
+
+// Functions:
+int schedAdd(const char *, schedTask_t , uint8_t , uint16_t , uint32_t , schedTrigger_t );
+void schedSetGuard( schedGuard_t );
+void schedRun( void );
+int schedCount( void );
+const char *schedName(int );
+uint8_t schedPrio(int );
+uint32_t schedBudget(int );
+uint32_t schedRuns(int );
+uint32_t schedOverruns(int );
+uint32_t schedDeferred(int );
+uint32_t schedMaxUs(int );
+uint32_t schedAvgUs(int );
+uint32_t schedRadioGap( void );
+void schedResetStats( void );
@@ -0,0 +1,127 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Downlink timing calibration.
+ * Drift: every NTP answer gives the offset UTC - micros64() at a local time.
+ * When micros() runs fast the offset goes down. Over the last
+ * CAL_DRIFT_SAMPLES answers, with offset(local) the least squares line:
+ *	drift (ppb) = -d offset / d local * 10^9
+ * A wait of w local uSec then takes w * (1 - drift) real uSec, so the
+ * downlink has to be w * drift later.
+ * TX latency: the radio signals TxDone some time after the last symbol left
+ * the antenna, and starts later than OPMODE_TX (PLL lock, PA ramp). The
+ * excess over the calculated time on air is averaged; OPMODE_TX is given
+ * that much earlier.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "timeCal.h"
+
+extern int debug;
+
+uint64_t calLocal[CAL_DRIFT_SAMPLES];			// micros64() of the NTP samples
+int64_t  calOffset[CAL_DRIFT_SAMPLES];
+uint8_t  calCount = 0;
+uint8_t  calNext = 0;
+int32_t  calDrift = 0;							// ppb, positive when micros() is fast
+bool     calDriftOk = false;
+
+int32_t  calTxAvg = 0;							// uSec, averaged TX latency
+int32_t  calTxLastUs = 0;
+uint32_t calTxCount = 0;
+
+// ----------------------------------------------------------------------------
+// Forget the NTP samples and start again from this one
+// ----------------------------------------------------------------------------
+static void calRestart(uint64_t local, int64_t offset) {
+	calLocal[0] = local;
+	calOffset[0] = offset;
+	calCount = 1;
+	calNext = 1;
+}
+
+// ----------------------------------------------------------------------------
+// An NTP answer: offset = UTC - local at local time local (both uSec).
+// The drift is the slope of a least squares line through the samples, a
+// single answer can be off by half its round trip.
+// ----------------------------------------------------------------------------
+void calNtpSample(uint64_t local, int64_t offset) {
+	if (calCount > 0) {
+		int last = (calNext + CAL_DRIFT_SAMPLES - 1) % CAL_DRIFT_SAMPLES;
+		int64_t step = offset - calOffset[last];
+		if ((step > CAL_STEP_US) || (step < -CAL_STEP_US)) {
+			// Other server or the time was stepped, the old samples are useless
+			if (debug >= 1) Serial.println(F("calNtpSample:: offset step, drift restarted"));
+			calRestart(local, offset);
+			return;
+		}
+	}
+	calLocal[calNext] = local;
+	calOffset[calNext] = offset;
+	calNext = (calNext + 1) % CAL_DRIFT_SAMPLES;
+	if (calCount < CAL_DRIFT_SAMPLES) calCount++;
+
+	int oldest = (calCount < CAL_DRIFT_SAMPLES) ? 0 : calNext;
+	if ((int64_t)(local - calLocal[oldest]) < CAL_DRIFT_MIN_US) return;
+
+	// Relative to the oldest sample so the doubles keep their precision
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (int i=0; i<calCount; i++) {
+		double x = (double)(int64_t)(calLocal[i] - calLocal[oldest]);
+		double y = (double)(calOffset[i] - calOffset[oldest]);
+		sx += x; sy += y; sxx += x * x; sxy += x * y;
+	}
+	double den = calCount * sxx - sx * sx;
+	if (den <= 0) return;
+	int64_t drift = (int64_t)(-(calCount * sxy - sx * sy) / den * 1e9);
+
+	if ((drift > CAL_DRIFT_MAX_PPB) || (drift < -CAL_DRIFT_MAX_PPB)) {
+		if (debug >= 1) Serial.println(F("calNtpSample:: drift out of range, restarted"));
+		calRestart(local, offset);
+		calDriftOk = false;
+		return;
+	}
+	calDrift = drift;
+	calDriftOk = true;
+}
+
+// ----------------------------------------------------------------------------
+// A transmission ended: OPMODE_TX at start, TxDone interrupt at done
+// (micros()), airtime is the calculated time on air.
+// ----------------------------------------------------------------------------
+void calTxSample(uint32_t start, uint32_t done, uint32_t airtime) {
+	int32_t excess = (int32_t)(done - start - airtime);
+	if ((excess > CAL_TX_MAX_US) || (excess < -CAL_TX_MAX_US)) return;
+
+	calTxLastUs = excess;
+	if (calTxCount == 0) calTxAvg = excess;
+	else calTxAvg += (excess - calTxAvg) / CAL_TX_SMOOTH;
+	calTxCount++;
+}
+
+// ----------------------------------------------------------------------------
+// Correction in uSec for a downlink wait uSec ahead: the drift part
+// ----------------------------------------------------------------------------
+int32_t calCorrection(int64_t wait) {
+	if (!calDriftOk) return(0);
+	return((int32_t)(wait * calDrift / 1000000000LL));
+}
+
+// ----------------------------------------------------------------------------
+// How much earlier than tmst OPMODE_TX has to be given
+// ----------------------------------------------------------------------------
+int32_t calTxAdvance() {
+	return(calTxAvg);
+}
+
+int32_t  calDriftPpb()   { return(calDrift); }
+bool     calDriftValid() { return(calDriftOk); }
+int32_t  calTxLatency()  { return(calTxAvg); }
+int32_t  calTxLast()     { return(calTxLastUs); }
+uint32_t calTxSamples()  { return(calTxCount); }
@@ -0,0 +1,30 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway downlink timing calibration
+//
+// Two corrections for the downlink scheduler:
+// - the drift of the micros() crystal, from the NTP offsets over the last polls. A
+//   downlink tmst is a local time, so a wait of 1 or 5 seconds is off by the drift.
+// - the TX start latency: TxDone minus OPMODE_TX minus the calculated time on air.
+//   OPMODE_TX is given this much earlier.
+// Both corrections are signed.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+#define CAL_DRIFT_SAMPLES  16				// NTP samples used for the drift
+#define CAL_DRIFT_MIN_US   600000000LL		// Baseline needed before the drift is used (10 min)
+#define CAL_DRIFT_MAX_PPB  200000			// More than 200 ppm is not a crystal
+#define CAL_STEP_US        50000			// Offset change between two answers that restarts the drift
+#define CAL_TX_SMOOTH      8				// Latency is averaged over about this many TX
+#define CAL_TX_MAX_US      5000				// Larger latency measurements are ignored
+
+// Functions:
+void calNtpSample(uint64_t , int64_t );
+void calTxSample(uint32_t , uint32_t , uint32_t );
+int32_t calCorrection(int64_t );
+int32_t calTxAdvance( void );
+int32_t calDriftPpb( void );
+bool calDriftValid( void );
+int32_t calTxLatency( void );
+int32_t calTxLast( void );
+uint32_t calTxSamples( void );
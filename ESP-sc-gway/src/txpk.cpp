@@ -0,0 +1,294 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Single pass parser of the txpk object in a PULL_RESP (*2, par. 6):
+ * {"txpk":{"imme":false,"tmst":1890991792,"freq":869.525,"rfch":0,"powe":14,
+ *  "modu":"LORA","datr":"SF9BW125","codr":"4/5","ipol":true,"size":18,
+ *  "data":"YCkEAgIABQABGmIwYX/kSn4Y"}}
+ * Only the fields we need are converted, all others are skipped. Numbers are
+ * converted with integer arithmetic (freq 869.525 becomes 869525000 Hz).
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include "txpk.h"
+
+struct TxpkCursor {
+	char *p;
+	char *end;
+};
+
+// ----------------------------------------------------------------------------
+// Helper functions, all return false on a syntax error
+// ----------------------------------------------------------------------------
+static void skipWs(TxpkCursor *c) {
+	while ((c->p < c->end) && ((*c->p == ' ') || (*c->p == '\t') || (*c->p == '\r') || (*c->p == '\n'))) c->p++;
+}
+
+static bool expect(TxpkCursor *c, char ch) {
+	skipWs(c);
+	if ((c->p >= c->end) || (*c->p != ch)) return(false);
+	c->p++;
+	return(true);
+}
+
+// String value or key. s points to the first character, len is the raw length
+// (escapes are not resolved, none of the fields we use has them).
+static bool parseString(TxpkCursor *c, char **s, int *len) {
+	if (!expect(c, '"')) return(false);
+	*s = c->p;
+	while ((c->p < c->end) && (*c->p != '"')) {
+		if (*c->p == '\\') c->p++;					// Skip the escaped character
+		c->p++;
+	}
+	if (c->p >= c->end) return(false);
+	*len = c->p - *s;
+	c->p++;
+	return(true);
+}
+
+// Number, the integer part is returned in v and the first 6 decimals in frac
+// (so 869.525 gives v=869, frac=525000). Exponents are not supported.
+static bool parseNumber(TxpkCursor *c, int32_t *v, uint32_t *frac) {
+	bool neg = false;
+	uint32_t n = 0;
+	uint32_t f = 0;
+	uint32_t scale = 100000;
+
+	skipWs(c);
+	if ((c->p < c->end) && (*c->p == '-')) { neg = true; c->p++; }
+	if ((c->p >= c->end) || (*c->p < '0') || (*c->p > '9')) return(false);
+	while ((c->p < c->end) && (*c->p >= '0') && (*c->p <= '9')) {
+		n = n * 10 + (*c->p++ - '0');
+	}
+	if ((c->p < c->end) && (*c->p == '.')) {
+		c->p++;
+		while ((c->p < c->end) && (*c->p >= '0') && (*c->p <= '9')) {
+			f += (*c->p++ - '0') * scale;
+			scale /= 10;
+		}
+	}
+	*v = neg ? -(int32_t)n : (int32_t)n;
+	if (frac != NULL) *frac = f;
+	return(true);
+}
+
+static bool parseBool(TxpkCursor *c, bool *b) {
+	skipWs(c);
+	if ((c->end - c->p >= 4) && (strncmp(c->p, "true", 4) == 0)) { *b = true; c->p += 4; return(true); }
+	if ((c->end - c->p >= 5) && (strncmp(c->p, "false", 5) == 0)) { *b = false; c->p += 5; return(true); }
+	return(false);
+}
+
+// Skip any value, including nested objects and arrays
+static bool skipValue(TxpkCursor *c) {
+	char *s;
+	int len;
+	int depth = 0;
+
+	skipWs(c);
+	do {
+		if (c->p >= c->end) return(false);
+		switch (*c->p) {
+		case '"':
+			if (!parseString(c, &s, &len)) return(false);
+			break;
+		case '{': case '[':
+			depth++; c->p++;
+			break;
+		case '}': case ']':
+			if (depth == 0) return(false);
+			depth--; c->p++;
+			break;
+		default:
+			c->p++;
+			// Number, true, false, null: up to the next delimiter
+			if (depth == 0) {
+				while ((c->p < c->end) && (*c->p != ',') && (*c->p != '}') && (*c->p != ']')) c->p++;
+			}
+		}
+	} while (depth > 0);
+	return(true);
+}
+
+static bool keyIs(const char *key, int len, const char *name) {
+	return((len == (int)strlen(name)) && (strncmp(key, name, len) == 0));
+}
+
+static int base64Value(char ch) {
+	if ((ch >= 'A') && (ch <= 'Z')) return(ch - 'A');
+	if ((ch >= 'a') && (ch <= 'z')) return(ch - 'a' + 26);
+	if ((ch >= '0') && (ch <= '9')) return(ch - '0' + 52);
+	if (ch == '+') return(62);
+	if (ch == '/') return(63);
+	return(-1);
+}
+
+// Decode len base64 characters at s in place. Padding is optional, but when
+// present it must complete the last group of 4. Returns the number of bytes
+// or -1 for invalid base64. The output is never ahead of the input.
+static int base64InPlace(char *s, int len) {
+	uint8_t *out = (uint8_t *) s;
+	uint32_t acc = 0;
+	int bits = 0;
+	int n = 0;
+	int chars = 0;
+	int pad = 0;
+
+	for (int i=0; i<len; i++) {
+		char ch = s[i];
+		if (ch == '\\') continue;					// "\/" is an escaped '/'
+		if (ch == '=') { pad++; continue; }
+		if (pad > 0) return(-1);					// Data after the padding
+		int v = base64Value(ch);
+		if (v < 0) return(-1);
+		chars++;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out[n++] = (acc >> bits) & 0xFF;
+		}
+	}
+	if ((chars % 4) == 1) return(-1);				// 6 bits left, not a byte
+	if ((pad > 2) || ((pad > 0) && (((chars + pad) % 4) != 0))) return(-1);
+	return(n);
+}
+
+// Digits at s[*i], stops at max so a long number cannot wrap around
+static uint32_t parseDigits(const char *s, int len, int *i, uint32_t max) {
+	uint32_t n = 0;
+	for (; (*i < len) && (s[*i] >= '0') && (s[*i] <= '9'); (*i)++) {
+		if (n <= max) n = n * 10 + (s[*i] - '0');
+	}
+	return(n);
+}
+
+// datr "SF7BW125". A number too large for sf or bw gives 0, not its low bits.
+static void parseDatr(const char *s, int len, Txpk *t) {
+	int i = 2;
+	if ((len < 3) || (s[0] != 'S') || (s[1] != 'F')) return;
+	uint32_t n = parseDigits(s, len, &i, 0xFF);
+	t->sf = (n > 0xFF) ? 0 : n;
+	if ((i + 2 >= len) || (s[i] != 'B') || (s[i+1] != 'W')) return;
+	i += 2;
+	n = parseDigits(s, len, &i, 0xFFFF);
+	t->bw = (n > 0xFFFF) ? 0 : n;
+}
+
+// ----------------------------------------------------------------------------
+// The fields of the txpk object
+// ----------------------------------------------------------------------------
+static int parseTxpk(TxpkCursor *c, Txpk *t) {
+	char *key, *s;
+	int klen, len;
+	int32_t v;
+	uint32_t frac;
+	bool lora = true;
+	char *data = NULL;
+	int dataLen = 0;
+
+	if (!expect(c, '{')) return(TXPK_ERR_SYNTAX);
+	skipWs(c);
+	if ((c->p < c->end) && (*c->p == '}')) {
+		c->p++;
+		return(TXPK_ERR_NODATA);
+	}
+
+	do {
+		if (!parseString(c, &key, &klen) || !expect(c, ':')) return(TXPK_ERR_SYNTAX);
+
+		if (keyIs(key, klen, "tmst")) {
+			if (!parseNumber(c, &v, NULL)) return(TXPK_ERR_SYNTAX);
+			t->tmst = (uint32_t) v;
+		}
+		else if (keyIs(key, klen, "freq")) {
+			if (!parseNumber(c, &v, &frac)) return(TXPK_ERR_SYNTAX);
+			t->freq = (uint32_t) v * 1000000 + frac;
+		}
+		else if (keyIs(key, klen, "powe")) {
+			if (!parseNumber(c, &v, NULL)) return(TXPK_ERR_SYNTAX);
+			t->powe = v;
+		}
+		else if (keyIs(key, klen, "size")) {
+			if (!parseNumber(c, &v, NULL)) return(TXPK_ERR_SYNTAX);
+			t->size = v;
+		}
+		else if (keyIs(key, klen, "imme")) {
+			if (!parseBool(c, &t->imme)) return(TXPK_ERR_SYNTAX);
+		}
+		else if (keyIs(key, klen, "ipol")) {
+			if (!parseBool(c, &t->ipol)) return(TXPK_ERR_SYNTAX);
+		}
+		else if (keyIs(key, klen, "ncrc")) {
+			if (!parseBool(c, &t->ncrc)) return(TXPK_ERR_SYNTAX);
+		}
+		else if (keyIs(key, klen, "datr")) {
+			if (!parseString(c, &s, &len)) {
+				// FSK datr is a number
+				if (!skipValue(c)) return(TXPK_ERR_SYNTAX);
+			}
+			else parseDatr(s, len, t);
+		}
+		else if (keyIs(key, klen, "codr")) {
+			if (!parseString(c, &s, &len)) return(TXPK_ERR_SYNTAX);
+			if ((len == 3) && (s[0] == '4') && (s[1] == '/') && (s[2] >= '5') && (s[2] <= '8')) {
+				t->cr = s[2] - '0';
+			}
+			else t->cr = TXPK_CR_BAD;
+		}
+		else if (keyIs(key, klen, "modu")) {
+			if (!parseString(c, &s, &len)) return(TXPK_ERR_SYNTAX);
+			lora = keyIs(s, len, "LORA");
+		}
+		else if (keyIs(key, klen, "data")) {
+			if (!parseString(c, &data, &dataLen)) return(TXPK_ERR_SYNTAX);
+		}
+		else {
+			if (!skipValue(c)) return(TXPK_ERR_SYNTAX);
+		}
+		skipWs(c);
+	} while ((c->p < c->end) && (*c->p++ == ','));
+
+	if (c->p[-1] != '}') return(TXPK_ERR_SYNTAX);
+	if (!lora) return(TXPK_ERR_MODU);
+	if (data == NULL) return(TXPK_ERR_NODATA);
+
+	// Decode last, the decoded bytes overwrite the base64 text
+	if (dataLen > 344) return(TXPK_ERR_SIZE);		// More than 256 bytes
+	int n = base64InPlace(data, dataLen);
+	if (n < 0) return(TXPK_ERR_BASE64);
+	if (n > 255) return(TXPK_ERR_SIZE);
+	t->data = (uint8_t *) data;
+	t->dataLen = n;
+	return(TXPK_OK);
+}
+
+// ----------------------------------------------------------------------------
+// Parse the PULL_RESP JSON message in buf (len bytes) into t.
+// The buffer is changed: the payload is decoded in place, t->data points to it.
+// Returns TXPK_OK or one of the TXPK_ERR_ values.
+// ----------------------------------------------------------------------------
+int txpkParse(char *buf, int len, Txpk *t) {
+	TxpkCursor c = { buf, buf + len };
+	char *key;
+	int klen;
+
+	memset(t, 0, sizeof(Txpk));
+	t->size = -1;
+
+	if (!expect(&c, '{')) return(TXPK_ERR_SYNTAX);
+	do {
+		if (!parseString(&c, &key, &klen) || !expect(&c, ':')) return(TXPK_ERR_SYNTAX);
+		if (keyIs(key, klen, "txpk")) return(parseTxpk(&c, t));
+		if (!skipValue(&c)) return(TXPK_ERR_SYNTAX);
+		skipWs(&c);
+	} while ((c.p < c.end) && (*c.p++ == ','));
+
+	return(TXPK_ERR_SYNTAX);
+}
@@ -0,0 +1,37 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway txpk parser
+//
+// Parser for the {"txpk":{...}} JSON object of a PULL_RESP message (*2, par. 6).
+// The message is read once from start to end, without heap or a JSON tree. The
+// base64 "data" is decoded in place in the message buffer.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+// Return values of txpkParse()
+#define TXPK_OK           0
+#define TXPK_ERR_SYNTAX  -1				// Not valid JSON, or no txpk object
+#define TXPK_ERR_NODATA  -2				// No "data" field
+#define TXPK_ERR_BASE64  -3				// "data" is not valid base64
+#define TXPK_ERR_SIZE    -4				// Payload larger than 255 bytes
+#define TXPK_ERR_MODU    -5				// Not a LoRa packet (FSK)
+
+#define TXPK_CR_BAD      0xFF			// Txpk.cr of a codr other than "4/5" .. "4/8"
+
+struct Txpk {
+	uint32_t tmst;						// Time to send, micros() of the gateway
+	bool     imme;						// Send immediately, tmst is not used
+	uint32_t freq;						// Hz, 0 when not given
+	uint8_t  sf;						// From datr "SF7BW125", 0 when not given
+	uint16_t bw;						// kHz, from datr
+	uint8_t  cr;						// 5..8 for codr "4/5" .. "4/8", 0 when not given, else TXPK_CR_BAD
+	int8_t   powe;						// dBm
+	bool     ipol;						// Invert polarity (downlinks to nodes)
+	bool     ncrc;						// No CRC
+	int16_t  size;						// Payload size given by the server, -1 when not given
+	uint8_t *data;						// Decoded payload, points into the parsed buffer
+	int      dataLen;
+};
+
+// Functions:
+int txpkParse(char *, int , Txpk * );
@@ -0,0 +1,149 @@
+/*******************************************************************************
+ * Copyright (c) 2016 Maarten Westenberg version for ESP8266
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Upstream server table. A message is serialized once and the same buffer
+ * is written to every enabled server, in priority order.
+ *
+ *******************************************************************************/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "ESP-sc-gway.h"
+#include "upstream.h"
+#include "dnsCache.h"
+
+extern int debug;
+
+// Local ports are _LOCUDPPORT, _LOCUDPPORT+1, ... in the order of the table
+Upstream upstream[UP_MAX] = {
+	{ SERVER1, PORT1, _LOCUDPPORT, true, 0 },
+#ifdef SERVER2
+	{ SERVER2, PORT2, _LOCUDPPORT + 1, true, 1 },
+#endif
+#ifdef SERVER3
+	{ SERVER3, PORT3, _LOCUDPPORT + 2, true, 2 },
+#endif
+};
+int upstreamCount = 0;
+
+int upOrder[UP_MAX];							// Indexes sorted on priority
+
+
+// ----------------------------------------------------------------------------
+// Sort the servers on priority (stable, the table is small)
+// ----------------------------------------------------------------------------
+static void upstreamSort() {
+	for (int i=0; i<upstreamCount; i++) upOrder[i] = i;
+	for (int i=1; i<upstreamCount; i++) {
+		int v = upOrder[i];
+		int j = i - 1;
+		while ((j >= 0) && (upstream[upOrder[j]].priority > upstream[v].priority)) {
+			upOrder[j+1] = upOrder[j];
+			j--;
+		}
+		upOrder[j+1] = v;
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Open a socket per server and add the names to the DNS cache
+// ----------------------------------------------------------------------------
+void upstreamInit() {
+	upstreamCount = 0;
+	while ((upstreamCount < UP_MAX) && (upstream[upstreamCount].host != NULL)) {
+		Upstream *u = &upstream[upstreamCount];
+		u->dns = dnsAdd(u->host);
+		if (u->udp.begin(u->localPort) != 1) {
+			Serial.print(F("upstreamInit:: ERROR opening UDP port "));
+			Serial.println(u->localPort);
+		}
+		else if (debug >= 1) {
+			Serial.print(F("Upstream "));
+			Serial.print(u->host);
+			Serial.print(F(":"));
+			Serial.print(u->port);
+			Serial.print(F(" from port "));
+			Serial.println(u->localPort);
+		}
+		upstreamCount++;
+	}
+	upstreamSort();
+}
+
+// ----------------------------------------------------------------------------
+// Take the addresses from the DNS cache. Called from the main loop.
+// ----------------------------------------------------------------------------
+void upstreamUpdate() {
+	for (int i=0; i<upstreamCount; i++) dnsGet(upstream[i].dns, upstream[i].ip);
+}
+
+// True when every enabled server has an address
+bool upstreamResolved() {
+	upstreamUpdate();
+	for (int i=0; i<upstreamCount; i++) {
+		if (upstream[i].enabled && (upstream[i].ip == IPAddress(0,0,0,0))) return(false);
+	}
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Write msg to server i. Returns true when it was written and endPacket()
+// handed it to lwIP (it fails e.g. without an ARP entry or lwIP buffer); a
+// failure is counted in sendErrors, the caller journals the message.
+// ----------------------------------------------------------------------------
+bool upstreamSend(int i, uint8_t *msg, int length) {
+	Upstream *u = &upstream[i];
+	int l;
+
+	if (u->ip == IPAddress(0,0,0,0)) return(false);		// Not resolved (yet)
+
+	u->udp.beginPacket(u->ip, u->port);
+	if ((l = u->udp.write((char *)msg, length)) != length) {
+		Serial.println(F("sendUdp:: Error write"));
+		u->sendErrors++;
+		yield();
+		u->udp.endPacket();
+		return(false);
+	}
+	yield();
+	if (!u->udp.endPacket()) {
+		Serial.println(F("sendUdp:: Error endPacket"));
+		u->sendErrors++;
+		return(false);
+	}
+	if (debug>=2) {
+		Serial.printf("sendUdp %s: sent %d bytes\r\n", u->host, l);
+	}
+	return(true);
+}
+
+// ----------------------------------------------------------------------------
+// Index of the primary server: the enabled one with the highest priority.
+// Returns -1 when no server is enabled.
+// ----------------------------------------------------------------------------
+int upstreamPrimary() {
+	for (int i=0; i<upstreamCount; i++) {
+		if (upstream[upOrder[i]].enabled) return(upOrder[i]);
+	}
+	return(-1);
+}
+
+// The n-th server in priority order
+int upstreamOrder(int n) {
+	return(upOrder[n]);
+}
+
+// ----------------------------------------------------------------------------
+// Change the enabled flag and priority of server i (web interface)
+// ----------------------------------------------------------------------------
+void upstreamSet(int i, bool enabled, uint8_t priority) {
+	if ((i < 0) || (i >= upstreamCount)) return;
+	upstream[i].enabled = enabled;
+	upstream[i].priority = priority;
+	upstreamSort();
+}
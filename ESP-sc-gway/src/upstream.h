@@ -0,0 +1,38 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway upstream servers
+//
+// Table of the servers the gateway forwards to (SERVER1 .. SERVER3 in ESP-sc-gway.h).
+// Every server has its own UDP socket, PULL_DATA timer and enable/priority setting.
+// The enabled server with the lowest priority value is the primary: messages it did
+// not get are journaled and replayed to it.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define UP_MAX  4						// Max number of upstream servers
+
+struct Upstream {
+	const char *host;
+	uint16_t    port;						// Server port
+	uint16_t    localPort;					// Our port, one socket per server
+	bool        enabled;
+	uint8_t     priority;					// 0 is highest
+	int         dns;						// Entry in dnsCache
+	IPAddress   ip;							// Address from the cache
+	WiFiUDP     udp;
+	uint32_t    pulltime;					// Last PULL_DATA, seconds
+	uint32_t    sendErrors;
+};
+
+extern Upstream upstream[UP_MAX];
+extern int upstreamCount;
+
+// Functions:
+void upstreamInit( void );
+void upstreamUpdate( void );
+bool upstreamResolved( void );
+bool upstreamSend(int , uint8_t *, int );
+int upstreamPrimary( void );
+int upstreamOrder(int );
+void upstreamSet(int , bool , uint8_t );
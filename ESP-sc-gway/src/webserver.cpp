@@ -2,6 +2,19 @@
 #include <ESP8266WebServer.h>
 #include <TimeLib.h>
 #include "loraModem.h"
+#include "ackTrack.h"
+#include "journal.h"
+#include "dnsCache.h"
+#include "upstream.h"
+#include "dedup.h"
+#include "lwFilter.h"
+#include "gwStats.h"
+#include "ntpClient.h"
+#include "timeCal.h"
+#include "sched.h"
+#include "prof.h"
+#include "OLEDDisplay.h"
+#include "RGBLed.h"
 #include "ESP-sc-gway.h"
 
 // ================================================================================
@@ -9,6 +22,19 @@
 
 int webDebug = 0 ;
 
+// PUSH_DATA batching statistics, see application.cpp
+extern uint32_t batchSent;
+extern uint32_t batchFrames;
+extern uint32_t batchLatency;
+extern uint32_t batchLatencyMax;
+
+// WiFi connection statistics, see process_WiFi() in application.cpp
+extern uint32_t wifiReconnects;
+extern uint32_t wifiReconnectLast;
+extern uint32_t wifiReconnectMax;
+extern uint32_t wifiDowntime;
+extern uint32_t wifiAttempts;
+
 // You can switch webserver off if not necessary
 // Probably better to leave it in though.
 ESP8266WebServer server(SERVERPORT);
@@ -59,14 +85,26 @@ String stringTime(unsigned long t) {
 }
 
 
+// ----------------------------------------------------------------------------
+// Send what is in response as the next part of the page and empty it, once
+// it holds at least min bytes. Only one piece of the page is in RAM at a time.
+// ----------------------------------------------------------------------------
+static void webFlush(String &response, unsigned int min) {
+	if (response.length() < min) return;
+	server.sendContent(response);
+	response = "";
+}
+
 // ----------------------------------------------------------------------------
 // WIFI SERVER
 //
 // This funtion implements the WiFI Webserver (very simple one). The purpose
 // of this server is to receive simple admin commands, and execute these
 // results are sent back to the web client.
-// Commands: DEBUG, ADDRESS, IP, CONFIG, GETTIME, SETTIME
-// The webpage is completely built response and then printed on screen.
+// Commands: DEBUG, ADDRESS, IP, CONFIG, GETTIME, SETTIME, UPSTREAM, FILTER
+// The webpage is sent with chunked transfer encoding, a table at a time (and
+// in pieces of about WEB_CHUNK bytes for the long ones), so the whole page is
+// never held in one String.
 // ----------------------------------------------------------------------------
 void WifiServer(const char *cmd, const char *arg) {
 
@@ -93,12 +131,53 @@ void WifiServer(const char *cmd, const char *arg) {
 	if (strcmp(cmd, "GETTIME")==0) { response += "gettime tbd"; }	// Get the local time
 	if (strcmp(cmd, "SETTIME")==0) { response += "settime tbd"; }	// Set the local time
 	if (strcmp(cmd, "HELP")==0)    { response += "Display Help Topics"; }
+	if (strcmp(cmd, "UPSTREAM")==0) {								// Enable/disable a server, set priority
+		int n = atoi(server.arg("n").c_str());
+		bool on = (atoi(server.arg("on").c_str()) != 0);
+		uint8_t prio = atoi(server.arg("prio").c_str());
+		upstreamSet(n, on, prio);
+		response += " upstream "; response += n;
+		response += (on ? " enabled" : " disabled");
+		response += ", priority "; response += prio;
+	}
+	if (strcmp(cmd, "FILTER")==0) {								// LoRaWAN DevAddr prefix rules
+		if (server.hasArg("add")) {								// add=26000000&bits=7&allow=1
+			uint32_t prefix = strtoul(server.arg("add").c_str(), NULL, 16);
+			uint8_t bits = atoi(server.arg("bits").c_str());
+			bool allow = (atoi(server.arg("allow").c_str()) != 0);
+			if (lwFilterAdd(prefix, bits, allow) < 0) response += " filter table full";
+			else {
+				response += " filter "; response += String(prefix, HEX);
+				response += "/"; response += bits;
+				response += (allow ? " allow" : " deny");
+			}
+		}
+		if (server.hasArg("del")) {								// del=<rule number>
+			lwFilterDel(atoi(server.arg("del").c_str()));
+			response += " filter rule removed";
+		}
+		if (server.hasArg("default")) {							// default=0 drops unknown DevAddr
+			lwDefaultAllow = (atoi(server.arg("default").c_str()) != 0);
+			response += " filter default "; response += (lwDefaultAllow ? "allow" : "deny");
+		}
+	}
 	if (strcmp(cmd, "RESET")==0)   { response += "Resetting Statistics";
   		resetLoraStats();
+  		ackResetStats();
+  		dedupResetStats();
+  		lwFilterResetStats();
+  		statReset();
+  		schedResetStats();
+#if _PROFILE==1
+  		profReset();
+#endif
 	}
 
 	// Do work, fill the webpage
 	delay(15);
+	response.reserve(WEB_CHUNK + 512);
+	server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+	server.send(200, "text/html", "");
 	response +="<!DOCTYPE HTML>";
 	response +="<HTML><HEAD>";
 	response +="<TITLE>ESP8266 1ch Gateway</TITLE>";
@@ -120,9 +199,19 @@ void WifiServer(const char *cmd, const char *arg) {
 	response +="<tr><td style=\"border: 1px solid black;\">IP Address</td><td style=\"border: 1px solid black;\">"; response+=printIP((IPAddress)WiFi.localIP()); response+="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">IP Gateway</td><td style=\"border: 1px solid black;\">"; response+=printIP((IPAddress)WiFi.gatewayIP()); response+="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">NTP Server</td><td style=\"border: 1px solid black;\">"; response+=NTP_TIMESERVER; response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">NTP Polls / Failed</td><td style=\"border: 1px solid black;\">"; response+=ntpPolls(); response+=" / "; response+=ntpFailures(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">NTP Delay / Correction (uSec)</td><td style=\"border: 1px solid black;\">"; response+=ntpDelay(); response+=" / "; response+=ntpCorrection(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">NTP Synced (s ago)</td><td style=\"border: 1px solid black;\">";
+	if (ntpSynced()) response+=ntpAge(); else response+="no";
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Clock Drift (ppb)</td><td style=\"border: 1px solid black;\">";
+	if (calDriftValid()) response+=calDriftPpb(); else response+="measuring";
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">TX Latency Last / Avg (uSec)</td><td style=\"border: 1px solid black;\">"; response+=calTxLast(); response+=" / "; response+=calTxLatency(); response+=" ("; response+=calTxSamples(); response+=" TX)</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">LoRa Router</td><td style=\"border: 1px solid black;\">"; response+=_TTNSERVER; response+="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">LoRa Router IP</td><td style=\"border: 1px solid black;\">"; response+=printIP((IPAddress)TTNServer); response+="</tr>";
 	response +="</table>";
+	webFlush(response, 0);
 
 	response +="<h2>System Status</h2>";
 	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
@@ -133,6 +222,7 @@ void WifiServer(const char *cmd, const char *arg) {
 	response +="<tr><td style=\"border: 1px solid black;\">Free heap</td><td style=\"border: 1px solid black;\">"; response+=ESP.getFreeHeap(); response+="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">ESP Chip ID</td><td style=\"border: 1px solid black;\">"; response+=ESP.getChipId(); response+="</tr>";
 	response +="</table>";
+	webFlush(response, 0);
 
 	response +="<h2>LoRa Status</h2>";
 	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
@@ -141,7 +231,9 @@ void WifiServer(const char *cmd, const char *arg) {
 	response +="<th style=\"background-color: green; color: white;\">Value</th>";
 	response +="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">Frequency</td><td style=\"border: 1px solid black;\">"; response+=LORA_freq; response+="</tr>";
-	response +="<tr><td style=\"border: 1px solid black;\">Spreading Factor</td><td style=\"border: 1px solid black;\">"; response+=getLoraSF(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Spreading Factor</td><td style=\"border: 1px solid black;\">";
+	if (getLoraCad()) response+="SF7-SF12 (CAD)"; else response+=getLoraSF();
+	response+="</tr>";
 	response +="<tr><td style=\"border: 1px solid black;\">Gateway ID</td><td style=\"border: 1px solid black;\">";
 	response +=String(GWMAC_address[0],HEX);									// The MAC array is always returned in lowercase
 	response +=String(GWMAC_address[1],HEX);
@@ -152,20 +244,245 @@ void WifiServer(const char *cmd, const char *arg) {
 	response +=String(GWMAC_address[5],HEX);
 	response+="</tr>";
 	response +="</table>";
+	webFlush(response, 0);
 
-	response +="<h2>Statistics</h2>";
+	response +="<h2>Traffic</h2>";
 	delay(1);
 	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
 	response +="<tr>";
 	response +="<th style=\"background-color: green; color: white;\">Counter</th>";
+	response +="<th style=\"background-color: green; color: white;\">Last Stat</th>";
+	response +="<th style=\"background-color: green; color: white;\">1 Hour</th>";
+	response +="<th style=\"background-color: green; color: white;\">24 Hours</th>";
+	response +="<th style=\"background-color: green; color: white;\">Total</th>";
+	response +="</tr>";
+	for (int i=0; i<ST_COUNT; i++) {
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=statName(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=statLastInterval(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=statHour(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=statDay(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=statTotal(i);
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="</table>";
+	webFlush(response, 0);
+
+	response +="<h2>Tasks</h2>";
+	delay(1);
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">Task</th>";
+	response +="<th style=\"background-color: green; color: white;\">Prio</th>";
+	response +="<th style=\"background-color: green; color: white;\">Runs</th>";
+	response +="<th style=\"background-color: green; color: white;\">Avg / Max (uSec)</th>";
+	response +="<th style=\"background-color: green; color: white;\">Budget</th>";
+	response +="<th style=\"background-color: green; color: white;\">Overruns</th>";
+	response +="<th style=\"background-color: green; color: white;\">Deferred</th>";
+	response +="</tr>";
+	for (int i=0; i<schedCount(); i++) {
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=schedName(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedPrio(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedRuns(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedAvgUs(i); response +=" / "; response +=schedMaxUs(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedBudget(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedOverruns(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=schedDeferred(i);
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="<tr><td style=\"border: 1px solid black;\">Radio gap max (uSec)</td><td colspan=\"6\" style=\"border: 1px solid black;\">"; response +=schedRadioGap(); response +="</td></tr>";
+	response +="</table>";
+	webFlush(response, 0);
+
+#if _PROFILE==1
+	response +="<h2>Profile (uSec)</h2>";
+	delay(1);
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">Stage</th>";
+	response +="<th style=\"background-color: green; color: white;\">Count</th>";
+	response +="<th style=\"background-color: green; color: white;\">Min</th>";
+	response +="<th style=\"background-color: green; color: white;\">Avg</th>";
+	response +="<th style=\"background-color: green; color: white;\">p99</th>";
+	response +="<th style=\"background-color: green; color: white;\">Max</th>";
+	response +="</tr>";
+	for (int i=0; i<PROF_COUNT; i++) {
+		if (profCount(i) == 0) continue;
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=profName(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=profCount(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=profMinUs(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=profAvgUs(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=profPctUs(i, 99);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=profMaxUs(i);
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="</table>";
+	webFlush(response, 0);
+#endif
+
+	response +="<h2>Statistics</h2>";
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">Counter</th>";
 	response +="<th style=\"background-color: green; color: white;\">Value</th>";
 	response +="</tr>";
-	response +="<tr><td style=\"border: 1px solid black;\">Packages Received</td><td style=\"border: 1px solid black;\">"; response +=getLoraRXRCV(); response+="</tr>";
-	response +="<tr><td style=\"border: 1px solid black;\">Packages OK </td><td style=\"border: 1px solid black;\">"; response +=getLoraRXOK(); response+="</tr>";
-	response +="<tr><td style=\"border: 1px solid black;\">Packages Forwarded</td><td style=\"border: 1px solid black;\">"; response +=getLoraPKTFWD(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Duplicates Dropped / Unique</td><td style=\"border: 1px solid black;\">"; response +=dedupHits(); response +=" / "; response +=dedupMisses(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">LED Events Merged</td><td style=\"border: 1px solid black;\">"; response +=LedRGBCoalesced(); response+="</tr>";
+#ifdef OLED_DISPLAY
+	response +="<tr><td style=\"border: 1px solid black;\">OLED Frames</td><td style=\"border: 1px solid black;\">"; response +=OLEDDisplay_Frames(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">OLED I2C bytes/s full / sent</td><td style=\"border: 1px solid black;\">"; response +=OLEDDisplay_RateFull(); response +=" / "; response +=OLEDDisplay_RateSent(); response+="</tr>";
+#endif
+	response +="<tr><td style=\"border: 1px solid black;\">Downlinks Queued</td><td style=\"border: 1px solid black;\">"; response +=getLoraTXQUEUE(); response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">PUSH_DATA Batches</td><td style=\"border: 1px solid black;\">"; response +=batchSent; response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Batch Fill %</td><td style=\"border: 1px solid black;\">";
+	if (batchSent > 0) response +=(batchFrames * 100 / (batchSent * _BATCH_MAX)); else response +="-";
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Batch Latency avg/max (ms)</td><td style=\"border: 1px solid black;\">";
+	if (batchSent > 0) response +=(batchLatency / batchSent); else response +="-";
+	response +=" / "; response +=batchLatencyMax;
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">WiFi Reconnects / Attempts</td><td style=\"border: 1px solid black;\">";
+	response +=wifiReconnects; response +=" / "; response +=wifiAttempts;
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">WiFi Reconnect last/max (ms)</td><td style=\"border: 1px solid black;\">";
+	response +=wifiReconnectLast; response +=" / "; response +=wifiReconnectMax;
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">WiFi Downtime (s)</td><td style=\"border: 1px solid black;\">";
+	response +=(wifiDowntime / 1000);
+	response+="</tr>";
+#if _JOURNAL==1
+	response +="<tr><td style=\"border: 1px solid black;\">Journal Depth (msgs / bytes)</td><td style=\"border: 1px solid black;\">";
+	response +=journalDepth(); response +=" / "; response +=journalBytes();
+	response+="</tr>";
+	response +="<tr><td style=\"border: 1px solid black;\">Journal Stored / Replayed / Dropped</td><td style=\"border: 1px solid black;\">";
+	response +=journalWritten(); response +=" / "; response +=journalReplayed();
+	response +=" / "; response +=journalDropped();
+	response+="</tr>";
+#endif
 	response +="<tr><td>&nbsp</td><td> </tr>";
 
 	response +="</table>";
+	webFlush(response, 0);
+
+	response +="<h2>Spreading Factors</h2>";
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">SF</th>";
+	response +="<th style=\"background-color: green; color: white;\">CAD Detected</th>";
+	response +="<th style=\"background-color: green; color: white;\">Received</th>";
+	response +="<th style=\"background-color: green; color: white;\">Hit Rate %</th>";
+	response +="</tr>";
+	for (int i=SF7; i<=SF12; i++) {
+		response +="<tr><td style=\"border: 1px solid black;\">SF"; response +=i;
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=getLoraCADDET(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=getLoraRXSF(i);
+		response +="</td><td style=\"border: 1px solid black;\">";
+		if (getLoraCADDET(i) > 0) response +=(getLoraRXSF(i) * 100 / getLoraCADDET(i)); else response +="-";
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="</table>";
+	webFlush(response, 0);
+
+	response +="<h2>Servers</h2>";
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">Server</th>";
+	response +="<th style=\"background-color: green; color: white;\">Local Port</th>";
+	response +="<th style=\"background-color: green; color: white;\">Enabled</th>";
+	response +="<th style=\"background-color: green; color: white;\">Priority</th>";
+	response +="<th style=\"background-color: green; color: white;\">Write Errors</th>";
+	response +="<th style=\"background-color: green; color: white;\">PUSH Acked/Sent</th>";
+	response +="<th style=\"background-color: green; color: white;\">PULL Acked/Sent</th>";
+	response +="<th style=\"background-color: green; color: white;\">Lost</th>";
+	response +="<th style=\"background-color: green; color: white;\">Resent</th>";
+	response +="<th style=\"background-color: green; color: white;\">RTT p50/p90/p99 (ms)</th>";
+	response +="</tr>";
+	for (int i=0; i<upstreamCount; i++) {
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=upstream[i].host;
+		response +=":"; response +=upstream[i].port;
+		if (i == upstreamPrimary()) response +=" (primary)";
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=upstream[i].localPort;
+		response +="</td><td style=\"border: 1px solid black;\">";
+		response +=(upstream[i].enabled ? "yes" : "no");
+		response +=" <a href=\"/UPSTREAM?n="; response +=i;
+		response +="&on="; response +=(upstream[i].enabled ? 0 : 1);
+		response +="&prio="; response +=upstream[i].priority;
+		response +="\">"; response +=(upstream[i].enabled ? "disable" : "enable"); response +="</a>";
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=upstream[i].priority;
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=upstream[i].sendErrors;
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=ackPushAcked(i);
+		response +=" / "; response +=ackPushSent(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=ackPullAcked(i);
+		response +=" / "; response +=ackPullSent(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=ackLost(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=ackRetried(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=ackRttPercentile(i, 50);
+		response +=" / "; response +=ackRttPercentile(i, 90);
+		response +=" / "; response +=ackRttPercentile(i, 99);
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="</table>";
+	webFlush(response, 0);
+	response +="Unmatched ACKs: "; response +=ackUnknown();
+
+	response +="<h2>DNS Cache</h2>";
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">Host</th>";
+	response +="<th style=\"background-color: green; color: white;\">Address</th>";
+	response +="<th style=\"background-color: green; color: white;\">Lookups / Failed / Changed</th>";
+	response +="<th style=\"background-color: green; color: white;\">Latency last/max (ms)</th>";
+	response +="<th style=\"background-color: green; color: white;\">Age (s)</th>";
+	response +="</tr>";
+	for (int i=0; i<DNS_ENTRIES; i++) {
+		IPAddress ip;
+		if (dnsLookups(i) == 0 && !dnsGet(i, ip)) continue;
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=dnsHost(i);
+		response +="</td><td style=\"border: 1px solid black;\">";
+		if (dnsGet(i, ip)) response +=printIP(ip); else response +="-";
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=dnsLookups(i);
+		response +=" / "; response +=dnsFailures(i);
+		response +=" / "; response +=dnsChanges(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=dnsLatencyLast(i);
+		response +=" / "; response +=dnsLatencyMax(i);
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=dnsAge(i);
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="</table>";
+	webFlush(response, 0);
+
+	response +="<h2>LoRaWAN Filter</h2>";
+	response +="<table style=\"max_width: 100%; min-width: 40%; border: 1px solid black; border-collapse: collapse;\" class=\"config_table\">";
+	response +="<tr>";
+	response +="<th style=\"background-color: green; color: white;\">DevAddr Prefix</th>";
+	response +="<th style=\"background-color: green; color: white;\">Action</th>";
+	response +="<th style=\"background-color: green; color: white;\">Hits</th>";
+	response +="</tr>";
+	for (int i=0; i<lwRuleCount; i++) {
+		response +="<tr><td style=\"border: 1px solid black;\">"; response +=String(lwRules[i].prefix, HEX);
+		response +="/"; response +=lwRules[i].bits;
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=(lwRules[i].allow ? "allow" : "deny");
+		response +=" <a href=\"/FILTER?del="; response +=i; response +="\">remove</a>";
+		response +="</td><td style=\"border: 1px solid black;\">"; response +=lwRules[i].hits;
+		response +="</td></tr>";
+		webFlush(response, WEB_CHUNK);
+	}
+	response +="<tr><td style=\"border: 1px solid black;\">default";
+	response +="</td><td style=\"border: 1px solid black;\">"; response +=(lwDefaultAllow ? "allow" : "deny");
+	response +=" <a href=\"/FILTER?default="; response +=(lwDefaultAllow ? 0 : 1);
+	response +="\">"; response +=(lwDefaultAllow ? "deny" : "allow"); response +="</a>";
+	response +="</td><td style=\"border: 1px solid black;\">"; response +=lwDefaultHits();
+	response +="</td></tr>";
+	response +="</table>";
+	webFlush(response, 0);
+	response +="Dropped: "; response +=lwDroppedFrames();
+	response +=", Join/other (not checked): "; response +=lwOtherFrames();
+	response +="<br>Add a rule with /FILTER?add=26000000&bits=7&allow=1";
 
 	response +="<br>";
 	response +="<h2>Settings</h2>";
@@ -181,7 +498,8 @@ void WifiServer(const char *cmd, const char *arg) {
 	response +="Click <a href=\"/HELP\">here</a> to explain Help and REST options<br>";
 	response +="</BODY></HTML>";
 
-	server.send(200, "text/html", response);
+	webFlush(response, 0);
+	server.sendContent("");								// last, empty chunk
 
 	delay(5);
 	free(dup);									// free the memory used, before jumping to other page
@@ -195,6 +513,8 @@ void startWebServer(IPAddress _ttnServer, uint8_t _MAC_address[]) {
   server.on("/DEBUG=0", []() { WifiServer("DEBUG","0");	});
   server.on("/DEBUG=1", []() { WifiServer("DEBUG","1");	});
   server.on("/DEBUG=2", []() { WifiServer("DEBUG","2");	});
+  server.on("/UPSTREAM",[]() { WifiServer("UPSTREAM","");	});
+  server.on("/FILTER",  []() { WifiServer("FILTER","");	});
 
   server.begin();											// Start the webserver
   Serial.print(F("Admin Server started on port "));
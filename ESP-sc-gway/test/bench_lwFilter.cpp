@@ -0,0 +1,79 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host benchmark: LoRaWAN uplink filter lookup
+//
+// Time of lwFilterPass() per frame with 0 to LWF_RULES rules, for a DevAddr that
+// matches the first rule (best case) and one that matches no rule (every rule is
+// tried, worst case). Host nanoseconds, the ratio between the rows is what carries
+// over to the ESP8266. Also checks that the longest prefix wins whatever the order
+// the rules were added in.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <time.h>
+#include "lwFilter.h"
+
+#define ROUNDS  2000000
+
+static double nowSec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// Unconfirmed uplink from devAddr
+static void makeFrame(uint8_t *f, uint32_t devAddr) {
+	memset(f, 0, 23);
+	f[0] = 0x40;
+	f[1] = devAddr & 0xFF; f[2] = (devAddr >> 8) & 0xFF;
+	f[3] = (devAddr >> 16) & 0xFF; f[4] = devAddr >> 24;
+}
+
+static double nsPerFrame(uint8_t *f) {
+	uint32_t pass = 0;
+	double t0 = nowSec();
+	for (int r = 0; r < ROUNDS; r++) {
+		f[6] = r & 0xFF;										// FCnt, as the radio would
+		pass += lwFilterPass(f, 23);
+	}
+	double t1 = nowSec();
+	if (pass == 1) printf(" ");								// keep the result alive
+	return((t1 - t0) * 1e9 / ROUNDS);
+}
+
+int main() {
+	const int counts[] = { 0, 1, 4, 8, LWF_RULES };
+	uint8_t first[23], none[23], join[23];
+
+	makeFrame(none, 0x01020304);								// in no rule below
+	memset(join, 0, sizeof(join));								// join request, never looked up
+
+	printf("bench_lwFilter: lwFilterPass() per frame, %d frames per row\n", ROUNDS);
+	printf("%6s %14s %14s %14s\n", "rules", "first ns", "no match ns", "join ns");
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		lwRuleCount = 0;
+		// Shortest first, the table sorts them: the /32 rule ends up on top
+		for (int i = 0; i < counts[c]; i++) {
+			lwFilterAdd(0x26000000UL | ((uint32_t) i << 8), 24 + i % 9, true);
+		}
+		if (counts[c] > 0) makeFrame(first, lwRules[0].prefix);
+		else makeFrame(first, 0x26000000UL);
+
+		double tFirst = nsPerFrame(first);
+		double tNone = nsPerFrame(none);
+		double tJoin = nsPerFrame(join);
+		printf("%6d %14.1f %14.1f %14.1f\n", lwRuleCount, tFirst, tNone, tJoin);
+	}
+
+	// Longest prefix wins: TTN NetID allowed, one /32 in it dropped
+	lwRuleCount = 0;
+	lwFilterAdd(0x26012345UL, 32, false);
+	lwFilterAdd(0x26000000UL, 7, true);
+	lwDefaultAllow = false;
+	makeFrame(first, 0x26012345UL);
+	makeFrame(none, 0x26012346UL);
+	if (lwFilterPass(first, 23) || !lwFilterPass(none, 23)) {
+		printf("bench_lwFilter: longest prefix match FAILED\n");
+		return(1);
+	}
+	return(0);
+}
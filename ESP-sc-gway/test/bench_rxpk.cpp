@@ -0,0 +1,146 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host benchmark: rxpk serializer
+//
+// Compares receivePacket() with the serializer it replaced (kept below as
+// oldSerialize: payload base64 encoded twice, frequency through ftoa(), snprintf for
+// the numbers). Reports packets per second of host CPU and the bytes each version
+// writes per packet; the ratio is what carries over to the ESP8266.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <SPI.h>
+#include <time.h>
+#include "Base64.h"
+#include "aux.h"
+#include "loraModem.h"
+
+#define DIO0_PIN   15
+#define ROUNDS     20000
+#define BATCH      (RX_RING_SIZE - 1)
+
+struct OldPkt {
+	uint64_t tmst;
+	long     snr;
+	int      prssi;
+	uint8_t  sf;
+	uint8_t  size;
+	uint8_t  payload[256];
+};
+
+static char b64[341];
+static uint32_t oldCopied = 0;
+
+// receivePacket() before the single pass serializer, without the debug output
+static int oldSerialize(OldPkt *pkt, uint8_t *buff_up, int size) {
+	char cfreq[12] = {0};
+	int j;
+
+	base64_encode(b64, (char *) pkt->payload, pkt->size);
+	oldCopied += base64_enc_len(pkt->size);
+
+	int buff_index = 0;
+	buff_up[buff_index++] = '{';
+	j = snprintf((char *)(buff_up + buff_index), size - buff_index, "\"tmst\":%u", (uint32_t) pkt->tmst);
+	buff_index += j;
+	ftoa((double)LORA_freq/1000000, cfreq, 6);
+	oldCopied += strlen(cfreq);
+	j = snprintf((char *)(buff_up + buff_index), size-buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%s", 0, 0, cfreq);
+	buff_index += j;
+	memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
+	buff_index += 9;
+	memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
+	buff_index += 14;
+	switch (pkt->sf) {
+	case SF7:  memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12); buff_index += 12; break;
+	case SF8:  memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12); buff_index += 12; break;
+	case SF9:  memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12); buff_index += 12; break;
+	case SF10: memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13); buff_index += 13; break;
+	case SF11: memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13); buff_index += 13; break;
+	default:   memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13); buff_index += 13; break;
+	}
+	memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
+	buff_index += 6;
+	memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
+	buff_index += 13;
+	j = snprintf((char *)(buff_up + buff_index), size-buff_index, ",\"lsnr\":%li", pkt->snr);
+	buff_index += j;
+	j = snprintf((char *)(buff_up + buff_index), size-buff_index, ",\"rssi\":%d,\"size\":%u", pkt->prssi, pkt->size);
+	buff_index += j;
+	memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
+	buff_index += 9;
+	j = base64_encode((char *)(buff_up + buff_index), (char *) pkt->payload, pkt->size);
+	buff_index += j;
+	buff_up[buff_index++] = '"';
+	buff_up[buff_index++] = '}';
+	buff_up[buff_index] = 0;
+
+	oldCopied += buff_index + 1;
+	return(buff_index);
+}
+
+static double nowSec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// Unconfirmed uplink, the FCnt makes every frame different for the dedup cache
+static void makeFrame(uint8_t *f, uint8_t len, uint32_t n) {
+	f[0] = 0x40;
+	f[1] = 0x01; f[2] = 0x02; f[3] = 0x00; f[4] = 0x26;
+	f[5] = 0x00;
+	f[6] = n & 0xFF; f[7] = (n >> 8) & 0xFF;
+	for (int i = 8; i < len; i++) f[i] = (uint8_t)(i * 37 + n);
+}
+
+int main() {
+	const uint8_t sizes[] = { 23, 51, 222 };
+	static uint8_t buf[1024];
+	static uint8_t frame[256];
+	UpTrace trace;
+	uint32_t n = 0;
+
+	hostSpiReset();
+	hostDio0 = DIO0_PIN;
+	hostReg[REG_VERSION] = 0x12;
+	setLoraModem(16, DIO0_PIN, NOT_A_PIN, NOT_A_PIN, NOT_A_PIN, SF9, false);
+	initLoraModem();
+
+	printf("bench_rxpk: rxpk serializer, %d packets per size\n", ROUNDS * BATCH);
+	printf("%6s %14s %12s %14s %12s %8s\n", "bytes", "before pkt/s", "before B/pkt", "after pkt/s", "after B/pkt", "speedup");
+	for (unsigned int s = 0; s < sizeof(sizes); s++) {
+		uint8_t len = sizes[s];
+		double tOld = 0, tNew = 0;
+		uint32_t newCopied = 0;
+		OldPkt old[BATCH];
+
+		oldCopied = 0;
+		for (int r = 0; r < ROUNDS; r++) {
+			// Fill the RX ring through the FIFO path, serialize outside of the timing
+			for (int b = 0; b < BATCH; b++) {
+				makeFrame(frame, len, n++);
+				hostRxFrame(frame, len);
+				pollLoraModem();
+				old[b].tmst = micros64();
+				old[b].snr = 7;
+				old[b].prssi = -80;
+				old[b].sf = SF9;
+				old[b].size = len;
+				memcpy(old[b].payload, frame, len);
+			}
+
+			double t0 = nowSec();
+			for (int b = 0; b < BATCH; b++) oldSerialize(&old[b], buf, sizeof(buf));
+			double t1 = nowSec();
+			for (int b = 0; b < BATCH; b++) newCopied += receivePacket(buf, sizeof(buf), &trace) + 1;
+			double t2 = nowSec();
+			tOld += t1 - t0;
+			tNew += t2 - t1;
+		}
+
+		double pkts = (double) ROUNDS * BATCH;
+		printf("%6u %14.0f %12.0f %14.0f %12.0f %7.2fx\n", len,
+			pkts / tOld, oldCopied / pkts, pkts / tNew, newCopied / pkts, tOld / tNew);
+	}
+	return(0);
+}
@@ -0,0 +1,58 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host benchmark: SPI bus time per packet
+//
+// Compares the FIFO and signal register access of one uplink and one downlink with
+// a transaction per byte (as before the burst functions) and with readBuffer()/
+// writeBuffer(). Bus time is computed from the counted transactions and bytes,
+// see host/SPI.h.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <SPI.h>
+#include "loraModem.h"
+
+byte readRegister(byte );
+void writeRegister(byte , byte );
+void readBuffer(byte , uint8_t *, uint8_t );
+void writeBuffer(byte , uint8_t *, uint8_t );
+
+#define REG_FIFO 0x00
+
+static uint8_t buf[256];
+
+static void perByte(int len) {
+	for (int i = 0; i < len; i++) buf[i] = readRegister(REG_FIFO);			// RX drain
+	readRegister(REG_PKT_SNR_VALUE);
+	readRegister(REG_PKT_RSSI);
+	readRegister(REG_RSSI);
+	for (int i = 0; i < len; i++) writeRegister(REG_FIFO, buf[i]);			// TX fill
+}
+
+static void burst(int len) {
+	uint8_t sigRegs[REG_RSSI - REG_PKT_SNR_VALUE + 1];
+	readBuffer(REG_FIFO, buf, len);
+	readBuffer(REG_PKT_SNR_VALUE, sigRegs, sizeof(sigRegs));
+	writeBuffer(REG_FIFO, buf, len);
+}
+
+int main() {
+	const int sizes[] = { 16, 64, 255 };
+
+	printf("bench_spi: bus time of one RX drain + signal regs + TX fill, %d Hz\n", HOST_SPI_HZ);
+	printf("%6s %12s %10s %12s %10s %8s\n", "bytes", "before txns", "before us", "after txns", "after us", "speedup");
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int len = sizes[s];
+
+		hostSpiReset();
+		perByte(len);
+		uint32_t beforeTxns = hostSpiTxns, beforeUs = hostSpiUs();
+
+		hostSpiReset();
+		burst(len);
+		uint32_t afterTxns = hostSpiTxns, afterUs = hostSpiUs();
+
+		printf("%6d %12u %10u %12u %10u %7.2fx\n", len, beforeTxns, beforeUs, afterTxns, afterUs,
+			(double) beforeUs / afterUs);
+	}
+	return(0);
+}
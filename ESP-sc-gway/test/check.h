@@ -0,0 +1,28 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host tests: minimal assertions
+//
+// CHECK() prints the failing expression and counts it, the test goes on.
+// CHECK_EQ() also prints both values. A test program returns checkResult().
+//
+// ----------------------------------------------------------------------------------------
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int checkFailed = 0;
+static int checkCount = 0;
+
+#define CHECK(c) do { checkCount++; if (!(c)) { checkFailed++; \
+	printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); } } while (0)
+
+#define CHECK_EQ(a, b) do { checkCount++; long long va_ = (long long)(a), vb_ = (long long)(b); \
+	if (va_ != vb_) { checkFailed++; \
+	printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, va_, vb_); } } while (0)
+
+static inline int checkResult(const char *name) {
+	printf("%s: %d checks, %d failed\n", name, checkCount, checkFailed);
+	return(checkFailed ? 1 : 0);
+}
+
+#endif
@@ -0,0 +1,60 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs, see Arduino.h
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <stdarg.h>
+
+uint64_t hostClock = 0;
+bool     hostVerbose = false;
+int      hostPin[32];
+uint32_t hostMicrosStep = 0;
+
+HardwareSerial Serial;
+EspClass ESP;
+
+void hostAdvance(uint64_t us) { hostClock += us; }
+
+unsigned long micros() { hostClock += hostMicrosStep; return((uint32_t) hostClock); }
+unsigned long millis() { return((uint32_t)(hostClock / 1000)); }
+void delay(unsigned long ms) { hostClock += (uint64_t) ms * 1000; }
+void delayMicroseconds(unsigned int us) { hostClock += us; }
+void yield() { hostClock += 1; }
+
+int digitalRead(int pin) { return(((pin >= 0) && (pin < 32)) ? hostPin[pin] : LOW); }
+void digitalWrite(int pin, int v) { if ((pin >= 0) && (pin < 32)) hostPin[pin] = v; }
+void pinMode(int , int ) {}
+int digitalPinToInterrupt(int pin) { return(pin); }
+void attachInterrupt(int , void (*)(void), int ) {}
+void detachInterrupt(int ) {}
+void noInterrupts() {}
+void interrupts() {}
+
+char *itoa(int v, char *buf, int base) {
+	sprintf(buf, base == 16 ? "%x" : "%d", v);
+	return(buf);
+}
+
+long random(long max) { return(max > 0 ? rand() % max : 0); }
+long random(long min, long max) { return(min + random(max - min)); }
+
+String IPAddress::toString() const {
+	char b[16];
+	sprintf(b, "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+	return(String(b));
+}
+
+size_t Print::write(const uint8_t *, size_t len) { return(len); }
+
+size_t Print::printf(const char *fmt, ...) {
+	char b[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(b, sizeof(b), fmt, ap);
+	va_end(ap);
+	return(print(b) ? n : 0);
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len) {
+	if (hostVerbose) fwrite(buf, 1, len, stdout);
+	return(len);
+}
@@ -0,0 +1,159 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs
+//
+// Just enough of the ESP8266 Arduino core to compile the gateway modules with g++ on
+// a PC. Time is virtual: micros() and millis() return hostClock, which only moves
+// when a test sets it or when delay()/delayMicroseconds()/yield() are called.
+// Serial output is discarded unless hostVerbose is set.
+//
+// ----------------------------------------------------------------------------------------
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(x) (x)
+#define PSTR(x) (x)
+#define sprintf_P sprintf
+#define ICACHE_RAM_ATTR
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define RISING 1
+#define HEX 16
+#define DEC 10
+#define NOT_A_PIN -1
+
+// Virtual clock and pins, set by the tests
+extern uint64_t hostClock;						// Microseconds since start
+extern bool     hostVerbose;					// Print Serial output to stdout
+extern int      hostPin[32];					// Level of every GPIO
+extern uint32_t hostMicrosStep;					// Time that passes with every micros() call
+
+void hostAdvance(uint64_t us);
+
+unsigned long micros( void );
+unsigned long millis( void );
+void delay(unsigned long );
+void delayMicroseconds(unsigned int );
+void yield( void );
+
+int digitalRead(int );
+void digitalWrite(int , int );
+void pinMode(int , int );
+int digitalPinToInterrupt(int );
+void attachInterrupt(int , void (*)(void), int );
+void detachInterrupt(int );
+void noInterrupts( void );
+void interrupts( void );
+
+char *itoa(int , char *, int );
+long random(long );
+long random(long , long );
+
+class String {
+public:
+	String() {}
+	String(const char *s) : s_(s ? s : "") {}
+	String(int v, int base=10) { num((long) v, base); }
+	String(unsigned int v, int base=10) { num((unsigned long) v, base); }
+	String(long v, int base=10) { num(v, base); }
+	String(unsigned long v, int base=10) { num(v, base); }
+	String(double v, int d=2) { char b[32]; snprintf(b, sizeof(b), "%.*f", d, v); s_ = b; }
+	String &operator+=(const String &o) { s_ += o.s_; return(*this); }
+	String &operator+=(const char *o) { s_ += o; return(*this); }
+	String &operator+=(char c) { s_ += c; return(*this); }
+	String &operator+=(int v) { return(*this += String(v)); }
+	String &operator+=(unsigned int v) { return(*this += String(v)); }
+	String &operator+=(long v) { return(*this += String(v)); }
+	String &operator+=(unsigned long v) { return(*this += String(v)); }
+	String &operator+=(double v) { return(*this += String(v)); }
+	bool operator==(const char *o) const { return(s_ == o); }
+	const char *c_str() const { return(s_.c_str()); }
+	unsigned int length() const { return(s_.length()); }
+	int toInt() const { return(atoi(s_.c_str())); }
+	void reserve(unsigned int n) { s_.reserve(n); }
+private:
+	void num(long v, int base) { if (v < 0) { s_ = "-"; num((unsigned long) -v, base); s_ = "-" + s_; } else num((unsigned long) v, base); }
+	void num(unsigned long v, int base) { char b[40]; snprintf(b, sizeof(b), base == 16 ? "%lX" : "%lu", v); s_ = b; }
+	std::string s_;
+};
+inline String operator+(const String &a, const String &b) { String r(a); r += b; return(r); }
+inline String operator+(const char *a, const String &b) { String r(a); r += b; return(r); }
+inline String operator+(const String &a, const char *b) { String r(a); r += b; return(r); }
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) { return(write(&c, 1)); }
+	virtual size_t write(const uint8_t *buf, size_t len);
+	size_t write(const char *buf, size_t len) { return(write((const uint8_t *) buf, len)); }
+	size_t printf(const char *fmt, ...);
+	size_t print(const char *s) { return(write(s, strlen(s))); }
+	size_t print(const String &s) { return(print(s.c_str())); }
+	size_t print(char c) { return(write((uint8_t) c)); }
+	size_t print(int v, int base=DEC) { return(print(String(v, base))); }
+	size_t print(unsigned int v, int base=DEC) { return(print(String(v, base))); }
+	size_t print(long v, int base=DEC) { return(print(String(v, base))); }
+	size_t print(unsigned long v, int base=DEC) { return(print(String(v, base))); }
+	size_t print(long long v, int base=DEC) { return(print(String((long) v, base))); }
+	size_t print(unsigned long long v, int base=DEC) { return(print(String((unsigned long) v, base))); }
+	size_t print(double v, int d=2) { return(print(String(v, d))); }
+	size_t println() { return(print("\n")); }
+	template<typename T> size_t println(T v) { size_t n = print(v); return(n + println()); }
+	template<typename T> size_t println(T v, int b) { size_t n = print(v, b); return(n + println()); }
+};
+
+class Printable {};
+
+class IPAddress : public Printable {
+public:
+	IPAddress() : a_(0) {}
+	IPAddress(uint32_t a) : a_(a) {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : a_(a | (b << 8) | (c << 16) | ((uint32_t) d << 24)) {}
+	operator uint32_t() const { return(a_); }
+	uint8_t operator[](int i) const { return((a_ >> (8 * i)) & 0xFF); }
+	bool operator==(const IPAddress &o) const { return(a_ == o.a_); }
+	bool operator!=(const IPAddress &o) const { return(a_ != o.a_); }
+	String toString() const;
+private:
+	uint32_t a_;
+};
+
+class HardwareSerial : public Print {
+public:
+	void begin(long ) {}
+	int available() { return(0); }
+	int read() { return(-1); }
+	size_t write(const uint8_t *buf, size_t len);
+	using Print::write;
+	using Print::print;
+	using Print::println;
+	size_t print(const IPAddress &ip) { return(print(ip.toString())); }
+	size_t println(const IPAddress &ip) { return(println(ip.toString())); }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+	uint32_t getFreeHeap() { return(40000); }
+	uint32_t getChipId() { return(0x123456); }
+	uint32_t getCycleCount() { return((uint32_t)(hostClock * 80)); }
+	uint32_t getCpuFreqMHz() { return(80); }
+	void restart() {}
+	void reset() {}
+};
+extern EspClass ESP;
+
+#endif
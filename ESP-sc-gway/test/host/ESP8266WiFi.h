@@ -0,0 +1,7 @@
+// ESP-sc-gway host test stubs: only the types the tested modules use
+#ifndef HOST_ESP8266WIFI_H
+#define HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+#endif
@@ -0,0 +1,56 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs, see FS.h
+// ----------------------------------------------------------------------------------------
+#include <FS.h>
+
+FS SPIFFS;
+HostFiles hostFiles;
+bool hostFsFull = false;
+
+size_t File::write(const uint8_t *buf, size_t len) {
+	if (!open_ || hostFsFull) return(0);
+	std::vector<uint8_t> &d = hostFiles[name_];
+	if (pos_ + len > d.size()) d.resize(pos_ + len);
+	memcpy(&d[pos_], buf, len);
+	pos_ += len;
+	return(len);
+}
+
+int File::read(uint8_t *buf, size_t len) {
+	if (!open_) return(-1);
+	std::vector<uint8_t> &d = hostFiles[name_];
+	if (pos_ >= d.size()) return(0);
+	if (len > d.size() - pos_) len = d.size() - pos_;
+	memcpy(buf, &d[pos_], len);
+	pos_ += len;
+	return((int) len);
+}
+
+bool File::seek(uint32_t pos) {
+	if (!open_ || (pos > size())) return(false);
+	pos_ = pos;
+	return(true);
+}
+
+size_t File::size() const {
+	HostFiles::const_iterator it = hostFiles.find(name_);
+	return(it == hostFiles.end() ? 0 : it->second.size());
+}
+
+bool Dir::next() {
+	HostFiles::const_iterator it = first_ ? hostFiles.lower_bound(prefix_) : hostFiles.upper_bound(cur_);
+	first_ = false;
+	if ((it == hostFiles.end()) || (it->first.compare(0, prefix_.size(), prefix_) != 0)) return(false);
+	cur_ = it->first;
+	return(true);
+}
+
+File FS::open(const char *path, const char *mode) {
+	if (mode[0] == 'r') {
+		if (!hostFiles.count(path)) return(File());
+		return(File(path, false));
+	}
+	if (mode[0] == 'w') hostFiles[path].clear();
+	else hostFiles[path];
+	return(File(path, mode[0] == 'a'));
+}
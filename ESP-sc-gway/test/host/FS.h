@@ -0,0 +1,61 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs: SPIFFS in RAM
+//
+// Files live in hostFiles and survive journalInit(), so a restart can be simulated by
+// resetting the module state only. hostFsFull makes every write fail.
+//
+// ----------------------------------------------------------------------------------------
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+typedef std::map<std::string, std::vector<uint8_t> > HostFiles;
+extern HostFiles hostFiles;
+extern bool      hostFsFull;
+
+class File : public Print {
+public:
+	File() : open_(false), pos_(0) {}
+	File(const std::string &name, bool append) : open_(true), name_(name), pos_(append ? hostFiles[name].size() : 0) {}
+	operator bool() const { return(open_); }
+	size_t write(const uint8_t *buf, size_t len);
+	using Print::write;
+	int read(uint8_t *buf, size_t len);
+	bool seek(uint32_t pos);
+	size_t position() const { return(pos_); }
+	size_t size() const;
+	void close() { open_ = false; }
+	const char *name() const { return(name_.c_str()); }
+private:
+	bool        open_;
+	std::string name_;
+	size_t      pos_;
+};
+
+class Dir {
+public:
+	Dir() : first_(true) {}
+	Dir(const std::string &prefix) : prefix_(prefix), first_(true) {}
+	bool next();
+	String fileName() { return(String(cur_.c_str())); }
+private:
+	std::string prefix_;
+	std::string cur_;
+	bool        first_;
+};
+
+class FS {
+public:
+	bool begin() { return(true); }
+	File open(const char *path, const char *mode);
+	bool exists(const char *path) { return(hostFiles.count(path) != 0); }
+	bool remove(const char *path) { return(hostFiles.erase(path) != 0); }
+	Dir openDir(const char *path) { return(Dir(path)); }
+	bool format() { hostFiles.clear(); return(true); }
+};
+extern FS SPIFFS;
+
+#endif
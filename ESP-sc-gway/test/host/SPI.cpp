@@ -0,0 +1,75 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs, see SPI.h
+// ----------------------------------------------------------------------------------------
+#include <SPI.h>
+
+#define HOST_REG_FIFO      0x00
+#define HOST_REG_FIFO_PTR  0x0D
+#define HOST_REG_RX_ADDR   0x10
+#define HOST_REG_IRQ_FLAGS 0x12
+#define HOST_REG_RX_BYTES  0x13
+#define HOST_IRQ_RXDONE    0x40
+
+SPIClass SPI;
+
+uint8_t  hostReg[128];
+uint8_t  hostRegWritten[128];
+uint8_t  hostFifo[256];
+uint32_t hostSpiTxns = 0;
+uint32_t hostSpiBytes = 0;
+int      hostDio0 = -1;
+
+void hostSpiReset() {
+	memset(hostReg, 0, sizeof(hostReg));
+	memset(hostRegWritten, 0, sizeof(hostRegWritten));
+	hostSpiTxns = 0;
+	hostSpiBytes = 0;
+}
+
+void hostRxFrame(const uint8_t *buf, uint8_t len) {
+	memcpy(hostFifo, buf, len);
+	hostReg[HOST_REG_FIFO_PTR] = 0;
+	hostReg[HOST_REG_RX_ADDR] = 0;
+	hostReg[HOST_REG_RX_BYTES] = len;
+	hostReg[HOST_REG_IRQ_FLAGS] |= HOST_IRQ_RXDONE;
+	if (hostDio0 >= 0) hostPin[hostDio0] = HIGH;
+}
+
+uint32_t hostSpiUs() {
+	return((uint32_t)((uint64_t) hostSpiBytes * 8 * 1000000 / HOST_SPI_HZ) + hostSpiTxns * HOST_SPI_TXN_US);
+}
+
+void SPIClass::beginTransaction(SPISettings ) {
+	addr_ = -1;
+	hostSpiTxns++;
+}
+
+void SPIClass::endTransaction() {
+	addr_ = -1;
+}
+
+uint8_t SPIClass::transfer(uint8_t b) {
+	hostSpiBytes++;
+	if (addr_ < 0) {							// Address byte
+		addr_ = b & 0x7F;
+		write_ = (b & 0x80) != 0;
+		return(0);
+	}
+	uint8_t res = 0;
+	if (addr_ == HOST_REG_FIFO) {
+		if (write_) hostFifo[hostReg[HOST_REG_FIFO_PTR]++] = b;
+		else res = hostFifo[hostReg[HOST_REG_FIFO_PTR]++];
+		return(res);
+	}
+	if (write_ && (addr_ == HOST_REG_IRQ_FLAGS)) {
+		hostReg[addr_] &= ~b;
+		if ((hostDio0 >= 0) && (hostReg[addr_] == 0)) hostPin[hostDio0] = LOW;
+	}
+	else if (write_) {
+		hostReg[addr_] = b;
+		if (hostRegWritten[addr_] < 255) hostRegWritten[addr_]++;
+	}
+	else res = hostReg[addr_];
+	addr_ = (addr_ + 1) & 0x7F;
+	return(res);
+}
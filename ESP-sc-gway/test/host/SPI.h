@@ -0,0 +1,51 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs: SPI bus with an SX1276 register model
+//
+// The first byte of a transaction is the address (bit 7 set for a write), the other
+// bytes read or write consecutive registers, like the transceiver does. REG_FIFO (0)
+// does not increment but reads or writes hostFifo at REG_FIFO_ADDR_PTR (0x0D).
+// REG_IRQ_FLAGS (0x12) is cleared by writing 1s; DIO0 (pin hostDio0) is high while
+// a flag is set. hostRxFrame() puts a received frame in the FIFO and raises RxDone.
+// Transactions and bytes are counted; hostSpiUs() turns the counts into bus time
+// at the 50 kHz clock loraModem.cpp uses.
+//
+// ----------------------------------------------------------------------------------------
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+#define HOST_SPI_HZ      50000				// Clock of every transaction in loraModem.cpp
+#define HOST_SPI_TXN_US  12					// beginTransaction(), CS toggles, endTransaction()
+
+extern uint8_t  hostReg[128];				// Register contents
+extern uint8_t  hostRegWritten[128];		// Number of writes per register
+extern uint8_t  hostFifo[256];
+extern uint32_t hostSpiTxns;
+extern uint32_t hostSpiBytes;
+extern int      hostDio0;					// GPIO of DIO0, -1 when not modelled
+
+void hostSpiReset( void );
+uint32_t hostSpiUs( void );
+void hostRxFrame(const uint8_t *, uint8_t );
+
+struct SPISettings {
+	SPISettings(uint32_t , int , int ) {}
+};
+
+class SPIClass {
+public:
+	void begin() {}
+	void beginTransaction(SPISettings );
+	void endTransaction();
+	uint8_t transfer(uint8_t );
+private:
+	int  addr_;
+	bool write_;
+};
+extern SPIClass SPI;
+
+#endif
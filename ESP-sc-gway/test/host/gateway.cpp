@@ -0,0 +1,11 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test stubs: globals and functions of application.cpp and
+// ntpClient.cpp that the tested modules use
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+
+int debug = 0;
+
+bool ntpSynced() { return(false); }
+uint64_t ntpUtc(uint64_t ) { return(0); }
+int ntpIsoTime(char *, uint64_t ) { return(0); }
@@ -0,0 +1,13 @@
+// ESP-sc-gway host test stubs: lwIP DNS client, the test provides dns_gethostbyname()
+#ifndef HOST_LWIP_DNS_H
+#define HOST_LWIP_DNS_H
+
+#include <stdint.h>
+#include "lwip/err.h"
+
+typedef struct ip_addr { uint32_t addr; } ip_addr_t;
+typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr, void *callback_arg);
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg);
+
+#endif
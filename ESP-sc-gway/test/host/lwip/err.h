@@ -0,0 +1,11 @@
+// ESP-sc-gway host test stubs: lwIP error codes
+#ifndef HOST_LWIP_ERR_H
+#define HOST_LWIP_ERR_H
+
+typedef signed char err_t;
+
+#define ERR_OK          0
+#define ERR_INPROGRESS -5
+#define ERR_ARG       -16
+
+#endif
@@ -0,0 +1,78 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: ACK tracking with two servers
+//
+// Every PUSH_DATA goes to both servers with the same token; the copy for the resend
+// must be shared, so ACK_RETRY_SLOTS datagrams can be retried, not half of that.
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include "ESP-sc-gway.h"
+#include "loraModem.h"
+#include "ackTrack.h"
+#include "check.h"
+
+static int resent[ACK_SERVERS];
+static int lost[ACK_SERVERS];
+static uint16_t lastToken;
+
+static void onResend(int server, uint8_t *msg, int length) {
+	resent[server]++;
+	lastToken = msg[1] | (msg[2] << 8);
+}
+
+static void onLost(int server, uint8_t *msg, int length) {
+	lost[server]++;
+}
+
+static int pushData(uint8_t *msg, uint16_t token) {
+	memset(msg, 0, 12);
+	msg[0] = PROTOCOL_VERSION;
+	msg[1] = token & 0xFF;
+	msg[2] = token >> 8;
+	msg[3] = PKT_PUSH_DATA;
+	int n = sprintf((char *)(msg + 12), "{\"rxpk\":[{\"tmst\":%u}]}", token);
+	return(12 + n);
+}
+
+int main() {
+	uint8_t msg[ACK_RETRY_SLOTS][64];
+
+	// ACK_RETRY_SLOTS datagrams in flight, each sent to two servers
+	for (int d = 0; d < ACK_RETRY_SLOTS; d++) {
+		int len = pushData(msg[d], 100 + d);
+		ackSent(0, msg[d], len);
+		ackSent(1, msg[d], len);
+	}
+
+	hostAdvance((uint64_t) ACK_RETRY_MS * 1000);
+	ackCheck(onResend, onLost);
+#if _ACK_RETRY==1
+	CHECK_EQ(resent[0], ACK_RETRY_SLOTS);
+	CHECK_EQ(resent[1], ACK_RETRY_SLOTS);
+#endif
+
+	// Server 1 acks the first datagram, server 0 does not: its copy is kept
+	CHECK(ackReceived(1, 100, PKT_PUSH_ACK));
+	hostAdvance((uint64_t) ACK_TIMEOUT_MS * 1000);
+	ackCheck(onResend, onLost);
+	CHECK_EQ(ackLost(0), ACK_RETRY_SLOTS);
+	CHECK_EQ(ackLost(1), ACK_RETRY_SLOTS - 1);
+#if _ACK_RETRY==1
+	CHECK_EQ(lost[0], ACK_RETRY_SLOTS);
+	CHECK_EQ(lost[1], ACK_RETRY_SLOTS - 1);
+#endif
+
+	// All slots are free again
+	int len = pushData(msg[0], 200);
+	ackSent(0, msg[0], len);
+	ackSent(1, msg[0], len);
+	hostAdvance((uint64_t) ACK_RETRY_MS * 1000);
+	memset(resent, 0, sizeof(resent));
+	ackCheck(onResend, onLost);
+#if _ACK_RETRY==1
+	CHECK_EQ(resent[0] + resent[1], 2);
+	CHECK_EQ(lastToken, 200);
+#endif
+	CHECK_EQ(ackPushSent(0), ACK_RETRY_SLOTS + 1);
+
+	return(checkResult("test_ackTrack"));
+}
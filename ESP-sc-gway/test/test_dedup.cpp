@@ -0,0 +1,94 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: duplicate uplink filter
+//
+// A frame is a duplicate only within DEDUP_WINDOW_MS of its first reception, also
+// when millis() wraps, and only as long as it is in the ring of DEDUP_ENTRIES.
+// A frame that receivePacket() had to drop (buffer too small) is not remembered.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <SPI.h>
+#include "loraModem.h"
+#include "dedup.h"
+#include "check.h"
+
+#define DIO0_PIN   15
+
+// Unconfirmed uplink, the FCnt makes every frame different
+static void makeFrame(uint8_t *f, uint8_t len, uint32_t n) {
+	f[0] = 0x40;
+	f[1] = 0x01; f[2] = 0x02; f[3] = 0x00; f[4] = 0x26;
+	f[5] = 0x00;
+	f[6] = n & 0xFF; f[7] = (n >> 8) & 0xFF;
+	for (int i = 8; i < len; i++) f[i] = (uint8_t)(i * 37 + n);
+}
+
+static void setMillis(uint32_t ms) {
+	hostClock = (uint64_t) ms * 1000;
+}
+
+int main() {
+	static uint8_t buf[1024];
+	uint8_t frame[64], other[64];
+	UpTrace trace;
+
+	// receivePacket(): a frame dropped for lack of room is sent when it comes again
+	hostSpiReset();
+	hostDio0 = DIO0_PIN;
+	hostReg[REG_VERSION] = 0x12;
+	setLoraModem(16, DIO0_PIN, NOT_A_PIN, NOT_A_PIN, NOT_A_PIN, SF9, false);
+	initLoraModem();
+
+	makeFrame(frame, 23, 1);
+	hostRxFrame(frame, 23);
+	pollLoraModem();
+	CHECK_EQ(receivePacket(buf, 16, &trace), -1);
+	CHECK_EQ(dedupMisses(), 0);
+	hostRxFrame(frame, 23);
+	pollLoraModem();
+	CHECK(receivePacket(buf, sizeof(buf), &trace) > 0);
+	hostRxFrame(frame, 23);
+	pollLoraModem();
+	CHECK_EQ(receivePacket(buf, sizeof(buf), &trace), -1);		// now it is a duplicate
+	CHECK_EQ(dedupHits(), 1);
+
+	// Window: a duplicate up to DEDUP_WINDOW_MS - 1, a new frame from DEDUP_WINDOW_MS
+	setMillis(100000);
+	makeFrame(frame, 23, 2);
+	CHECK(!dedupSeen(frame, 23));
+	setMillis(100000 + DEDUP_WINDOW_MS - 1);
+	CHECK(dedupSeen(frame, 23));
+	setMillis(100000 + DEDUP_WINDOW_MS);
+	CHECK(!dedupSeen(frame, 23));								// expired, remembered again
+	setMillis(100000 + DEDUP_WINDOW_MS + 10);
+	CHECK(dedupSeen(frame, 23));
+
+	// Same bytes with another length is another frame
+	CHECK(!dedupSeen(frame, 22));
+
+	// The window across the millis() rollover
+	setMillis(0xFFFFFFFFUL - 500);
+	makeFrame(frame, 23, 3);
+	CHECK(!dedupSeen(frame, 23));
+	setMillis(DEDUP_WINDOW_MS - 600);
+	CHECK(dedupSeen(frame, 23));
+	setMillis(DEDUP_WINDOW_MS);
+	CHECK(!dedupSeen(frame, 23));
+
+	// DEDUP_ENTRIES newer frames push it out of the ring within the window
+	setMillis(DEDUP_WINDOW_MS + 10);
+	for (uint32_t n = 0; n < DEDUP_ENTRIES - 1; n++) {
+		makeFrame(other, 23, 100 + n);
+		CHECK(!dedupSeen(other, 23));
+	}
+	CHECK(dedupSeen(frame, 23));								// still in the ring
+	makeFrame(other, 23, 200);
+	CHECK(!dedupSeen(other, 23));
+	CHECK(!dedupSeen(frame, 23));								// replaced by the oldest slot
+
+	dedupResetStats();
+	CHECK_EQ(dedupHits(), 0);
+	CHECK_EQ(dedupMisses(), 0);
+
+	return(checkResult("test_dedup"));
+}
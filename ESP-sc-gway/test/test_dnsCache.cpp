@@ -0,0 +1,138 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: DNS cache lookups, timeouts and fallback
+//
+// dns_gethostbyname() is faked: the test decides whether it answers at once, later
+// (through the saved callback) or fails.
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "dnsCache.h"
+#include "check.h"
+
+extern "C" {
+#include "lwip/err.h"
+#include "lwip/dns.h"
+}
+
+static err_t dnsMode = ERR_INPROGRESS;		// What the next dns_gethostbyname() returns
+static uint32_t dnsAnswer = 0;				// Address for ERR_OK
+static dns_found_callback dnsCb = NULL;		// Saved for a later answer
+static void *dnsArg = NULL;
+static int dnsCalls = 0;
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *arg) {
+	dnsCalls++;
+	dnsCb = found;
+	dnsArg = arg;
+	if (dnsMode == ERR_OK) addr->addr = dnsAnswer;
+	return(dnsMode);
+}
+
+static void answer(void *arg, uint32_t a) {
+	ip_addr_t ip;
+	ip.addr = a;
+	dnsCb("host", a ? &ip : NULL, arg);
+}
+
+static void advanceMs(uint32_t ms) { hostAdvance((uint64_t) ms * 1000); }
+
+int main() {
+	IPAddress ip;
+	const uint32_t A1 = IPAddress(10, 0, 0, 1);
+	const uint32_t A2 = IPAddress(10, 0, 0, 2);
+	const uint32_t A3 = IPAddress(10, 0, 0, 3);
+
+	int h = dnsAdd("router.example");
+	CHECK_EQ(h, 0);
+	CHECK_EQ(dnsAdd("router.example"), 0);					// Same name, same entry
+	CHECK(!dnsGet(h, ip));
+
+	// No lookups while WiFi is down
+	dnsService(false);
+	CHECK_EQ(dnsCalls, 0);
+
+	// First lookup, answered 120 ms later
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 1);
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 1);									// Pending, not started again
+	advanceMs(120);
+	answer(dnsArg, A1);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A1);
+	CHECK_EQ(dnsLatencyLast(h), 120);
+	CHECK_EQ(dnsFailures(h), 0);
+
+	// Nothing until the refresh is due
+	advanceMs(DNS_REFRESH_MS - 1);
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 1);
+	advanceMs(1);
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 2);
+
+	// No answer: timeout, the old address stays in use
+	void *timedOut = dnsArg;
+	advanceMs(DNS_TIMEOUT_MS - 1);
+	dnsService(true);
+	CHECK_EQ(dnsFailures(h), 0);
+	advanceMs(1);
+	dnsService(true);
+	CHECK_EQ(dnsFailures(h), 1);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A1);
+
+	// Retry after DNS_RETRY_MS, not before
+	advanceMs(DNS_RETRY_MS - 1);
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 2);
+	advanceMs(1);
+	dnsService(true);
+	CHECK_EQ(dnsCalls, 3);
+
+	// The answer to the timed out lookup comes in now: it is ignored
+	answer(timedOut, A3);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A1);
+	CHECK_EQ(dnsChanges(h), 0);
+
+	// The answer to the current lookup is taken, with a new address
+	answer(dnsArg, A2);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A2);
+	CHECK_EQ(dnsChanges(h), 1);
+
+	// A second answer to the same lookup is ignored as well
+	answer(dnsArg, A3);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A2);
+
+	// Failed answer (NULL) and immediate errors keep the address and retry
+	dnsRefreshAll();
+	dnsService(true);
+	answer(dnsArg, 0);
+	CHECK_EQ(dnsFailures(h), 2);
+	dnsMode = ERR_ARG;
+	advanceMs(DNS_RETRY_MS);
+	dnsService(true);
+	CHECK_EQ(dnsFailures(h), 3);
+	CHECK(dnsGet(h, ip));
+	CHECK_EQ((uint32_t) ip, A2);
+
+	// Numeric name or lwIP cache hit: answered at once
+	dnsMode = ERR_OK;
+	dnsAnswer = A3;
+	int n = dnsAdd("192.168.1.17");
+	CHECK_EQ(n, 1);
+	dnsService(true);											// Entry 0 still waits for its retry
+	CHECK(dnsGet(n, ip));
+	CHECK_EQ((uint32_t) ip, A3);
+	CHECK_EQ(dnsLatencyLast(n), 0);
+
+	// Table full
+	CHECK(dnsAdd("c") >= 0);
+	CHECK(dnsAdd("d") >= 0);
+	CHECK_EQ(dnsAdd("e"), -1);
+
+	return(checkResult("test_dnsCache"));
+}
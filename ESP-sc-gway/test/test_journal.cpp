@@ -0,0 +1,196 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: uplink journal on (RAM) SPIFFS
+//
+// Fills the journal past JRNL_SEGMENTS segments so the ring wraps and the oldest
+// segment is dropped, simulates a restart (journalInit rescans the segment files,
+// a torn record at the end is ignored) and replays everything in order.
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <FS.h>
+#include "ESP-sc-gway.h"
+#include "loraModem.h"
+#include "journal.h"
+#include "check.h"
+
+// journal.cpp state, reset to simulate a restart
+extern bool     jrnlMounted;
+extern uint32_t jrnlTailSeq, jrnlHeadSeq, jrnlReadPos;
+extern uint16_t jrnlReadCount;
+extern uint16_t jrnlSegCount[JRNL_SEGMENTS];
+extern uint32_t jrnlSegBytes[JRNL_SEGMENTS];
+extern int      jrnlWbufLen, jrnlWbufCount;
+extern uint32_t jrnlLastAppend, jrnlLastReplay;
+extern uint32_t jrnlDepth, jrnlWritten, jrnlReplayed, jrnlDropped;
+
+#define BODY_DATA  900						// About 17 records per segment
+
+static void restart() {
+	jrnlMounted = false;
+	jrnlTailSeq = jrnlHeadSeq = jrnlReadPos = 0;
+	jrnlReadCount = 0;
+	memset(jrnlSegCount, 0, sizeof(jrnlSegCount));
+	memset(jrnlSegBytes, 0, sizeof(jrnlSegBytes));
+	jrnlWbufLen = jrnlWbufCount = 0;
+	jrnlLastAppend = jrnlLastReplay = 0;
+	jrnlDepth = jrnlWritten = jrnlReplayed = jrnlDropped = 0;
+	journalInit();
+}
+
+static int makeMsg(uint8_t *msg, uint32_t n) {
+	memset(msg, 0, 12);
+	msg[0] = PROTOCOL_VERSION;
+	msg[3] = PKT_PUSH_DATA;
+	char *p = (char *)(msg + 12);
+	p += sprintf(p, "{\"rxpk\":[{\"tmst\":%u,\"stat\":1,\"data\":\"", n);
+	memset(p, 'A' + (n % 26), BODY_DATA);
+	p += BODY_DATA;
+	p += sprintf(p, "\"}],\"stat\":{\"rxnb\":%u}}", n);
+	return(p - (char *) msg);
+}
+
+static int segmentFiles() {
+	int n = 0;
+	Dir d = SPIFFS.openDir(JRNL_DIR);
+	while (d.next()) n++;
+	return(n);
+}
+
+// Replay callback: checks order and content of every message
+static uint32_t nextTmst;
+static int replayBad;
+static bool replayOk;
+static bool replayAppend;						// Journal the replay again, as sendUdpServer()
+
+static bool onReplay(uint8_t *msg, int length) {
+	if (!replayOk) return(false);
+	msg[length] = 0;
+	char *body = (char *)(msg + 12);
+	unsigned int tmst;
+	if ((sscanf(body, "{\"rxpk\":[{\"tmst\":%u,", &tmst) != 1) || (tmst != nextTmst)) replayBad++;
+	if (strstr(body, "\"stat\":{") != NULL) replayBad++;			// Stale stat left in
+	if (strcmp(body + strlen(body) - 3, "\"}]") == 0) replayBad++;
+	if (strcmp(body + strlen(body) - 4, "\"}]}") != 0) replayBad++;
+	nextTmst = tmst + 1;
+	if (replayAppend && journalAppend(msg, length)) replayBad++;	// would be a duplicate
+	return(true);
+}
+
+static void replayAll() {
+	for (int i = 0; (i < 10000) && (journalDepth() > 0); i++) {
+		hostAdvance(JRNL_REPLAY_MS * 1000);
+		journalService(true, onReplay);
+	}
+}
+
+int main() {
+	static uint8_t msg[_BATCH_BYTES];
+	uint32_t n;
+
+	restart();
+	CHECK_EQ(journalDepth(), 0);
+
+	// Not stored: stat only, PULL_DATA
+	int len = makeMsg(msg, 0);
+	msg[3] = PKT_PULL_DATA;
+	CHECK(!journalAppend(msg, len));
+	memcpy(msg + 12, "{\"stat\":{}}", 11);
+	msg[3] = PKT_PUSH_DATA;
+	CHECK(!journalAppend(msg, 23));
+
+	// Wrap: many more records than JRNL_SEGMENTS segments hold
+	uint32_t total = 4 * JRNL_SEGMENTS * (JRNL_SEG_SIZE / (BODY_DATA + 60));
+	for (n = 0; n < total; n++) {
+		len = makeMsg(msg, n);
+		CHECK(journalAppend(msg, len));
+		hostAdvance(1000);
+	}
+	CHECK_EQ(journalWritten(), total);
+	CHECK(journalDropped() > 0);
+	CHECK_EQ(journalDepth() + journalDropped(), total);
+	CHECK(segmentFiles() <= JRNL_SEGMENTS - 1);
+	journalFlush();
+	CHECK(segmentFiles() <= JRNL_SEGMENTS - 1);
+
+	// Restart: the rescan finds the same records
+	uint32_t depth = journalDepth();
+	uint32_t first = total - depth;
+	restart();
+	CHECK_EQ(journalDepth(), depth);
+
+	// A torn record at the end of the newest segment is not counted
+	std::string last;
+	{
+		Dir d = SPIFFS.openDir(JRNL_DIR);
+		uint32_t maxSeq = 0;
+		while (d.next()) {
+			uint32_t seq = strtoul(d.fileName().c_str() + strlen(JRNL_DIR), NULL, 10);
+			if (seq >= maxSeq) { maxSeq = seq; last = d.fileName().c_str(); }
+		}
+	}
+	std::vector<uint8_t> &f = hostFiles[last];
+	uint8_t torn[] = { JRNL_MAGIC, 0x40, 0x01, 0x00, '{', '"' };
+	f.insert(f.end(), torn, torn + sizeof(torn));
+	restart();
+	CHECK_EQ(journalDepth(), depth);
+
+	// New records go behind the old ones, replay sends all in order
+	len = makeMsg(msg, total);
+	CHECK(journalAppend(msg, len));
+	hostAdvance(JRNL_HOLD_MS * 1000);
+
+	replayOk = false;								// Link down: nothing is lost
+	journalService(true, onReplay);
+	hostAdvance(JRNL_REPLAY_MS * 1000);
+	journalService(true, onReplay);
+	CHECK_EQ(journalDepth(), depth + 1);
+
+	replayOk = true;
+	nextTmst = first;
+	replayAll();
+	CHECK_EQ(replayBad, 0);
+	CHECK_EQ(nextTmst, total + 1);
+	CHECK_EQ(journalReplayed(), depth + 1);
+	CHECK_EQ(journalDepth(), 0);
+	CHECK_EQ(journalBytes(), 0);
+
+	// Half replayed, restart: the tail segment is sent again from its start
+	for (n = 0; n < 40; n++) {
+		len = makeMsg(msg, 1000 + n);
+		journalAppend(msg, len);
+	}
+	journalFlush();
+	hostAdvance(JRNL_HOLD_MS * 1000);
+	nextTmst = 1000;
+	for (int i = 0; i < 5; i++) {
+		hostAdvance(JRNL_REPLAY_MS * 1000);
+		journalService(true, onReplay);
+	}
+	CHECK_EQ(nextTmst, 1005);
+	restart();
+	CHECK_EQ(journalDepth(), 40);
+	hostAdvance(JRNL_HOLD_MS * 1000);
+	nextTmst = 1000;
+	replayAll();
+	CHECK_EQ(replayBad, 0);
+	CHECK_EQ(nextTmst, 1040);
+	CHECK_EQ(segmentFiles(), 0);
+
+	// A replay whose send path journals it (no ACK copy slot left) is not
+	// stored twice: depth and written count only go down with the replays
+	for (n = 0; n < 20; n++) {
+		len = makeMsg(msg, 2000 + n);
+		journalAppend(msg, len);
+	}
+	uint32_t written = journalWritten();
+	hostAdvance(JRNL_HOLD_MS * 1000);
+	nextTmst = 2000;
+	replayAppend = true;
+	replayAll();
+	replayAppend = false;
+	CHECK_EQ(replayBad, 0);
+	CHECK_EQ(nextTmst, 2020);
+	CHECK_EQ(journalWritten(), written);
+	CHECK_EQ(journalDepth(), 0);
+
+	return(checkResult("test_journal"));
+}
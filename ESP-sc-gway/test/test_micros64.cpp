@@ -0,0 +1,60 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: micros64() and micros64From32() around the 2^32 wrap
+// of micros(), every 71.6 minutes on the ESP8266.
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include "aux.h"
+#include "check.h"
+
+#define WRAP  ((uint64_t)1 << 32)
+
+// micros64() must see every wrap, so step in less than 2^31 uSec
+static void stepTo(uint64_t t) {
+	while (hostClock + 0x40000000 < t) {
+		hostClock += 0x40000000;
+		micros64();
+	}
+	hostClock = t;
+}
+
+int main() {
+	// Monotonic over three wraps, in steps of 1 ms down to 1 uSec near each wrap
+	uint64_t last = micros64();
+	bool mono = true;
+	for (int w = 1; w <= 3; w++) {
+		stepTo(w * WRAP - 5000);
+		for (int i = 0; i < 10000; i++) {
+			hostClock += (i % 3) ? 1 : 7;
+			uint64_t now = micros64();
+			if ((now <= last) || (now != hostClock)) mono = false;
+			last = now;
+		}
+	}
+	CHECK(mono);
+	CHECK_EQ(micros64(), hostClock);
+	CHECK(micros64() > 3 * WRAP);
+
+	// A 32-bit timestamp taken just before the wrap, expanded just after it
+	stepTo(4 * WRAP - 100);
+	uint32_t before = micros();
+	stepTo(4 * WRAP + 200);
+	CHECK_EQ(micros64From32(before), 4 * WRAP - 100);
+
+	// ... and one taken just after the wrap, expanded just before it (a server
+	// tmst slightly in the future)
+	stepTo(5 * WRAP - 300);
+	CHECK_EQ(micros64From32((uint32_t)(5 * WRAP + 400)), 5 * WRAP + 400);
+
+	// Exactly on the wrap and a few uSec around it, both directions
+	stepTo(6 * WRAP);
+	CHECK_EQ(micros64From32(0), 6 * WRAP);
+	CHECK_EQ(micros64From32(0xFFFFFFFF), 6 * WRAP - 1);
+	CHECK_EQ(micros64From32(5), 6 * WRAP + 5);
+
+	// Far away timestamps, still within +/- 2^31 uSec (35 minutes)
+	stepTo(7 * WRAP + 1000);
+	CHECK_EQ(micros64From32((uint32_t)(7 * WRAP - 0x7FFFF000)), 7 * WRAP - 0x7FFFF000);
+	CHECK_EQ(micros64From32((uint32_t)(7 * WRAP + 0x7FFFF000)), 7 * WRAP + 0x7FFFF000);
+
+	return(checkResult("test_micros64"));
+}
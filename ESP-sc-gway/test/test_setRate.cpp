@@ -0,0 +1,154 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: radio registers per downlink freq/SF/BW/CR
+//
+// Every downlink goes through sendPacket(), the JIT queue and txLoraModem() on the
+// SX1276 register model. The FRF and modem config registers are compared with values
+// worked out from the SX1276 data sheet, not with the formulas of setRate()/setFreq().
+// After TxDone the radio must be back on the receive channel and rate.
+//
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include <SPI.h>
+#include "loraModem.h"
+#include "aux.h"
+#include "check.h"
+
+#define DIO0_PIN   15
+
+extern bool sx1272;
+void setRate(uint8_t sf, uint16_t bw, uint8_t cr, uint8_t crc);
+
+struct Case {
+	const char *freq;			// as the server writes it
+	const char *datr;
+	const char *codr;
+	bool        ipol;
+	uint8_t     frf[3];			// FRF_MSB, FRF_MID, FRF_LSB == freq * 2^19 / 32 MHz
+	uint8_t     mc1;			// bw 125/250/500 == 0x70/0x80/0x90 | cr 4/5..4/8 == 0x02..0x08
+	uint8_t     mc2;			// sf<<4, CRC off for TX
+	uint8_t     mc3;			// AGC auto 0x04 | low data rate optimize 0x08
+	uint8_t     symb;			// 0x05 for SF10-12, else 0x08
+};
+
+static const Case cases[] = {
+	{ "868.1",   "SF7BW125",  "4/5", true,  { 0xD9, 0x06, 0x66 }, 0x72, 0x70, 0x04, 0x08 },
+	{ "869.525", "SF9BW125",  "4/5", true,  { 0xD9, 0x61, 0x99 }, 0x72, 0x90, 0x04, 0x08 },
+	{ "869.525", "SF10BW125", "4/6", false, { 0xD9, 0x61, 0x99 }, 0x74, 0xA0, 0x04, 0x05 },
+	{ "867.5",   "SF11BW125", "4/7", true,  { 0xD8, 0xE0, 0x00 }, 0x76, 0xB0, 0x0C, 0x05 },
+	{ "863",     "SF12BW125", "4/8", true,  { 0xD7, 0xC0, 0x00 }, 0x78, 0xC0, 0x0C, 0x05 },
+	{ "870",     "SF12BW250", "4/5", true,  { 0xD9, 0x80, 0x00 }, 0x82, 0xC0, 0x0C, 0x05 },
+	{ "868.1",   "SF11BW250", "4/5", true,  { 0xD9, 0x06, 0x66 }, 0x82, 0xB0, 0x04, 0x05 },
+	{ "868.1",   "SF8BW500",  "4/5", true,  { 0xD9, 0x06, 0x66 }, 0x92, 0x80, 0x04, 0x08 },
+	{ "868.1",   "SF12BW500", "4/8", true,  { 0xD9, 0x06, 0x66 }, 0x98, 0xC0, 0x04, 0x05 },
+};
+
+static char buf[512];
+
+static int downlink(const Case *c, int powe) {
+	int len = snprintf(buf, sizeof(buf),
+		"{\"txpk\":{\"imme\":true,\"freq\":%s,\"rfch\":0,\"powe\":%d,\"modu\":\"LORA\","
+		"\"datr\":\"%s\",\"codr\":\"%s\",\"ipol\":%s,\"size\":4,\"data\":\"AQIDBA==\"}}",
+		c->freq, powe, c->datr, c->codr, c->ipol ? "true" : "false");
+	return(sendPacket((uint8_t *) buf, len));
+}
+
+// Let the JIT queue prepare the radio, fire, and finish with TxDone
+static void transmit(const Case *c) {
+	pollLoraModem();												// txLoraModem(): armed
+	CHECK_EQ(hostReg[REG_FRF_MSB], c->frf[0]);
+	CHECK_EQ(hostReg[REG_FRF_MID], c->frf[1]);
+	CHECK_EQ(hostReg[REG_FRF_LSB], c->frf[2]);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], c->mc1);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], c->mc2);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG3], c->mc3);
+	CHECK_EQ(hostReg[REG_SYMB_TIMEOUT_LSB], c->symb);
+	CHECK_EQ(hostReg[REG_INVERTIQ], c->ipol ? 0x40 : 0x27);
+	CHECK_EQ(hostReg[REG_PAYLOAD_LENGTH], 4);
+
+	hostAdvance(TX_PREPARE_US);
+	pollLoraModem();												// txFire()
+	CHECK_EQ(hostReg[REG_OPMODE] & OPMODE_MASK, OPMODE_TX);
+	hostReg[REG_IRQ_FLAGS] = 0x08;									// TxDone
+	hostPin[DIO0_PIN] = HIGH;
+	pollLoraModem();												// txDoneLoraModem()
+	hostPin[DIO0_PIN] = LOW;
+
+	// Back on the receive channel, SF9 with CRC on
+	CHECK_EQ(hostReg[REG_FRF_MSB], 0xD9);
+	CHECK_EQ(hostReg[REG_FRF_MID], 0x06);
+	CHECK_EQ(hostReg[REG_FRF_LSB], 0x66);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], 0x72);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], 0x94);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG3], 0x04);
+	CHECK_EQ(hostReg[REG_INVERTIQ], 0x27);
+}
+
+int main() {
+	hostSpiReset();
+	hostDio0 = DIO0_PIN;
+	hostReg[REG_VERSION] = 0x12;
+	setLoraModem(16, DIO0_PIN, NOT_A_PIN, NOT_A_PIN, NOT_A_PIN, SF9, false);
+	initLoraModem();
+
+	for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		CHECK_EQ(downlink(&cases[i], 14), TX_ERR_NONE);
+		transmit(&cases[i]);
+		CHECK_EQ(hostReg[REG_PAC], 0x8E);
+		hostAdvance(100000);
+	}
+
+	// Power above TX_POWE_MAX is sent with TX_POWE_MAX
+	CHECK_EQ(downlink(&cases[0], 20), TX_ERR_POWER);
+	transmit(&cases[0]);
+	CHECK_EQ(hostReg[REG_PAC], 0x80 | TX_POWE_MAX);
+	hostAdvance(100000);
+
+	// Immediate downlink while the clock runs: not refused as too late
+	hostMicrosStep = 1;
+	CHECK_EQ(downlink(&cases[1], 14), TX_ERR_NONE);
+	transmit(&cases[1]);
+	hostMicrosStep = 0;
+	hostAdvance(100000);
+
+	// Outside the band nothing is queued or written
+	Case out = cases[0];
+	out.freq = "915.0";
+	CHECK_EQ(downlink(&out, 14), TX_ERR_FREQ);
+	pollLoraModem();
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], 0x94);
+
+	// A datr the radio cannot send is refused with an error, not dropped
+	out = cases[0];
+	out.datr = "SF6BW125";
+	CHECK_EQ(downlink(&out, 14), TX_ERR_INVALID);
+	out = cases[0];
+	out.codr = "4/9";
+	CHECK_EQ(downlink(&out, 14), TX_ERR_INVALID);
+	out.codr = "4/0";
+	CHECK_EQ(downlink(&out, 14), TX_ERR_INVALID);
+	pollLoraModem();
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], 0x94);					// nothing was queued
+	CHECK_EQ(sendPacket((uint8_t *) strcpy(buf, "{\"txpk\":"), 8), TX_ERR_INVALID);
+
+	// An idle radio task alone keeps micros64() across micros() wraps
+	for (int i = 0; i < 10; i++) {
+		hostAdvance(0x40000000);
+		pollLoraModem();
+	}
+	CHECK_EQ(micros64(), hostClock);
+
+	// SX1272 layout: bw in bits 7-6, cr in bits 5-3, LDRO in bit 0
+	sx1272 = true;
+	setRate(SF7, 125, 5, 0x00);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], 0x0A);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], 0x70);
+	setRate(SF12, 125, 8, 0x04);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], 0x23);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG2], 0xC4);
+	setRate(SF9, 250, 5, 0x00);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], 0x4A);
+	setRate(SF12, 500, 6, 0x00);
+	CHECK_EQ(hostReg[REG_MODEM_CONFIG1], 0x92);
+
+	return(checkResult("test_setRate"));
+}
@@ -0,0 +1,151 @@
+// ----------------------------------------------------------------------------------------
+// ESP-sc-gway host test: txpk parser corpus
+//
+// PULL_RESP messages as sent by the TTN (Semtech packet forwarder protocol) and
+// ChirpStack servers, and broken variants of them.
+// ----------------------------------------------------------------------------------------
+#include <Arduino.h>
+#include "txpk.h"
+#include "check.h"
+
+static Txpk t;
+static char buf[1024];
+
+static int parse(const char *json) {
+	int len = strlen(json);
+	memcpy(buf, json, len + 1);
+	return(txpkParse(buf, len, &t));
+}
+
+static bool dataIs(const char *s) {
+	return((t.dataLen == (int) strlen(s)) && (memcmp(t.data, s, t.dataLen) == 0));
+}
+
+int main() {
+	// TTN, the example of the protocol document
+	CHECK_EQ(parse("{\"txpk\":{\"imme\":false,\"tmst\":1890991792,\"freq\":869.525,\"rfch\":0,\"powe\":14,"
+		"\"modu\":\"LORA\",\"datr\":\"SF9BW125\",\"codr\":\"4/5\",\"ipol\":true,\"size\":18,"
+		"\"data\":\"YCkEAgIABQABGmIwYX/kSn4Y\"}}"), TXPK_OK);
+	CHECK(!t.imme);
+	CHECK_EQ(t.tmst, 1890991792u);
+	CHECK_EQ(t.freq, 869525000);
+	CHECK_EQ(t.powe, 14);
+	CHECK_EQ(t.sf, 9);
+	CHECK_EQ(t.bw, 125);
+	CHECK_EQ(t.cr, 5);
+	CHECK(t.ipol);
+	CHECK(!t.ncrc);
+	CHECK_EQ(t.size, 18);
+	CHECK_EQ(t.dataLen, 18);
+	CHECK_EQ(t.data[0], 0x60);
+	CHECK_EQ(t.data[17], 0x18);
+
+	// ChirpStack gateway bridge: other key order, extra fields, whitespace
+	CHECK_EQ(parse("{ \"txpk\" : { \"imme\" : false, \"rfch\" : 0, \"powe\" : 16, \"ant\" : 0, \"brd\" : 0,\n"
+		"  \"tmst\" : 4294967295, \"freq\" : 868.1, \"modu\" : \"LORA\", \"datr\" : \"SF12BW125\",\n"
+		"  \"codr\" : \"4/8\", \"ipol\" : true, \"ncrc\" : true, \"size\" : 3, \"data\" : \"YWJj\" } }"), TXPK_OK);
+	CHECK_EQ(t.tmst, 4294967295u);
+	CHECK_EQ(t.freq, 868100000);
+	CHECK_EQ(t.sf, 12);
+	CHECK_EQ(t.cr, 8);
+	CHECK(t.ncrc);
+	CHECK(dataIs("abc"));
+
+	// Class C, immediate, data first, txpk after another top level member
+	CHECK_EQ(parse("{\"other\":{\"a\":[1,{\"b\":\"}\"}]},\"txpk\":{\"data\":\"YWI=\",\"imme\":true,"
+		"\"datr\":\"SF7BW500\",\"freq\":869.525}}"), TXPK_OK);
+	CHECK(t.imme);
+	CHECK_EQ(t.sf, 7);
+	CHECK_EQ(t.bw, 500);
+	CHECK(dataIs("ab"));
+
+	// Missing fields: the parser leaves them 0 (size -1), sendPacket() rejects
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YQ==\"}}"), TXPK_OK);
+	CHECK_EQ(t.tmst, 0);
+	CHECK_EQ(t.freq, 0);
+	CHECK_EQ(t.sf, 0);
+	CHECK_EQ(t.cr, 0);
+	CHECK_EQ(t.size, -1);
+
+	// Coding rates other than 4/5 .. 4/8 are marked, not mapped to a default
+	CHECK_EQ(parse("{\"txpk\":{\"codr\":\"4/9\",\"data\":\"YQ==\"}}"), TXPK_OK);
+	CHECK_EQ(t.cr, TXPK_CR_BAD);
+	CHECK_EQ(parse("{\"txpk\":{\"codr\":\"4/0\",\"data\":\"YQ==\"}}"), TXPK_OK);
+	CHECK_EQ(t.cr, TXPK_CR_BAD);
+	CHECK_EQ(parse("{\"txpk\":{\"codr\":\"4/5x\",\"data\":\"YQ==\"}}"), TXPK_OK);
+	CHECK_EQ(t.cr, TXPK_CR_BAD);
+	CHECK(dataIs("a"));
+	CHECK(dataIs("a"));
+	CHECK_EQ(parse("{\"txpk\":{\"tmst\":1,\"freq\":868.1}}"), TXPK_ERR_NODATA);
+	CHECK_EQ(parse("{\"txpk\":{}}"), TXPK_ERR_NODATA);
+	CHECK_EQ(parse("{\"txpk_ack\":{\"error\":\"NONE\"}}"), TXPK_ERR_SYNTAX);
+
+	// Escaped strings: "\/" in base64, escaped quotes in skipped fields
+	CHECK_EQ(parse("{\"txpk\":{\"note\":\"say \\\"hi\\\", }\",\"data\":\"\\/\\/8=\"}}"), TXPK_OK);
+	CHECK_EQ(t.dataLen, 2);
+	CHECK_EQ(t.data[0], 0xFF);
+	CHECK_EQ(t.data[1], 0xFF);
+
+	// Base64 with and without padding, and broken padding
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YWJjZA\"}}"), TXPK_OK);		// No padding (gBase64 style)
+	CHECK(dataIs("abcd"));
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YWJjZA==\"}}"), TXPK_OK);
+	CHECK(dataIs("abcd"));
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.dataLen, 0);
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YWJjZA=\"}}"), TXPK_ERR_BASE64);	// Padding too short
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YWJjZ===\"}}"), TXPK_ERR_BASE64);	// Too much padding
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YWJjZ\"}}"), TXPK_ERR_BASE64);		// 6 bits left over
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YQ==YWJj\"}}"), TXPK_ERR_BASE64);	// Data after padding
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"=YWJ\"}}"), TXPK_ERR_BASE64);
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YW Jj\"}}"), TXPK_ERR_BASE64);
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YW*j\"}}"), TXPK_ERR_BASE64);
+
+	// Payload size limit
+	char big[1024];
+	strcpy(big, "{\"txpk\":{\"data\":\"");
+	for (int i = 0; i < 85; i++) strcat(big, "AAAA");					// 255 bytes
+	strcat(big, "\"}}");
+	CHECK_EQ(parse(big), TXPK_OK);
+	CHECK_EQ(t.dataLen, 255);
+	big[strlen(big) - 3] = 0;
+	strcat(big, "AAAA\"}}");											// 258 bytes
+	CHECK_EQ(parse(big), TXPK_ERR_SIZE);
+
+	// datr at the SF and BW limits. Out of range values are parsed as given
+	// and rejected by sendPacket(); numbers that overflow give 0.
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF7BW125\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 7);
+	CHECK_EQ(t.bw, 125);
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF12BW500\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 12);
+	CHECK_EQ(t.bw, 500);
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF6BW125\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 6);
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF13BW62\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 13);
+	CHECK_EQ(t.bw, 62);
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF263BW125\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 0);																// Not SF7
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF7BW65661\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.bw, 0);																// Not BW125
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SFBW125\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.sf, 0);
+	CHECK_EQ(parse("{\"txpk\":{\"datr\":\"SF9\",\"data\":\"\"}}"), TXPK_OK);
+	CHECK_EQ(t.bw, 0);
+
+	// FSK
+	CHECK_EQ(parse("{\"txpk\":{\"modu\":\"FSK\",\"datr\":50000,\"fdev\":3000,\"data\":\"YQ==\"}}"), TXPK_ERR_MODU);
+
+	// Syntax errors
+	CHECK_EQ(parse(""), TXPK_ERR_SYNTAX);
+	CHECK_EQ(parse("[]"), TXPK_ERR_SYNTAX);
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YQ==\""), TXPK_ERR_SYNTAX);		// Truncated
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YQ==}}"), TXPK_ERR_SYNTAX);		// Open string
+	CHECK_EQ(parse("{\"txpk\":{\"tmst\":abc,\"data\":\"YQ==\"}}"), TXPK_ERR_SYNTAX);
+	CHECK_EQ(parse("{\"txpk\":{\"imme\":1,\"data\":\"YQ==\"}}"), TXPK_ERR_SYNTAX);
+	CHECK_EQ(parse("{\"txpk\":{\"data\" \"YQ==\"}}"), TXPK_ERR_SYNTAX);
+	CHECK_EQ(parse("{\"txpk\":{\"data\":\"YQ==\";\"tmst\":1}}"), TXPK_ERR_SYNTAX);
+
+	return(checkResult("test_txpk"));
+}